@@ -1,54 +1,110 @@
 package com.rnwhisper;
 
+import android.content.res.AssetFileDescriptor;
+import android.content.res.Resources;
 import android.util.Log;
 
-import java.io.ByteArrayOutputStream;
-import java.io.File;
 import java.io.IOException;
 import java.io.InputStream;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
-import java.nio.ShortBuffer;
+import java.nio.channels.Channels;
+import java.nio.channels.ReadableByteChannel;
 import java.util.Base64;
 
-import java.util.Arrays;
-
+// The audio is only held twice at most: by its source and by the direct buffer native code reads
 public class AudioUtils {
   private static final String NAME = "RNWhisperAudioUtils";
 
-  private static float[] bufferToFloatArray(byte[] buffer, Boolean cutHeader) {
-    ByteBuffer byteBuffer = ByteBuffer.wrap(buffer);
-    byteBuffer.order(ByteOrder.LITTLE_ENDIAN);
-    ShortBuffer shortBuffer = byteBuffer.asShortBuffer();
-    short[] shortArray = new short[shortBuffer.limit()];
-    shortBuffer.get(shortArray);
-    if (cutHeader) {
-      shortArray = Arrays.copyOfRange(shortArray, 44, shortArray.length);
-    }
-    float[] floatArray = new float[shortArray.length];
-    for (int i = 0; i < shortArray.length; i++) {
-      floatArray[i] = ((float) shortArray[i]) / 32767.0f;
-      floatArray[i] = Math.max(floatArray[i], -1f);
-      floatArray[i] = Math.min(floatArray[i], 1f);
-    }
-    return floatArray;
+  private static final String WAV_BASE64_PREFIX = "data:audio/wav;base64,";
+
+  // Native code reads the audio straight from the buffer memory (GetDirectBufferAddress)
+  private static ByteBuffer allocateDirect(long size) throws IOException {
+    if (size > Integer.MAX_VALUE) {
+      throw new IOException("Audio is too large: " + size + " bytes");
+    }
+    ByteBuffer buffer = ByteBuffer.allocateDirect((int) size);
+    buffer.order(ByteOrder.LITTLE_ENDIAN);
+    return buffer;
+  }
+
+  // Stream into a direct buffer, sized from length if it is known (>= 0) or grown as needed otherwise
+  private static ByteBuffer readToDirectBuffer(InputStream inputStream, long length) throws IOException {
+    ReadableByteChannel channel = Channels.newChannel(inputStream);
+    ByteBuffer buffer = allocateDirect(length >= 0 ? length : 1 << 16);
+    while (true) {
+      if (!buffer.hasRemaining()) {
+        if (length >= 0) break;
+        ByteBuffer grown = allocateDirect((long) buffer.capacity() * 2);
+        buffer.flip();
+        grown.put(buffer);
+        buffer = grown;
+      }
+      if (channel.read(buffer) < 0) break;
+    }
+    buffer.flip();
+    // Native code reads the whole capacity, trim it to what was read
+    return buffer.limit() == buffer.capacity() ? buffer : buffer.slice().order(ByteOrder.LITTLE_ENDIAN);
+  }
+
+  public static ByteBuffer readResourceToDirectBuffer(Resources resources, int resId) throws IOException {
+    long length = -1;
+    try (AssetFileDescriptor fd = resources.openRawResourceFd(resId)) {
+      length = fd.getLength();
+    } catch (Resources.NotFoundException e) {
+      // Compressed in the APK, the length is unknown until it is read
+      Log.d(NAME, "Raw resource is compressed, reading it without a known length");
+    }
+    try (InputStream inputStream = resources.openRawResource(resId)) {
+      return readToDirectBuffer(inputStream, length);
+    }
+  }
+
+  // The base64 characters of a string as an ASCII stream, without copying the string
+  private static class Base64CharStream extends InputStream {
+    private final String data;
+    private int pos;
+
+    Base64CharStream(String data, int pos) {
+      this.data = data;
+      this.pos = pos;
+    }
+
+    @Override
+    public int read() {
+      return pos < data.length() ? data.charAt(pos++) & 0xff : -1;
+    }
+
+    @Override
+    public int read(byte[] b, int off, int len) {
+      if (len == 0) return 0;
+      if (pos >= data.length()) return -1;
+      int n = Math.min(len, data.length() - pos);
+      for (int i = 0; i < n; i++) {
+        b[off + i] = (byte) data.charAt(pos++);
+      }
+      return n;
+    }
   }
 
-  public static float[] decodeWaveFile(InputStream inputStream) throws IOException {
-    ByteArrayOutputStream baos = new ByteArrayOutputStream();
-    byte[] buffer = new byte[1024];
-    int bytesRead;
-    while ((bytesRead = inputStream.read(buffer)) != -1) {
-      baos.write(buffer, 0, bytesRead);
+  // Decode straight into a direct buffer sized from the base64 length
+  private static ByteBuffer decodeToDirectBuffer(String dataBase64, int begin) throws IOException {
+    int end = dataBase64.length();
+    int padding = 0;
+    while (end - padding > begin && padding < 2 && dataBase64.charAt(end - padding - 1) == '=') {
+      padding++;
     }
-    return bufferToFloatArray(baos.toByteArray(), true);
+    long size = (long) (end - begin) / 4 * 3 - padding;
+    int tail = (end - begin) % 4;
+    if (tail > 1) size += tail - 1;
+    return readToDirectBuffer(Base64.getDecoder().wrap(new Base64CharStream(dataBase64, begin)), Math.max(0, size));
   }
 
-  public static float[] decodeWaveData(String dataBase64) throws IOException {
-    return bufferToFloatArray(Base64.getDecoder().decode(dataBase64), true);
+  public static ByteBuffer decodeWaveData(String dataBase64) throws IOException {
+    return decodeToDirectBuffer(dataBase64, dataBase64.startsWith(WAV_BASE64_PREFIX) ? WAV_BASE64_PREFIX.length() : 0);
   }
 
-  public static float[] decodePcmData(String dataBase64) {
-    return bufferToFloatArray(Base64.getDecoder().decode(dataBase64), false);
+  public static ByteBuffer decodePcmData(String dataBase64) throws IOException {
+    return decodeToDirectBuffer(dataBase64, 0);
   }
 }
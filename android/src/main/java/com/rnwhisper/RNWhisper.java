@@ -6,6 +6,8 @@ import android.os.Build;
 import android.os.Handler;
 import android.os.AsyncTask;
 import android.media.AudioRecord;
+import android.content.ComponentCallbacks2;
+import android.content.res.Configuration;
 
 import com.facebook.react.bridge.Promise;
 import com.facebook.react.bridge.ReactApplicationContext;
@@ -21,8 +23,9 @@ import java.io.File;
 import java.io.FileInputStream;
 import java.io.InputStream;
 import java.io.PushbackInputStream;
+import java.nio.ByteBuffer;
 
-public class RNWhisper implements LifecycleEventListener {
+public class RNWhisper implements LifecycleEventListener, ComponentCallbacks2 {
   public static final String NAME = "RNWhisper";
 
   private ReactApplicationContext reactContext;
@@ -30,6 +33,7 @@ public class RNWhisper implements LifecycleEventListener {
 
   public RNWhisper(ReactApplicationContext reactContext) {
     reactContext.addLifecycleEventListener(this);
+    reactContext.registerComponentCallbacks(this);
     this.reactContext = reactContext;
     this.downloader = new Downloader(reactContext);
   }
@@ -120,7 +124,16 @@ public class RNWhisper implements LifecycleEventListener {
     tasks.put(task, "initContext");
   }
 
-  private AsyncTask transcribe(WhisperContext context, double jobId, final float[] audioData, final ReadableMap options, Promise promise) {
+  private interface TranscribeRunner {
+    WritableMap run() throws Exception;
+  }
+
+  // File and data jobs of a context run next to each other and to its realtime session, on their own states
+  private static String transcribeTaskName(double id, double jobId) {
+    return "transcribe-" + (int) id + "-" + (int) jobId;
+  }
+
+  private AsyncTask transcribe(WhisperContext context, double jobId, final TranscribeRunner runner, Promise promise) {
     Log.d("RNWhisper", "Starting transcription for jobId: " + jobId);
     AsyncTask task = new AsyncTask<Void, Void, WritableMap>() {
       private Exception exception;
@@ -129,12 +142,7 @@ public class RNWhisper implements LifecycleEventListener {
       protected WritableMap doInBackground(Void... voids) {
         Log.d("RNWhisper", "Transcribing audio data for jobId: " + jobId);
         try {
-          Log.d("RNWhisper", "Starting transcription for jobId: " + jobId + " with " + audioData.length + " samples.");
-          return context.transcribe(
-            (int) jobId,
-            audioData,
-            options
-          );
+          return runner.run();
         } catch (Exception e) {
           exception = e;
           Log.e("RNWhisper", "Error during transcription: " + e.getMessage());
@@ -164,16 +172,6 @@ public class RNWhisper implements LifecycleEventListener {
       promise.reject("Context not found");
       return;
     }
-    if (context.isCapturing()) {
-      Log.e("RNWhisper", "The context is in realtime transcribe mode");
-      promise.reject("The context is in realtime transcribe mode");
-      return;
-    }
-    if (context.isTranscribing()) {
-      Log.e("RNWhisper", "Context is already transcribing");
-      promise.reject("Context is already transcribing");
-      return;
-    }
 
     String waveFilePath = filePathOrBase64;
     try {
@@ -183,20 +181,22 @@ public class RNWhisper implements LifecycleEventListener {
         Log.d("RNWhisper", "Downloaded file to: " + waveFilePath);
       }
 
-      float[] audioData;
+      final String filePath = waveFilePath;
+      TranscribeRunner runner;
       int resId = getResourceIdentifier(waveFilePath);
       if (resId > 0) {
-        audioData = AudioUtils.decodeWaveFile(reactContext.getResources().openRawResource(resId));
+        final ByteBuffer audioBuffer = AudioUtils.readResourceToDirectBuffer(reactContext.getResources(), resId);
+        runner = () -> context.transcribeBuffer((int) jobId, audioBuffer, true, options);
       } else if (filePathOrBase64.startsWith("data:audio/wav;base64,")) {
-        audioData = AudioUtils.decodeWaveData(filePathOrBase64);
+        final ByteBuffer audioBuffer = AudioUtils.decodeWaveData(filePathOrBase64);
+        runner = () -> context.transcribeBuffer((int) jobId, audioBuffer, true, options);
       } else {
-        audioData = AudioUtils.decodeWaveFile(new FileInputStream(new File(waveFilePath)));
+        // Decoded natively, the samples never go through the Java heap
+        runner = () -> context.transcribeFile((int) jobId, filePath, options);
       }
-      Log.d("RNWhisper", "Decoded audio data size: " + audioData.length);
 
-
-      AsyncTask task = transcribe(context, jobId, audioData, options, promise);
-      tasks.put(task, "transcribeFile-" + id);
+      AsyncTask task = transcribe(context, jobId, runner, promise);
+      tasks.put(task, transcribeTaskName(id, jobId));
     } catch (Exception e) {
       Log.e("RNWhisper", "Error transcribing file: " + e.getMessage());
       promise.reject(e);
@@ -209,22 +209,12 @@ public class RNWhisper implements LifecycleEventListener {
       promise.reject("Context not found");
       return;
     }
-    if (context.isCapturing()) {
-      Log.e("RNWhisper", "The context is in realtime transcribe mode");
-      promise.reject("The context is in realtime transcribe mode");
-      return;
-    }
-    if (context.isTranscribing()) {
-      Log.e("RNWhisper", "Context is already transcribing");
-      promise.reject("Context is already transcribing");
-      return;
-    }
 
     try {
       Log.d("RNWhisper", "Transcribing data with base64: " + dataBase64.substring(0, Math.min(dataBase64.length(), 100)) + "...");
-      float[] audioData = AudioUtils.decodePcmData(dataBase64);
-      AsyncTask task = transcribe(context, jobId, audioData, options, promise);
-      tasks.put(task, "transcribeData-" + id);
+      final ByteBuffer audioBuffer = AudioUtils.decodePcmData(dataBase64);
+      AsyncTask task = transcribe(context, jobId, () -> context.transcribeBuffer((int) jobId, audioBuffer, false, options), promise);
+      tasks.put(task, transcribeTaskName(id, jobId));
     } catch (Exception e) {
       Log.e("RNWhisper", "Error transcribing data: " + e.getMessage());
       promise.reject(e);
@@ -283,9 +273,8 @@ public class RNWhisper implements LifecycleEventListener {
       protected Void doInBackground(Void... voids) {
         try {
           context.stopTranscribe((int) jobId);
-          AsyncTask completionTask = null;
           for (AsyncTask task : tasks.keySet()) {
-            if (tasks.get(task).equals("transcribeFile-" + id) || tasks.get(task).equals("transcribeData-" + id)) {
+            if (transcribeTaskName(id, jobId).equals(tasks.get(task))) {
               task.get();
               break;
             }
@@ -318,6 +307,15 @@ public class RNWhisper implements LifecycleEventListener {
     promise.resolve(context.bench((int) nThreads));
   }
 
+  public void benchJobs(double id, double nThreads, Promise promise) {
+    final WhisperContext context = contexts.get((int) id);
+    if (context == null) {
+      promise.reject("Context not found");
+      return;
+    }
+    promise.resolve(context.benchJobs((int) nThreads));
+  }
+
   public void releaseContext(double id, Promise promise) {
     final int contextId = (int) id;
     AsyncTask task = new AsyncTask<Void, Void, Void>() {
@@ -331,11 +329,10 @@ public class RNWhisper implements LifecycleEventListener {
             throw new Exception("Context " + id + " not found");
           }
           context.stopCurrentTranscribe();
-          AsyncTask completionTask = null;
           for (AsyncTask task : tasks.keySet()) {
-            if (tasks.get(task).equals("transcribeFile-" + contextId) || tasks.get(task).equals("transcribeData-" + contextId)) {
+            String name = tasks.get(task);
+            if (name != null && name.startsWith("transcribe-" + contextId + "-")) {
               task.get();
-              break;
             }
           }
           context.release();
@@ -394,6 +391,27 @@ public class RNWhisper implements LifecycleEventListener {
   public void onHostPause() {
   }
 
+  @Override
+  public void onTrimMemory(int level) {
+    if (level < ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW) return;
+    for (WhisperContext context : contexts.values()) {
+      context.trimMemory();
+    }
+  }
+
+  @Override
+  public void onLowMemory() {
+    onTrimMemory(ComponentCallbacks2.TRIM_MEMORY_COMPLETE);
+  }
+
+  @Override
+  public void onConfigurationChanged(@NonNull Configuration newConfig) {
+  }
+
+  public void invalidate() {
+    reactContext.unregisterComponentCallbacks(this);
+  }
+
   @Override
   public void onHostDestroy() {
     for (WhisperContext context : contexts.values()) {
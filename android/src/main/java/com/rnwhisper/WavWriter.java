@@ -49,6 +49,22 @@ public class WavWriter {
         }
     }
 
+    // Append count samples from a direct buffer filled by AudioRecord (little-endian 16-bit PCM)
+    public synchronized boolean appendSamples(ByteBuffer samples, int count) {
+        if (!isOpen) return false;
+        try {
+            ByteBuffer bb = samples.duplicate();
+            bb.position(0);
+            bb.limit(count * 2);
+            fos.getChannel().write(bb);
+            totalSamples += count;
+            return true;
+        } catch (IOException e) {
+            e.printStackTrace();
+            return false;
+        }
+    }
+
     public void flush() {
         try {
             if (isOpen) {
@@ -25,8 +25,12 @@ import java.io.IOException;
 import java.io.InputStream;
 import java.io.UnsupportedEncodingException;
 import java.io.PushbackInputStream;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
 import java.nio.charset.StandardCharsets;
 import java.util.Arrays;
+import java.util.Set;
+import java.util.concurrent.ConcurrentHashMap;
 
 import org.json.JSONArray;
 import org.json.JSONObject;
@@ -68,6 +72,10 @@ public class WhisperContext {
   // new fields
   private WavWriter wavWriter = null;
   private int previousVolumeLevel = -1;
+  // File and buffer jobs run on their own states, next to each other and to the realtime session,
+  // the fields above only belong to the realtime session
+  private final Set<Integer> fileJobs = ConcurrentHashMap.newKeySet();
+  private final Set<Integer> stoppedFileJobs = ConcurrentHashMap.newKeySet();
 
   public WhisperContext(int id, ReactApplicationContext reactContext, long context) {
     this.id = id;
@@ -96,10 +104,10 @@ public class WhisperContext {
     return vadSimple(jobId, sliceIndex, nSamples, n);
   }
 
-  private int computeVolumeLevel(short[] buffer, int readSamples) {
+  private int computeVolumeLevel(ByteBuffer buffer, int readSamples) {
       double sum = 0;
       for (int i = 0; i < readSamples; i++) {
-          double sample = buffer[i] / 32768.0;
+          double sample = buffer.getShort(i * 2) / 32768.0;
           sum += sample * sample;
       }
       double rms = Math.sqrt(sum / readSamples);
@@ -200,7 +208,14 @@ public class WhisperContext {
         }
     }
 
-    createRealtimeTranscribeJob(jobId, context, options);
+    if (!createRealtimeTranscribeJob(jobId, context, options)) {
+      recorder.release();
+      if (wavWriter != null) {
+        wavWriter.finalizeWav();
+        wavWriter = null;
+      }
+      return -1;
+    }
 
     sliceNSamples = new ArrayList<Integer>();
     sliceNSamples.add(0);
@@ -212,18 +227,14 @@ public class WhisperContext {
       @Override
       public void run() {
         try {
-          short[] buffer = new short[bufferSize];
+          // Direct buffer, so the native side reads the samples in place
+          ByteBuffer buffer = ByteBuffer.allocateDirect(bufferSize * 2);
+          buffer.order(ByteOrder.nativeOrder());
           Log.d("WhisperContext", "Buffer Size: " + bufferSize);
           while (isCapturing) {
             try {
-              int n = recorder.read(buffer, 0, bufferSize);
-              if (n == 0) continue;
-
-              // Append to WAV file if enabled:
-              if (wavWriter != null) {
-                  wavWriter.appendSamples(buffer, n);
-                  wavWriter.flush();
-              }
+              int n = recorder.read(buffer, bufferSize * 2) / 2;
+              if (n <= 0) continue;
 
               int currentVolume = computeVolumeLevel(buffer, n);
               if (currentVolume != previousVolumeLevel) {
@@ -267,7 +278,16 @@ public class WhisperContext {
                 nSamples = 0;
                 sliceNSamples.add(0);
               }
-              putPcmData(jobId, buffer, sliceIndex, nSamples, n);
+              if (!putPcmData(jobId, buffer, sliceIndex, nSamples, n)) {
+                // Transcription is too far behind, drop the buffer
+                continue;
+              }
+
+              // Append to WAV file if enabled, only the samples that are transcribed
+              if (wavWriter != null) {
+                  wavWriter.appendSamples(buffer, n);
+                  wavWriter.flush();
+              }
 
               boolean isSpeech = vad(sliceIndex, nSamples, n);
 
@@ -335,7 +355,7 @@ public class WhisperContext {
     payload.putInt("sliceIndex", transcribeSliceIndex);
 
     if (code == 0) {
-      payload.putMap("data", getTextSegments(0, getTextSegmentCount(context)));
+      payload.putMap("data", getTextSegments(jobId, isTdrzEnable, 0, getTextSegmentCount(jobId)));
     } else if (code != -999) { // Not aborted
       payload.putString("error", "Transcribe failed with code " + code);
     }
@@ -353,6 +373,8 @@ public class WhisperContext {
     ) {
       transcribeSliceIndex++;
       nSamplesTranscribing = 0;
+      // Give the finished slice back to the capture buffer
+      freeSlice(jobId, transcribeSliceIndex - 1);
     }
 
     boolean continueNeeded = !isCapturing && nSamplesTranscribing != nSamplesOfIndex && code != -999;
@@ -387,7 +409,7 @@ public class WhisperContext {
     eventEmitter.emit(eventName, event);
   }
 
-  private void emitProgress(int progress) {
+  private void emitProgress(int jobId, int progress) {
     WritableMap event = Arguments.createMap();
     event.putInt("contextId", WhisperContext.this.id);
     event.putInt("jobId", jobId);
@@ -395,7 +417,7 @@ public class WhisperContext {
     eventEmitter.emit("@RNWhisper_onTranscribeProgress", event);
   }
 
-  private void emitNewSegments(WritableMap result) {
+  private void emitNewSegments(int jobId, WritableMap result) {
     WritableMap event = Arguments.createMap();
     event.putInt("contextId", WhisperContext.this.id);
     event.putInt("jobId", jobId);
@@ -405,19 +427,23 @@ public class WhisperContext {
 
   private static class Callback {
     WhisperContext context;
+    int jobId;
+    boolean isTdrzEnable = false;
     boolean emitProgressNeeded = false;
     boolean emitNewSegmentsNeeded = false;
     int totalNNew = 0;
 
-    public Callback(WhisperContext context, boolean emitProgressNeeded, boolean emitNewSegmentsNeeded) {
+    public Callback(WhisperContext context, int jobId, boolean isTdrzEnable, boolean emitProgressNeeded, boolean emitNewSegmentsNeeded) {
       this.context = context;
+      this.jobId = jobId;
+      this.isTdrzEnable = isTdrzEnable;
       this.emitProgressNeeded = emitProgressNeeded;
       this.emitNewSegmentsNeeded = emitNewSegmentsNeeded;
     }
 
     void onProgress(int progress) {
       if (!emitProgressNeeded) return;
-      context.emitProgress(progress);
+      context.emitProgress(jobId, progress);
     }
 
     void onNewSegments(int nNew) {
@@ -425,55 +451,61 @@ public class WhisperContext {
       totalNNew += nNew;
       if (!emitNewSegmentsNeeded) return;
 
-      WritableMap result = context.getTextSegments(totalNNew - nNew, totalNNew);
+      WritableMap result = context.getTextSegments(jobId, isTdrzEnable, totalNNew - nNew, totalNNew);
       result.putInt("nNew", nNew);
       result.putInt("totalNNew", totalNNew);
-      context.emitNewSegments(result);
+      context.emitNewSegments(jobId, result);
     }
   }
 
-  public WritableMap transcribe(int jobId, float[] audioData, ReadableMap options) throws IOException, Exception {
-    if (isCapturing || isTranscribing) {
-      throw new Exception("Context is already in capturing or transcribing");
+  private interface FullRunner {
+    int run(Callback callback);
+  }
+
+  // Decode a 16-bit PCM mono WAV file natively
+  public WritableMap transcribeFile(int jobId, String filePath, ReadableMap options) throws IOException, Exception {
+    return transcribe(jobId, options, callback -> fullWithNewJobFile(jobId, context, filePath, options, callback));
+  }
+
+  // Transcribe raw 16-bit PCM, or a whole WAV file if isWav, from a direct buffer
+  public WritableMap transcribeBuffer(int jobId, ByteBuffer audioBuffer, boolean isWav, ReadableMap options) throws IOException, Exception {
+    return transcribe(jobId, options, callback -> fullWithNewJobBuffer(jobId, context, audioBuffer, isWav, options, callback));
+  }
+
+  // Runs next to a realtime session or other file jobs of the context, each job has its own state
+  private WritableMap transcribe(int jobId, ReadableMap options, FullRunner runner) throws IOException, Exception {
+    if (!fileJobs.add(jobId)) {
+      throw new Exception("Job " + jobId + " is already transcribing");
     }
 
     Log.d("WhisperContext", "Transcribing: " + jobId);
-    rewind();
-    this.jobId = jobId;
-    this.isTdrzEnable = options.hasKey("tdrzEnable") && options.getBoolean("tdrzEnable");
-
-    isTranscribing = true;
+    boolean isTdrzEnable = options.hasKey("tdrzEnable") && options.getBoolean("tdrzEnable");
 
     boolean hasProgressCallback = options.hasKey("onProgress") && options.getBoolean("onProgress");
     boolean hasNewSegmentsCallback = options.hasKey("onNewSegments") && options.getBoolean("onNewSegments");
-    int code = fullWithNewJob(
-      jobId,
-      context,
-      // float[] audio_data,
-      audioData,
-      // jint audio_data_len,
-      audioData.length,
-      // ReadableMap options,
-      options,
-      // Callback callback
-      hasProgressCallback || hasNewSegmentsCallback ? new Callback(this, hasProgressCallback, hasNewSegmentsCallback) : null
-    );
-
-    isTranscribing = false;
-    this.jobId = -1;
-    if (code != 0 && code != 999) {
-      throw new Exception("Failed to transcribe the file. Code: " + code);
+    try {
+      int code = runner.run(
+        hasProgressCallback || hasNewSegmentsCallback ? new Callback(this, jobId, isTdrzEnable, hasProgressCallback, hasNewSegmentsCallback) : null
+      );
+      if (code != 0 && code != 999) {
+        throw new Exception("Failed to transcribe the file. Code: " + code);
+      }
+      Log.d("WhisperContext", "Trascribed, now calleing text segments: " + jobId);
+      // The results live in the state of the job, read them before it's removed
+      WritableMap result = getTextSegments(jobId, isTdrzEnable, 0, getTextSegmentCount(jobId));
+      result.putBoolean("isAborted", stoppedFileJobs.contains(jobId));
+      return result;
+    } finally {
+      removeJob(jobId);
+      stoppedFileJobs.remove(jobId);
+      fileJobs.remove(jobId);
     }
-    Log.d("WhisperContext", "Trascribed, now calleing text segments: " + jobId);
-    WritableMap result = getTextSegments(0, getTextSegmentCount(context));
-    result.putBoolean("isAborted", isStoppedByAction);
-    return result;
   }
-  private WritableMap getTextSegments(int start, int count) {
+  private WritableMap getTextSegments(int jobId, boolean isTdrzEnable, int start, int count) {
     Log.d("WhisperContext", "getTextSegments, calling JNIGetSegments: " + start + " " + count);
 
     // Call the JNI method to get the JSON string
-    String jsonString = JNIGetTextSegments(context, start, count, this.isTdrzEnable); 
+    String jsonString = JNIGetTextSegments(jobId, start, count, isTdrzEnable);
     Log.d("WhisperContext", "getTextSegments, got JSON string: " + jsonString);
     // Parse the JSON string into a map or structure
     try {
@@ -591,11 +623,17 @@ public class WhisperContext {
   }
 
   public boolean isTranscribing() {
-    return isTranscribing;
+    return isTranscribing || !fileJobs.isEmpty();
   }
 
   public void stopTranscribe(int jobId) {
     abortTranscribe(jobId);
+    if (fileJobs.contains(jobId)) {
+      // The caller waits for the file job to return
+      stoppedFileJobs.add(jobId);
+      return;
+    }
+    if (jobId != this.jobId) return;
     isCapturing = false;
     isStoppedByAction = true;
     if (rootFullHandler != null) {
@@ -609,6 +647,9 @@ public class WhisperContext {
   }
 
   public void stopCurrentTranscribe() {
+    for (int fileJobId : fileJobs) {
+      stopTranscribe(fileJobId);
+    }
     stopTranscribe(this.jobId);
   }
 
@@ -616,6 +657,15 @@ public class WhisperContext {
     return bench(context, n_threads);
   }
 
+  public String benchJobs(int n_threads) {
+    return benchJobs(context, n_threads);
+  }
+
+  // Free the idle transcription states kept for reuse, they are rebuilt on demand
+  public void trimMemory() {
+    trimStatePool(context);
+  }
+
   public void release() {
     stopCurrentTranscribe();
     freeContext(context);
@@ -689,32 +739,42 @@ public class WhisperContext {
   protected static native long initContextWithAsset(AssetManager assetManager, String modelPath);
   protected static native long initContextWithInputStream(PushbackInputStream inputStream);
   protected static native void freeContext(long contextPtr);
+  protected static native void trimStatePool(long contextPtr);
 
-  protected static native int fullWithNewJob(
+  protected static native int fullWithNewJobBuffer(
+    int job_id,
+    long context,
+    ByteBuffer audio_buffer,
+    boolean is_wav,
+    ReadableMap options,
+    Callback Callback
+  );
+  protected static native int fullWithNewJobFile(
     int job_id,
     long context,
-    float[] audio_data,
-    int audio_data_len,
+    String file_path,
     ReadableMap options,
     Callback Callback
   );
+  protected static native void removeJob(int job_id);
   protected static native void abortTranscribe(int jobId);
   protected static native void abortAllTranscribe();
-  protected static native int getTextSegmentCount(long context);
-  protected static native String getTextSegment(long context, int index);
-  protected static native String JNIGetTextSegments(long contextPtr, int start, int count, boolean tdrzEnable);
-  protected static native int getTextSegmentT0(long context, int index);
-  protected static native int getTextSegmentT1(long context, int index);
-  protected static native boolean getTextSegmentSpeakerTurnNext(long context, int index);
-
-  protected static native void createRealtimeTranscribeJob(
+  protected static native int getTextSegmentCount(int job_id);
+  protected static native String getTextSegment(int job_id, int index);
+  protected static native String JNIGetTextSegments(int job_id, int start, int count, boolean tdrzEnable);
+  protected static native int getTextSegmentT0(int job_id, int index);
+  protected static native int getTextSegmentT1(int job_id, int index);
+  protected static native boolean getTextSegmentSpeakerTurnNext(int job_id, int index);
+
+  protected static native boolean createRealtimeTranscribeJob(
     int job_id,
     long context,
     ReadableMap options
   );
   protected static native void finishRealtimeTranscribeJob(int job_id, long context, int[] sliceNSamples);
   protected static native boolean vadSimple(int job_id, int slice_index, int n_samples, int n);
-  protected static native void putPcmData(int job_id, short[] buffer, int slice_index, int n_samples, int n);
+  protected static native boolean putPcmData(int job_id, ByteBuffer buffer, int slice_index, int n_samples, int n);
+  protected static native void freeSlice(int job_id, int slice_index);
   protected static native int fullWithJob(
     int job_id,
     long context,
@@ -722,4 +782,5 @@ public class WhisperContext {
     int n_samples
   );
   protected static native String bench(long context, int n_threads);
+  protected static native String benchJobs(long context, int n_threads);
 }
@@ -61,6 +61,18 @@ float getFloat(JNIEnv *env, jobject readableMap, const char *key, jfloat default
     return result;
 }
 
+double getDouble(JNIEnv *env, jobject readableMap, const char *key, jdouble defaultValue) {
+    if (!hasKey(env, readableMap, key)) {
+        return defaultValue;
+    }
+    jclass mapClass = env->GetObjectClass(readableMap);
+    jmethodID getDoubleMethod = env->GetMethodID(mapClass, "getDouble", "(Ljava/lang/String;)D");
+    jstring jKey = env->NewStringUTF(key);
+    jdouble result = env->CallDoubleMethod(readableMap, getDoubleMethod, jKey);
+    env->DeleteLocalRef(jKey);
+    return result;
+}
+
 jstring getString(JNIEnv *env, jobject readableMap, const char *key, jstring defaultValue) {
     if (!hasKey(env, readableMap, key)) {
         return defaultValue;
@@ -3,6 +3,8 @@
 #include <android/asset_manager_jni.h>
 #include <android/log.h>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <sys/sysinfo.h>
 #include <string>
 #include <thread>
@@ -26,14 +28,33 @@ static inline int min(int a, int b) {
 }
 
 // Load model from input stream (used for drawable / raw resources)
+// whisper.cpp reads the model on a background I/O thread, so the env is looked up for the calling thread
 struct input_stream_context {
-    JNIEnv *env;
+    JavaVM *vm;
     jobject input_stream;
 };
 
+// Detaches a thread attached by input_stream_env() when it exits
+struct jni_thread_detacher {
+    JavaVM *vm = nullptr;
+    ~jni_thread_detacher() {
+        if (vm) vm->DetachCurrentThread();
+    }
+};
+
+static JNIEnv *input_stream_env(input_stream_context *context) {
+    static thread_local jni_thread_detacher detacher;
+    JNIEnv *env = nullptr;
+    if (context->vm->GetEnv((void **) &env, JNI_VERSION_1_6) == JNI_EDETACHED) {
+        context->vm->AttachCurrentThread(&env, nullptr);
+        detacher.vm = context->vm;
+    }
+    return env;
+}
+
 static size_t input_stream_read(void *ctx, void *output, size_t read_size) {
     input_stream_context *context = (input_stream_context *)ctx;
-    JNIEnv *env = context->env;
+    JNIEnv *env = input_stream_env(context);
     jobject input_stream = context->input_stream;
     jclass input_stream_class = env->GetObjectClass(input_stream);
 
@@ -49,13 +70,14 @@ static size_t input_stream_read(void *ctx, void *output, size_t read_size) {
     }
 
     env->DeleteLocalRef(buffer);
+    env->DeleteLocalRef(input_stream_class);
 
     return bytes_read;
 }
 
 static bool input_stream_is_eof(void *ctx) {
     input_stream_context *context = (input_stream_context *)ctx;
-    JNIEnv *env = context->env;
+    JNIEnv *env = input_stream_env(context);
     jobject input_stream = context->input_stream;
 
     jclass input_stream_class = env->GetObjectClass(input_stream);
@@ -80,13 +102,14 @@ static bool input_stream_is_eof(void *ctx) {
     }
 
     env->DeleteLocalRef(buffer);
+    env->DeleteLocalRef(input_stream_class);
 
     return is_eof;
 }
 
 static void input_stream_close(void *ctx) {
     input_stream_context *context = (input_stream_context *)ctx;
-    JNIEnv *env = context->env;
+    JNIEnv *env = input_stream_env(context);
     jobject input_stream = context->input_stream;
     jclass input_stream_class = env->GetObjectClass(input_stream);
 
@@ -95,7 +118,9 @@ static void input_stream_close(void *ctx) {
         env->GetMethodID(input_stream_class, "close", "()V")
     );
 
+    env->DeleteLocalRef(input_stream_class);
     env->DeleteGlobalRef(input_stream);
+    delete context;
 }
 
 static struct whisper_context *whisper_init_from_input_stream(
@@ -104,7 +129,7 @@ static struct whisper_context *whisper_init_from_input_stream(
     struct whisper_context_params cparams
 ) {
     input_stream_context *context = new input_stream_context;
-    context->env = env;
+    env->GetJavaVM(&context->vm);
     context->input_stream = env->NewGlobalRef(input_stream);
 
     whisper_model_loader loader = {
@@ -157,7 +182,7 @@ JNIEXPORT jlong JNICALL
 Java_com_rnwhisper_WhisperContext_initContext(
         JNIEnv *env, jobject thiz, jstring model_path_str) {
     UNUSED(thiz);
-    struct whisper_context_params cparams;
+    struct whisper_context_params cparams = whisper_context_default_params();
     cparams.dtw_token_timestamps = false;
 
     struct whisper_context *context = nullptr;
@@ -175,7 +200,7 @@ Java_com_rnwhisper_WhisperContext_initContextWithAsset(
     jstring model_path_str
 ) {
     UNUSED(thiz);
-    struct whisper_context_params cparams;
+    struct whisper_context_params cparams = whisper_context_default_params();
     cparams.dtw_token_timestamps = false;
 
     struct whisper_context *context = nullptr;
@@ -192,7 +217,7 @@ Java_com_rnwhisper_WhisperContext_initContextWithInputStream(
     jobject input_stream
 ) {
     UNUSED(thiz);
-    struct whisper_context_params cparams;
+    struct whisper_context_params cparams = whisper_context_default_params();
     cparams.dtw_token_timestamps = false;
 
     struct whisper_context *context = nullptr;
@@ -214,9 +239,14 @@ struct whisper_full_params createFullParams(JNIEnv *env, jobject options) {
     int default_n_threads = max_threads == 4 ? 2 : min(4, max_threads);
     int n_threads = readablemap::getInt(env, options, "maxThreads", default_n_threads);
     params.n_threads = n_threads > 0 ? n_threads : default_n_threads;
+    params.use_threadpool = readablemap::getBool(env, options, "useThreadPool", true);
+    // JS numbers are doubles, an int would drop the cores above 31
+    double cpu_mask = readablemap::getDouble(env, options, "cpuMask", 0);
+    params.cpu_mask = cpu_mask > 0 && cpu_mask < 18446744073709551616.0 ? (uint64_t) cpu_mask : 0;
     params.translate = readablemap::getBool(env, options, "translate", false);
     params.token_timestamps = readablemap::getBool(env, options, "tokenTimestamps", false);
     params.tdrz_enable = readablemap::getBool(env, options, "tdrzEnable", false);
+    params.audio_ctx_auto = readablemap::getBool(env, options, "audioCtxAuto", false);
     params.offset_ms = 0;
     params.no_context = true;
     params.single_segment = false;
@@ -236,12 +266,18 @@ struct whisper_full_params createFullParams(JNIEnv *env, jobject options) {
     if (offset > -1) params.offset_ms = offset;
     int duration = readablemap::getInt(env, options, "duration", -1);
     if (duration > -1) params.duration_ms = duration;
+    int parallel_overlap = readablemap::getInt(env, options, "parallelOverlapMs", -1);
+    if (parallel_overlap > -1) params.parallel_overlap_ms = parallel_overlap;
     int word_thold = readablemap::getInt(env, options, "wordThold", -1);
     if (word_thold > -1) params.thold_pt = word_thold;
     float temperature = readablemap::getFloat(env, options, "temperature", -1);
     if (temperature > -1) params.temperature = temperature;
     float temperature_inc = readablemap::getFloat(env, options, "temperatureInc", -1);
     if (temperature_inc > -1) params.temperature_inc = temperature_inc;
+    int top_k = readablemap::getInt(env, options, "topK", -1);
+    if (top_k > -1) params.top_k = top_k;
+    float top_p = readablemap::getFloat(env, options, "topP", -1);
+    if (top_p > -1) params.top_p = top_p;
     jstring prompt = readablemap::getString(env, options, "prompt", nullptr);
     if (prompt != nullptr) {
         params.initial_prompt = env->GetStringUTFChars(prompt, nullptr);
@@ -260,27 +296,25 @@ struct callback_context {
     jobject callback_instance;
 };
 
-JNIEXPORT jint JNICALL
-Java_com_rnwhisper_WhisperContext_fullWithNewJob(
+// Runs a one-shot transcription job on its own state, run() is given the job with the params built from options
+// The job keeps the results until Java removes it with removeJob()
+static int full_with_new_job(
     JNIEnv *env,
-    jobject thiz,
     jint job_id,
     jlong context_ptr,
-    jfloatArray audio_data,
-    jint audio_data_len,
     jobject options,
-    jobject callback_instance
+    jobject callback_instance,
+    const std::function<int(rnwhisper::job *)> &run
 ) {
-    UNUSED(thiz);
     struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
-    jfloat *audio_data_arr = env->GetFloatArrayElements(audio_data, nullptr);
 
     LOGI("About to create params");
 
     whisper_full_params params = createFullParams(env, options);
 
+    callback_context *cb_ctx = nullptr;
     if (callback_instance != nullptr) {
-        callback_context *cb_ctx = new callback_context;
+        cb_ctx = new callback_context;
         cb_ctx->env = env;
         cb_ctx->callback_instance = env->NewGlobalRef(callback_instance);
 
@@ -305,24 +339,106 @@ Java_com_rnwhisper_WhisperContext_fullWithNewJob(
         params.new_segment_callback_user_data = cb_ctx;
     }
 
-    rnwhisper::job* job = rnwhisper::job_new(job_id, params);
+    int code = -1;
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_new(job_id, context, params);
+    if (job != nullptr) {
+        LOGI("About to run whisper_full");
+        code = run(job.get());
+        if (job->is_aborted()) code = -999;
+    }
 
-    LOGI("About to reset timings");
-    whisper_reset_timings(context);
+    if (cb_ctx != nullptr) {
+        env->DeleteGlobalRef(cb_ctx->callback_instance);
+        delete cb_ctx;
+    }
+    return code;
+}
 
-    LOGI("About to run whisper_full");
-    int code = whisper_full(context, params, audio_data_arr, audio_data_len);
-    if (code == 0) {
-        // whisper_print_timings(context);
+// Transcribe 16-bit PCM (or a whole WAV file if is_wav) held in a direct ByteBuffer, without copying it
+JNIEXPORT jint JNICALL
+Java_com_rnwhisper_WhisperContext_fullWithNewJobBuffer(
+    JNIEnv *env,
+    jobject thiz,
+    jint job_id,
+    jlong context_ptr,
+    jobject audio_buffer,
+    jboolean is_wav,
+    jobject options,
+    jobject callback_instance
+) {
+    UNUSED(thiz);
+    const uint8_t *data = (const uint8_t *) env->GetDirectBufferAddress(audio_buffer);
+    const jlong size = env->GetDirectBufferCapacity(audio_buffer);
+    if (data == nullptr || size < 0) {
+        LOGE("Audio buffer is not a direct buffer");
+        return -1;
     }
-    env->ReleaseFloatArrayElements(audio_data, audio_data_arr, JNI_ABORT);
 
-    if (job->is_aborted()) code = -999;
-    rnwhisper::job_remove(job_id);
-    return code;
+    rnaudioutils::WavInfo info;
+    info.dataSize = (size_t) size & ~(size_t) 1;
+    if (is_wav && !rnaudioutils::parseWav(data, (size_t) size, info)) {
+        return -1;
+    }
+
+    std::vector<short> aligned;
+    const short *samples = (const short *) (data + info.dataOffset);
+    const int n_samples = (int) (info.dataSize / sizeof(short));
+    if (info.dataOffset % alignof(short) != 0) {
+        aligned.resize(n_samples);
+        memcpy(aligned.data(), data + info.dataOffset, info.dataSize);
+        samples = aligned.data();
+    }
+
+    const int n_processors = readablemap::getInt(env, options, "nProcessors", 1);
+    return full_with_new_job(env, job_id, context_ptr, options, callback_instance, [&](rnwhisper::job *job) {
+        if (n_processors > 1) {
+            return whisper_full_i16_parallel_with_state(job->ctx, job->state, job->params, samples, n_samples, n_processors);
+        }
+        return whisper_full_i16_with_state(job->ctx, job->state, job->params, samples, n_samples);
+    });
+}
+
+// Map a WAV file natively, the samples never go through the Java heap
+JNIEXPORT jint JNICALL
+Java_com_rnwhisper_WhisperContext_fullWithNewJobFile(
+    JNIEnv *env,
+    jobject thiz,
+    jint job_id,
+    jlong context_ptr,
+    jstring file_path,
+    jobject options,
+    jobject callback_instance
+) {
+    UNUSED(thiz);
+    const char *file_path_chars = env->GetStringUTFChars(file_path, nullptr);
+    rnaudioutils::WavFileMap wav;
+    bool ok = wav.open(file_path_chars);
+    env->ReleaseStringUTFChars(file_path, file_path_chars);
+    if (!ok) return -1;
+
+    // The file is mapped and transcribed window by window, long files don't need to fit in memory
+    // With nProcessors > 1, the chunks of the mapped file are transcribed in parallel instead
+    const int n_processors = readablemap::getInt(env, options, "nProcessors", 1);
+    return full_with_new_job(env, job_id, context_ptr, options, callback_instance, [&](rnwhisper::job *job) {
+        if (n_processors > 1) {
+            return whisper_full_i16_parallel_with_state(job->ctx, job->state, job->params, wav.samples(), wav.nSamples(), n_processors);
+        }
+        return whisper_full_i16_windowed_with_state(job->ctx, job->state, job->params, wav.samples(), wav.nSamples());
+    });
 }
 
 JNIEXPORT void JNICALL
+Java_com_rnwhisper_WhisperContext_removeJob(
+    JNIEnv *env,
+    jobject thiz,
+    jint job_id
+) {
+    UNUSED(env);
+    UNUSED(thiz);
+    rnwhisper::job_remove(job_id);
+}
+
+JNIEXPORT jboolean JNICALL
 Java_com_rnwhisper_WhisperContext_createRealtimeTranscribeJob(
     JNIEnv *env,
     jobject thiz,
@@ -330,8 +446,12 @@ Java_com_rnwhisper_WhisperContext_createRealtimeTranscribeJob(
     jlong context_ptr,
     jobject options
 ) {
+    UNUSED(thiz);
+    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
+
     whisper_full_params params = createFullParams(env, options);
-    rnwhisper::job* job = rnwhisper::job_new(job_id, params);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_new(job_id, context, params);
+    if (job == nullptr) return false;
     rnwhisper::vad_params vad;
     vad.use_vad = readablemap::getBool(env, options, "useVad", false);
     vad.vad_ms = readablemap::getInt(env, options, "vadMs", 2000);
@@ -351,6 +471,7 @@ Java_com_rnwhisper_WhisperContext_createRealtimeTranscribeJob(
         readablemap::getFloat(env, options, "realtimeAudioMinSec", 0),
         audio_output_path_str
     );
+    return true;
 }
 
 JNIEXPORT void JNICALL
@@ -365,8 +486,8 @@ Java_com_rnwhisper_WhisperContext_finishRealtimeTranscribeJob(
     UNUSED(thiz);
     UNUSED(context_ptr);
 
-    rnwhisper::job *job = rnwhisper::job_get(job_id);
-    if (job->audio_output_path != nullptr) {
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job != nullptr && job->audio_output_path != nullptr) {
         RNWHISPER_LOG_INFO("job->params.language: %s\n", job->params.language);
         std::vector<int> slice_n_samples_vec;
         jint *slice_n_samples_arr = env->GetIntArrayElements(slice_n_samples, nullptr);
@@ -386,25 +507,41 @@ Java_com_rnwhisper_WhisperContext_vadSimple(
     jint n
 ) {
     UNUSED(thiz);
-    rnwhisper::job* job = rnwhisper::job_get(job_id);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job == nullptr) return false;
     return job->vad_simple(slice_index, n_samples, n);
 }
 
-JNIEXPORT void JNICALL
+JNIEXPORT jboolean JNICALL
 Java_com_rnwhisper_WhisperContext_putPcmData(
     JNIEnv *env,
     jobject thiz,
     jint job_id,
-    jshortArray pcm,
+    jobject pcm,
     jint slice_index,
     jint n_samples,
     jint n
 ) {
     UNUSED(thiz);
-    rnwhisper::job* job = rnwhisper::job_get(job_id);
-    jshort *pcm_arr = env->GetShortArrayElements(pcm, nullptr);
-    job->put_pcm_data(pcm_arr, slice_index, n_samples, n);
-    env->ReleaseShortArrayElements(pcm, pcm_arr, JNI_ABORT);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job == nullptr) return false;
+    short *pcm_arr = (short *) env->GetDirectBufferAddress(pcm);
+    if (pcm_arr == nullptr) return false;
+    return job->put_pcm_data(pcm_arr, slice_index, n_samples, n);
+}
+
+JNIEXPORT void JNICALL
+Java_com_rnwhisper_WhisperContext_freeSlice(
+    JNIEnv *env,
+    jobject thiz,
+    jint job_id,
+    jint slice_index
+) {
+    UNUSED(env);
+    UNUSED(thiz);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job == nullptr) return;
+    job->free_slice(slice_index);
 }
 
 JNIEXPORT jint JNICALL
@@ -417,15 +554,11 @@ Java_com_rnwhisper_WhisperContext_fullWithJob(
     jint n_samples
 ) {
     UNUSED(thiz);
-    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
+    UNUSED(context_ptr);
 
-    rnwhisper::job* job = rnwhisper::job_get(job_id);
-    float* pcmf32 = job->pcm_slice_to_f32(slice_index, n_samples);
-    int code = whisper_full(context, job->params, pcmf32, n_samples);
-    free(pcmf32);
-    if (code == 0) {
-        // whisper_print_timings(context);
-    }
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job == nullptr) return -1;
+    int code = job->transcribe_slice(slice_index, n_samples);
     if (job->is_aborted()) code = -999;
     return code;
 }
@@ -437,8 +570,7 @@ Java_com_rnwhisper_WhisperContext_abortTranscribe(
     jint job_id
 ) {
     UNUSED(thiz);
-    rnwhisper::job *job = rnwhisper::job_get(job_id);
-    if (job) job->abort();
+    rnwhisper::job_abort(job_id);
 }
 
 JNIEXPORT void JNICALL
@@ -450,21 +582,24 @@ Java_com_rnwhisper_WhisperContext_abortAllTranscribe(
     rnwhisper::job_abort_all();
 }
 
+// The results are read from the state of the job, it must not be removed yet
 JNIEXPORT jint JNICALL
 Java_com_rnwhisper_WhisperContext_getTextSegmentCount(
-        JNIEnv *env, jobject thiz, jlong context_ptr) {
+        JNIEnv *env, jobject thiz, jint job_id) {
     UNUSED(env);
     UNUSED(thiz);
-    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
-    return whisper_full_n_segments(context);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job == nullptr) return 0;
+    return whisper_full_n_segments_from_state(job->state);
 }
 
 JNIEXPORT jstring JNICALL
 Java_com_rnwhisper_WhisperContext_getTextSegment(
-        JNIEnv *env, jobject thiz, jlong context_ptr, jint index) {
+        JNIEnv *env, jobject thiz, jint job_id, jint index) {
     UNUSED(thiz);
-    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
-    const char *text = whisper_full_get_segment_text(context, index);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job == nullptr) return nullptr;
+    const char *text = whisper_full_get_segment_text_from_state(job->state, index);
     jstring string = env->NewStringUTF(text);
     return string;
 }
@@ -583,13 +718,15 @@ bool isValidUtf8(const std::vector<char>& buffer) {
 
 JNIEXPORT jstring JNICALL
 Java_com_rnwhisper_WhisperContext_JNIGetTextSegments(
-    JNIEnv *env, jobject thiz, jlong context_ptr, jint start, jint count, jboolean tdrzEnable) {
+    JNIEnv *env, jobject thiz, jint job_id, jint start, jint count, jboolean tdrzEnable) {
 
     LOGI("JNIGetTextSegments: Start");
 
     UNUSED(thiz);
 
-    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    struct whisper_state *state = job != nullptr ? job->state : nullptr;
+    if (state == nullptr) count = 0;
     std::vector<Segment> segments;
 
     std::vector<char> tempData;  // Buffer for raw text data
@@ -599,7 +736,7 @@ Java_com_rnwhisper_WhisperContext_JNIGetTextSegments(
     for (int i = start; i < start + count; i++) {
         LOGI("JNIGetTextSegments: Processing segment %d", i);
 
-        const char *text = whisper_full_get_segment_text(context, i);
+        const char *text = whisper_full_get_segment_text_from_state(state, i);
         if (text == NULL || strlen(text) == 0) {
             LOGW("JNIGetTextSegments: Skipping empty or NULL text in segment %d", i);
             continue;
@@ -619,11 +756,11 @@ Java_com_rnwhisper_WhisperContext_JNIGetTextSegments(
             Segment segment;
             segment.text = validText;
             LOGI("JNIGetTextSegments: Text for segment %d: %s", i, segment.text.c_str());
-            segment.t0 = whisper_full_get_segment_t0(context, i);
-            segment.t1 = whisper_full_get_segment_t1(context, i);
+            segment.t0 = whisper_full_get_segment_t0_from_state(state, i);
+            segment.t1 = whisper_full_get_segment_t1_from_state(state, i);
 
             // Handle speaker turn if enabled
-            if (tdrzEnable && whisper_full_get_segment_speaker_turn_next(context, i)) {
+            if (tdrzEnable && whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 segment.text += " [SPEAKER_TURN]";
                 combinedText += " [SPEAKER_TURN]";
             }
@@ -649,20 +786,22 @@ Java_com_rnwhisper_WhisperContext_JNIGetTextSegments(
 
 JNIEXPORT jint JNICALL
 Java_com_rnwhisper_WhisperContext_getTextSegmentT0(
-        JNIEnv *env, jobject thiz, jlong context_ptr, jint index) {
+        JNIEnv *env, jobject thiz, jint job_id, jint index) {
     UNUSED(env);
     UNUSED(thiz);
-    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
-    return whisper_full_get_segment_t0(context, index);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job == nullptr) return 0;
+    return whisper_full_get_segment_t0_from_state(job->state, index);
 }
 
 JNIEXPORT jint JNICALL
 Java_com_rnwhisper_WhisperContext_getTextSegmentT1(
-        JNIEnv *env, jobject thiz, jlong context_ptr, jint index) {
+        JNIEnv *env, jobject thiz, jint job_id, jint index) {
     UNUSED(env);
     UNUSED(thiz);
-    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
-    return whisper_full_get_segment_t1(context, index);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job == nullptr) return 0;
+    return whisper_full_get_segment_t1_from_state(job->state, index);
 }
 
 JNIEXPORT void JNICALL
@@ -674,13 +813,23 @@ Java_com_rnwhisper_WhisperContext_freeContext(
     whisper_free(context);
 }
 
+JNIEXPORT void JNICALL
+Java_com_rnwhisper_WhisperContext_trimStatePool(
+        JNIEnv *env, jobject thiz, jlong context_ptr) {
+    UNUSED(env);
+    UNUSED(thiz);
+    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
+    whisper_state_pool_trim(context, 0);
+}
+
 JNIEXPORT jboolean JNICALL
 Java_com_rnwhisper_WhisperContext_getTextSegmentSpeakerTurnNext(
-        JNIEnv *env, jobject thiz, jlong context_ptr, jint index) {
+        JNIEnv *env, jobject thiz, jint job_id, jint index) {
     UNUSED(env);
     UNUSED(thiz);
-    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
-    return whisper_full_get_segment_speaker_turn_next(context, index);
+    std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(job_id);
+    if (job == nullptr) return false;
+    return whisper_full_get_segment_speaker_turn_next_from_state(job->state, index);
 }
 
 JNIEXPORT jstring JNICALL
@@ -696,4 +845,17 @@ Java_com_rnwhisper_WhisperContext_bench(
     return env->NewStringUTF(result.c_str());
 }
 
+JNIEXPORT jstring JNICALL
+Java_com_rnwhisper_WhisperContext_benchJobs(
+    JNIEnv *env,
+    jobject thiz,
+    jlong context_ptr,
+    jint n_threads
+) {
+    UNUSED(thiz);
+    struct whisper_context *context = reinterpret_cast<struct whisper_context *>(context_ptr);
+    std::string result = rnwhisper::bench_jobs(context, n_threads);
+    return env->NewStringUTF(result.c_str());
+}
+
 } // extern "C"
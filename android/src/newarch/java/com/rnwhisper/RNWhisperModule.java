@@ -33,6 +33,12 @@ public class RNWhisperModule extends NativeRNWhisperSpec {
     return NAME;
   }
 
+  @Override
+  public void invalidate() {
+    super.invalidate();
+    rnwhisper.invalidate();
+  }
+
   @Override
   public HashMap<String, Object> getTypedExportedConstants() {
     return rnwhisper.getTypedExportedConstants();
@@ -97,6 +103,11 @@ public class RNWhisperModule extends NativeRNWhisperSpec {
     rnwhisper.bench(id, nThreads, promise);
   }
 
+  @ReactMethod
+  public void benchJobs(double id, double nThreads, Promise promise) {
+    rnwhisper.benchJobs(id, nThreads, promise);
+  }
+
   @ReactMethod
   public void releaseContext(double id, Promise promise) {
     rnwhisper.releaseContext(id, promise);
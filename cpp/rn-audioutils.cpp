@@ -1,10 +1,215 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "rn-audioutils.h"
 #include "rn-whisper-log.h"
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #define WHISPER_SAMPLE_RATE 16000
 
 namespace rnaudioutils {
 
+void pcm_i16_to_f32(const short *src, float *dst, size_t n) {
+    const float scale = 1.0f / 32768.0f;
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    for (; i + 8 <= n; i += 8) {
+        const int16x8_t x = vld1q_s16(src + i);
+        vst1q_f32(dst + i,     vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))),  scale));
+        vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), scale));
+    }
+#elif defined(__AVX2__)
+    const __m256 vscale = _mm256_set1_ps(scale);
+    for (; i + 8 <= n; i += 8) {
+        const __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), vscale));
+    }
+#elif defined(__SSE2__)
+    const __m128 vscale = _mm_set1_ps(scale);
+    for (; i + 8 <= n; i += 8) {
+        const __m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+        // sign-extend by placing each sample in the upper half of a 32-bit lane and shifting back
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(dst + i,     _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] = (float) src[i] * scale;
+    }
+}
+
+float sum_abs_f32(const float *x, size_t n) {
+    float sum = 0.0f;
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vaddq_f32(acc0, vabsq_f32(vld1q_f32(x + i)));
+        acc1 = vaddq_f32(acc1, vabsq_f32(vld1q_f32(x + i + 4)));
+    }
+    const float32x4_t acc = vaddq_f32(acc0, acc1);
+    sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#elif defined(__AVX2__)
+    const __m256 vabs = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_add_ps(acc, _mm256_and_ps(_mm256_loadu_ps(x + i), vabs));
+    }
+    const __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc4);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+    const __m128 vabs = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_and_ps(_mm_loadu_ps(x + i),     vabs));
+        acc1 = _mm_add_ps(acc1, _mm_and_ps(_mm_loadu_ps(x + i + 4), vabs));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    for (; i < n; i++) {
+        sum += fabsf(x[i]);
+    }
+    return sum;
+}
+
+// Walk the RIFF chunks until "data", read_at(offset, dst, n) reads n bytes at offset
+static bool parseWavChunks(size_t totalSize, const std::function<bool(size_t, void *, size_t)> &read_at, WavInfo &info) {
+    char riff[12];
+    if (!read_at(0, riff, sizeof(riff)) || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        RNWHISPER_LOG_ERROR("parseWav: Not a RIFF/WAVE file\n");
+        return false;
+    }
+
+    bool hasFmt = false;
+    size_t offset = sizeof(riff);
+    while (offset + 8 <= totalSize) {
+        char id[4];
+        uint32_t size;
+        if (!read_at(offset, id, 4) || !read_at(offset + 4, &size, 4)) return false;
+        offset += 8;
+
+        if (memcmp(id, "fmt ", 4) == 0) {
+            uint8_t fmt[16];
+            if (size < sizeof(fmt) || !read_at(offset, fmt, sizeof(fmt))) return false;
+            memcpy(&info.audioFormat, fmt, 2);
+            memcpy(&info.numChannels, fmt + 2, 2);
+            memcpy(&info.sampleRate, fmt + 4, 4);
+            memcpy(&info.bitsPerSample, fmt + 14, 2);
+            hasFmt = true;
+        } else if (memcmp(id, "data", 4) == 0) {
+            if (!hasFmt) break;
+            info.dataOffset = offset;
+            // Writers that never finalized the header leave 0 or 0xFFFFFFFF here, use the rest of the file then
+            info.dataSize = size == 0 || offset + size > totalSize ? totalSize - offset : size;
+            info.dataSize -= info.dataSize % 2;
+
+            if (info.audioFormat != 1 || info.bitsPerSample != 16 || info.numChannels != 1) {
+                RNWHISPER_LOG_ERROR("parseWav: Unsupported format %d, %d channels, %d bits (expected 16-bit PCM mono)\n",
+                    info.audioFormat, info.numChannels, info.bitsPerSample);
+                return false;
+            }
+            if (info.sampleRate != WHISPER_SAMPLE_RATE) {
+                RNWHISPER_LOG_WARN("parseWav: Sample rate is %u, expected %d\n", info.sampleRate, WHISPER_SAMPLE_RATE);
+            }
+            return true;
+        }
+        offset += size + (size & 1); // chunks are word aligned
+    }
+
+    RNWHISPER_LOG_ERROR("parseWav: Missing fmt or data chunk\n");
+    return false;
+}
+
+bool parseWav(const uint8_t *data, size_t size, WavInfo &info) {
+    // Fast path for the canonical 44-byte header written by WavWriter and most recorders
+    WavHeader header;
+    if (size >= sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.riff, "RIFF", 4) == 0 && memcmp(header.wave, "WAVE", 4) == 0 &&
+            memcmp(header.fmt, "fmt ", 4) == 0 && header.subChunkSize == 16 && memcmp(header.data, "data", 4) == 0 &&
+            header.audioFormat == 1 && header.numChannels == 1 && header.bitsPerSample == 16 &&
+            header.sampleRate == WHISPER_SAMPLE_RATE) {
+            const size_t rest = size - sizeof(header);
+            info.audioFormat = header.audioFormat;
+            info.numChannels = header.numChannels;
+            info.sampleRate = header.sampleRate;
+            info.bitsPerSample = header.bitsPerSample;
+            info.dataOffset = sizeof(header);
+            info.dataSize = header.subChunk2Size == 0 || header.subChunk2Size > rest ? rest : header.subChunk2Size;
+            info.dataSize -= info.dataSize % 2;
+            return true;
+        }
+    }
+
+    return parseWavChunks(size, [&](size_t offset, void *dst, size_t n) {
+        if (offset + n > size) return false;
+        memcpy(dst, data + offset, n);
+        return true;
+    }, info);
+}
+
+bool WavFileMap::open(const std::string &filePath) {
+    close();
+
+    int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        RNWHISPER_LOG_ERROR("WavFileMap: Failed to open file: %s\n", filePath.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        RNWHISPER_LOG_ERROR("WavFileMap: Empty or unreadable file: %s\n", filePath.c_str());
+        ::close(fd);
+        return false;
+    }
+    void *addr = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        RNWHISPER_LOG_ERROR("WavFileMap: Failed to map file: %s\n", filePath.c_str());
+        return false;
+    }
+    // The samples are read once front to back: read ahead, and the pages stay clean so
+    // they can be dropped under memory pressure
+    madvise(addr, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+    data = (const uint8_t *) addr;
+    size = (size_t) st.st_size;
+    if (!parseWav(data, size, info)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void WavFileMap::close() {
+    if (data) {
+        munmap((void *) data, size);
+        data = nullptr;
+        size = 0;
+    }
+}
+
 // 1) Initialize: write a placeholder WAV header.
 bool WavWriter::initialize(const std::string &filePath,
                            int sampleRate,
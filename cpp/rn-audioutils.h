@@ -5,9 +5,16 @@
 #include <fstream>
 #include <vector>
 #include <cstdint>
+#include <functional>
 
 namespace rnaudioutils {
 
+// Convert 16-bit PCM to float in [-1, 1) (NEON / SSE2 / AVX2 when available)
+void pcm_i16_to_f32(const short *src, float *dst, size_t n);
+
+// Sum of |x[i]| (NEON / SSE2 / AVX2 when available)
+float sum_abs_f32(const float *x, size_t n);
+
 // Simple WAV header struct (16-bit PCM, 1 channel @ 16000 Hz).
 // Adjust fields if your format is different.
 #pragma pack(push, 1)
@@ -28,6 +35,40 @@ struct WavHeader {
 };
 #pragma pack(pop)
 
+// Layout of the samples in a WAV file, found by walking its chunks
+struct WavInfo {
+    uint16_t audioFormat = 0;
+    uint16_t numChannels = 0;
+    uint32_t sampleRate = 0;
+    uint16_t bitsPerSample = 0;
+    size_t dataOffset = 0; // byte offset of the first sample
+    size_t dataSize = 0;   // bytes of sample data
+};
+
+// Parse a WAV held in memory, only 16-bit PCM mono is accepted
+bool parseWav(const uint8_t *data, size_t size, WavInfo &info);
+
+// Read-only mapping of a 16-bit PCM mono WAV file, the samples are paged in from the file
+// as they are read instead of being loaded up front
+class WavFileMap {
+public:
+    WavFileMap() = default;
+    WavFileMap(const WavFileMap &) = delete;
+    WavFileMap &operator=(const WavFileMap &) = delete;
+    ~WavFileMap() { close(); }
+
+    bool open(const std::string &filePath);
+    void close();
+
+    const short *samples() const { return data ? (const short *) (data + info.dataOffset) : nullptr; }
+    int nSamples() const { return data ? (int) (info.dataSize / sizeof(short)) : 0; }
+
+private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    WavInfo info;
+};
+
 class WavWriter {
 public:
     // Call this first:
@@ -1,10 +1,17 @@
 #include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <string>
 #include <vector>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include "rn-whisper.h"
 
 #define DEFAULT_MAX_AUDIO_SEC 30;
+// Slices held by the capture ring: the ones kept behind the transcription, the one being transcribed and the one being captured
+#define PCM_RING_SLICES 4
 
 namespace rnwhisper {
 
@@ -99,10 +106,86 @@ std::string bench(struct whisper_context * ctx, int n_threads) {
         std::to_string(1e-3f * timings->t_prompt_us / n_prompt) + "]";
 }
 
-void high_pass_filter(std::vector<float> & data, float cutoff, float sample_rate) {
+// One job of bench_jobs(): encode a window and generate 64 tokens on its own state
+static int bench_job_run(struct whisper_context * ctx, struct whisper_state * state, int n_threads) {
+    if (int ret = whisper_set_mel_with_state(ctx, state, nullptr, 0, whisper_model_n_mels(ctx))) {
+        return ret;
+    }
+    if (int ret = whisper_encode_with_state(ctx, state, 0, n_threads)) {
+        return ret;
+    }
+
+    whisper_token tokens[1] = { 0 };
+    for (int i = 0; i < 64; i++) {
+        if (int ret = whisper_decode_with_state(ctx, state, tokens, 1, i, n_threads)) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+std::string bench_jobs(struct whisper_context * ctx, int n_threads) {
+    const int n_jobs_max = 4;
+
+    std::vector<whisper_state *> states;
+    for (int i = 0; i < n_jobs_max; i++) {
+        whisper_state * state = whisper_state_acquire(ctx);
+        if (state == nullptr) {
+            for (auto * s : states) whisper_state_release(ctx, s);
+            return "error: failed to acquire state";
+        }
+        states.push_back(state);
+    }
+
+    std::string result = std::string("[") + "\"" + system_info() + "\"," + std::to_string(n_threads);
+    int ret = 0;
+
+    // heat every state once, so the graph allocation is not measured
+    for (int i = 0; i < n_jobs_max && ret == 0; i++) {
+        ret = bench_job_run(ctx, states[i], n_threads);
+    }
+
+    for (int n_jobs = 1; n_jobs <= n_jobs_max && ret == 0; n_jobs *= 2) {
+        std::vector<int> codes(n_jobs, 0);
+        std::vector<std::thread> workers;
+
+        const int64_t t_start_us = wsp_ggml_time_us();
+        for (int i = 0; i < n_jobs; i++) {
+            workers.emplace_back([&, i]() {
+                codes[i] = bench_job_run(ctx, states[i], n_threads);
+            });
+        }
+        for (auto & worker : workers) {
+            worker.join();
+        }
+        const int64_t t_us = std::max<int64_t>(1, wsp_ggml_time_us() - t_start_us);
+
+        for (int code : codes) {
+            if (code != 0) ret = code;
+        }
+
+        // jobs per second with n_jobs running at the same time
+        result += "," + std::to_string(1e6f * n_jobs / t_us);
+    }
+
+    for (auto * state : states) {
+        whisper_state_release(ctx, state);
+    }
+
+    if (ret != 0) {
+        return "error: failed to run job: " + std::to_string(ret);
+    }
+    return result + "]";
+}
+
+static float high_pass_alpha(float cutoff, float sample_rate) {
     const float rc = 1.0f / (2.0f * M_PI * cutoff);
     const float dt = 1.0f / sample_rate;
-    const float alpha = dt / (rc + dt);
+    return dt / (rc + dt);
+}
+
+void high_pass_filter(std::vector<float> & data, float cutoff, float sample_rate) {
+    const float alpha = high_pass_alpha(cutoff, sample_rate);
 
     float y = data[0];
 
@@ -150,6 +233,51 @@ bool vad_simple_impl(std::vector<float> & pcmf32, int sample_rate, int last_ms,
     return true;
 }
 
+void pcm_ring_buffer::init(size_t n) {
+    buf.assign(n, 0);
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    tail_cached = 0;
+}
+
+bool pcm_ring_buffer::write(const short* src, size_t n) {
+    const size_t cap = buf.size();
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h + n - tail_cached > cap) {
+        tail_cached = tail.load(std::memory_order_acquire);
+        if (h + n - tail_cached > cap) return false;
+    }
+
+    const size_t i0 = h % cap;
+    const size_t n0 = std::min(n, cap - i0);
+    memcpy(buf.data() + i0, src, n0 * sizeof(short));
+    memcpy(buf.data(), src + n0, (n - n0) * sizeof(short));
+
+    head.store(h + n, std::memory_order_release);
+    return true;
+}
+
+bool pcm_ring_buffer::view(size_t pos, size_t n, span & out) const {
+    const size_t cap = buf.size();
+    if (cap == 0) return false;
+    if (pos < tail.load(std::memory_order_acquire) || pos + n > head.load(std::memory_order_acquire)) {
+        return false;
+    }
+
+    const size_t i0 = pos % cap;
+    out.data0 = buf.data() + i0;
+    out.n0 = std::min(n, cap - i0);
+    out.data1 = buf.data();
+    out.n1 = n - out.n0;
+    return true;
+}
+
+void pcm_ring_buffer::release(size_t pos) {
+    if (pos > tail.load(std::memory_order_relaxed) && pos <= head.load(std::memory_order_acquire)) {
+        tail.store(pos, std::memory_order_release);
+    }
+}
+
 void job::set_realtime_params(
     vad_params params,
     int sec,
@@ -163,45 +291,185 @@ void job::set_realtime_params(
     audio_slice_sec = slice_sec > 0 && slice_sec < audio_sec ? slice_sec : audio_sec;
     audio_min_sec = min_sec >= 0.5 && min_sec <= audio_slice_sec ? min_sec : 1.0f;
     audio_output_path = output_path;
+
+    // A new slice is started when the next buffer doesn't fit, so there can be one more slice than audio_sec / audio_slice_sec
+    n_slices_max = (audio_sec + audio_slice_sec - 1) / audio_slice_sec + 1;
+    slice_offsets.reset(new std::atomic<size_t>[n_slices_max]);
+    for (int i = 0; i < n_slices_max; i++) {
+        slice_offsets[i].store(0, std::memory_order_relaxed);
+    }
+    pcm.init((size_t) WHISPER_SAMPLE_RATE * std::min(audio_sec, audio_slice_sec * PCM_RING_SLICES));
+}
+
+bool job::pcm_slice_view(int slice_index, int offset, int n, pcm_ring_buffer::span & out) {
+    if (slice_index < 0 || slice_index >= n_slices_max) return false;
+    return pcm.view(slice_offsets[slice_index].load(std::memory_order_acquire) + offset, n, out);
+}
+
+// Sum of |y| over the samples [p0, p1) of the slice, all in the ring
+static double vad_ring_sum(const vad_stream & vs, int p0, int p1) {
+    const int size = (int) vs.ring.size();
+    if (p0 >= p1) return 0.0;
+
+    const int i0 = p0 % size;
+    const int n0 = std::min(p1 - p0, size - i0);
+    return (double) rnaudioutils::sum_abs_f32(vs.ring.data() + i0, n0) +
+           (double) rnaudioutils::sum_abs_f32(vs.ring.data(), p1 - p0 - n0);
+}
+
+// Filter the samples [vs.pos, end) of the slice into the ring and update the running sums
+static bool vad_stream_update(job & j, vad_stream & vs, int slice_index, int end, int n_window, int n_last) {
+    const float alpha = j.vad.freq_thold > 0.0f ? high_pass_alpha(j.vad.freq_thold, WHISPER_SAMPLE_RATE) : 0.0f;
+
+    // Only the last vad_ms matter, restart the stream there when it is behind (or on another slice)
+    if (vs.slice_index != slice_index || vs.pos > end || end - vs.pos > n_window || (int) vs.ring.size() != n_window) {
+        vs.slice_index = slice_index;
+        vs.pos_begin = std::max(0, end - n_window);
+        vs.pos = vs.pos_begin;
+        vs.ring.assign(n_window, 0.0f);
+        vs.sum_all = 0.0;
+        vs.sum_last = 0.0;
+        vs.y_prev = 0.0f;
+    }
+
+    // Pieces of at most last_ms, so the samples leaving the windows are still in the ring
+    while (vs.pos < end) {
+        const int p0 = vs.pos;
+        const int p1 = std::min(end, p0 + n_last);
+        const int n = p1 - p0;
+
+        pcm_ring_buffer::span samples;
+        if (!j.pcm_slice_view(slice_index, p0, n, samples)) {
+            vs.slice_index = -1;
+            return false;
+        }
+
+        if (vs.x.size() < (size_t) n) vs.x.resize(n);
+        rnaudioutils::pcm_i16_to_f32(samples.data0, vs.x.data(), samples.n0);
+        rnaudioutils::pcm_i16_to_f32(samples.data1, vs.x.data() + samples.n0, samples.n1);
+
+        vs.sum_all -= vad_ring_sum(vs, std::max(0, p0 - n_window), std::max(0, p1 - n_window));
+        vs.sum_last -= vad_ring_sum(vs, std::max(0, p0 - n_last), std::max(0, p1 - n_last));
+
+        // Same recurrence as high_pass_filter(), which reads back its own output as the previous input
+        float y = vs.y_prev;
+        for (int i = 0; i < n; i++) {
+            const int p = p0 + i;
+            y = alpha > 0.0f && p != vs.pos_begin ? alpha * (y + vs.x[i] - y) : vs.x[i];
+            vs.ring[p % n_window] = y;
+        }
+        vs.y_prev = y;
+
+        const double sum = vad_ring_sum(vs, p0, p1);
+        vs.sum_all += sum;
+        vs.sum_last += sum;
+        vs.pos = p1;
+    }
+    return true;
 }
 
 bool job::vad_simple(int slice_index, int n_samples, int n) {
-    if (slice_index >= pcm_slices.size()) return !vad.use_vad;
     if (!vad.use_vad) return true;
 
-    short* pcm = pcm_slices[slice_index];
-    int sample_size = (int) (WHISPER_SAMPLE_RATE * vad.vad_ms / 1000);
-    if (n_samples + n > sample_size) {
-        int start = n_samples + n - sample_size;
-        std::vector<float> pcmf32(sample_size);
-        for (int i = 0; i < sample_size; i++) {
-            pcmf32[i] = (float)pcm[i + start] / 32768.0f;
-        }
-        return vad_simple_impl(pcmf32, WHISPER_SAMPLE_RATE, vad.last_ms, vad.vad_thold, vad.freq_thold, vad.verbose);
+    const int sample_size = (int) (WHISPER_SAMPLE_RATE * vad.vad_ms / 1000);
+    const int n_last = (WHISPER_SAMPLE_RATE * vad.last_ms) / 1000;
+    const int end = n_samples + n;
+    if (end <= sample_size) return false;
+    // not enough samples - assume no speech
+    if (n_last >= sample_size || n_last <= 0) return false;
+
+    if (!vad_stream_update(*this, vad_state, slice_index, end, sample_size, n_last)) return false;
+
+    // vad_simple_impl() filters from the start of the window: its first sample is unfiltered, the next ones only
+    // depend on the previous output through rounding, so the stream differs from it in the first sample only
+    double energy_all = vad_state.sum_all;
+    if (vad.freq_thold > 0.0f) {
+        const int w0 = end - sample_size;
+        pcm_ring_buffer::span first;
+        if (!pcm_slice_view(slice_index, w0, 1, first)) return false;
+        energy_all += fabsf(first.data0[0] / 32768.0f) - fabsf(vad_state.ring[w0 % sample_size]);
     }
-    return false;
+
+    const float energy_all_mean = (float) (energy_all / sample_size);
+    const float energy_last_mean = (float) (vad_state.sum_last / n_last);
+
+    if (vad.verbose) {
+        RNWHISPER_LOG_INFO("%s: energy_all: %f, energy_last: %f, vad_thold: %f, freq_thold: %f\n", __func__, energy_all_mean, energy_last_mean, vad.vad_thold, vad.freq_thold);
+    }
+
+    return energy_last_mean <= vad.vad_thold * energy_all_mean;
 }
 
-void job::put_pcm_data(short* data, int slice_index, int n_samples, int n) {
-    if (pcm_slices.size() == slice_index) {
-        int n_slices = (int) (WHISPER_SAMPLE_RATE * audio_slice_sec);
-        pcm_slices.push_back(new short[n_slices]);
+bool job::put_pcm_data(short* data, int slice_index, int n_samples, int n) {
+    if (slice_index < 0 || slice_index >= n_slices_max) return false;
+    if (n_samples == 0) {
+        // First samples of the slice
+        slice_offsets[slice_index].store(pcm.write_pos(), std::memory_order_release);
     }
-    short* pcm = pcm_slices[slice_index];
-    for (int i = 0; i < n; i++) {
-        pcm[i + n_samples] = data[i];
+    if (!pcm.write(data, n)) {
+        RNWHISPER_LOG_WARN("rnwhisper::job::%s: capture ring is full, dropped %d samples\n", __func__, n);
+        return false;
     }
+    return true;
 }
 
-float* job::pcm_slice_to_f32(int slice_index, int size) {
-    if (pcm_slices.size() > slice_index) {
-        float* pcmf32 = new float[size];
-        for (int i = 0; i < size; i++) {
-            pcmf32[i] = (float)pcm_slices[slice_index][i] / 32768.0f;
+const float* job::pcm_slice_to_f32(int slice_index, int size) {
+    pcm_ring_buffer::span samples;
+    if (!pcm_slice_view(slice_index, 0, size, samples)) return nullptr;
+
+    if (pcmf32.size() < (size_t) size) {
+        // Grows up to one slice, then stays
+        pcmf32.resize(std::max((size_t) size, (size_t) WHISPER_SAMPLE_RATE * audio_slice_sec));
+    }
+    rnaudioutils::pcm_i16_to_f32(samples.data0, pcmf32.data(), samples.n0);
+    rnaudioutils::pcm_i16_to_f32(samples.data1, pcmf32.data() + samples.n0, samples.n1);
+    return pcmf32.data();
+}
+
+int job::transcribe_slice(int slice_index, int n_samples) {
+    const float* samples = pcm_slice_to_f32(slice_index, n_samples);
+    if (samples == nullptr) return -1;
+
+    if (mel_stream == nullptr) {
+        mel_stream = whisper_mel_stream_init(ctx);
+    }
+    if (slice_index != mel_stream_slice_index) {
+        // New slice, the cached frames belong to the previous audio
+        whisper_mel_stream_reset(mel_stream);
+        mel_stream_slice_index = slice_index;
+    }
+
+    const bool is_auto_language = !params.detect_language &&
+        (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0);
+
+    whisper_full_params params_slice = params;
+    if (is_auto_language && !language.empty()) {
+        params_slice.language = language.c_str();
+    }
+    if (params.initial_prompt != nullptr && params.prompt_tokens == nullptr) {
+        if (!prompt_tokenized) {
+            prompt_tokens.resize(1024);
+            int n_tokens = whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size());
+            if (n_tokens < 0) {
+                prompt_tokens.resize(-n_tokens);
+                n_tokens = whisper_tokenize(ctx, params.initial_prompt, prompt_tokens.data(), prompt_tokens.size());
+            }
+            prompt_tokens.resize(std::max(0, n_tokens));
+            prompt_tokenized = true;
         }
-        return pcmf32;
+        // whisper_full would tokenize the prompt again if it gets no tokens
+        params_slice.initial_prompt = nullptr;
+        params_slice.prompt_tokens = prompt_tokens.data();
+        params_slice.prompt_n_tokens = prompt_tokens.size();
     }
-    return nullptr;
+
+    int code = whisper_full_with_mel_with_state(ctx, state, params_slice, mel_stream, samples, n_samples);
+
+    // Keep the language detected on the first slice with speech, later slices skip the detection
+    if (code == 0 && is_auto_language && language.empty() && whisper_full_n_segments_from_state(state) > 0) {
+        language = whisper_lang_str(whisper_full_lang_id_from_state(state));
+    }
+    return code;
 }
 
 // Open the .raw file for writing
@@ -231,74 +499,103 @@ void job::close_raw_file() {
     }
 }
 
-// Free the slice array after we know it's no longer needed
+// Release the slice after we know it's no longer needed, the next slice must already be started
 void job::free_slice(int slice_index) {
-    if (slice_index < 0 || slice_index >= (int)pcm_slices.size()) return;
-    if (pcm_slices[slice_index]) {
-        delete[] pcm_slices[slice_index];
-        pcm_slices[slice_index] = nullptr;
-    }
+    if (slice_index < 0 || slice_index + 1 >= n_slices_max) return;
+    pcm.release(slice_offsets[slice_index + 1].load(std::memory_order_acquire));
 }
 
 bool job::is_aborted() {
-    return aborted;
+    return aborted.load(std::memory_order_relaxed);
 }
 
 void job::abort() {
-    aborted = true;
+    aborted.store(true, std::memory_order_relaxed);
 }
 
 job::~job() {
     RNWHISPER_LOG_INFO("rnwhisper::job::%s: job_id: %d\n", __func__, job_id);
 
-    for (size_t i = 0; i < pcm_slices.size(); i++) {
-        delete[] pcm_slices[i];
+    if (mel_stream != nullptr) {
+        whisper_mel_stream_free(mel_stream);
+        mel_stream = nullptr;
     }
-    pcm_slices.clear();
+
+    // The state goes back to the pool, the results of the job are gone after this
+    whisper_state_release(ctx, state);
+    state = nullptr;
 }
 
-std::unordered_map<int, job*> job_map;
+std::mutex job_mutex;
+std::unordered_map<int, std::shared_ptr<job>> job_map;
 
 void job_abort_all() {
+    std::lock_guard<std::mutex> lock(job_mutex);
     for (auto it = job_map.begin(); it != job_map.end(); ++it) {
         it->second->abort();
     }
 }
 
-job* job_new(int job_id, struct whisper_full_params params) {
-    job* ctx = new job();
-    ctx->job_id = job_id;
-    ctx->params = params;
+void job_abort(int job_id) {
+    std::lock_guard<std::mutex> lock(job_mutex);
+    auto it = job_map.find(job_id);
+    if (it != job_map.end()) {
+        it->second->abort();
+    }
+}
+
+std::shared_ptr<job> job_new(int job_id, whisper_context* ctx, struct whisper_full_params params) {
+    whisper_state* state = whisper_state_acquire(ctx);
+    if (state == nullptr) {
+        RNWHISPER_LOG_ERROR("rnwhisper::%s: failed to lease a state for job_id: %d\n", __func__, job_id);
+        return nullptr;
+    }
 
-    job_map[job_id] = ctx;
+    std::shared_ptr<job> j = std::make_shared<job>();
+    j->job_id = job_id;
+    j->ctx = ctx;
+    j->state = state;
 
-    // Abort handler
+    // Abort handler, the job outlives the transcriptions since their caller holds it
     params.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
         job *j = (job*)user_data;
         return !j->is_aborted();
     };
-    params.encoder_begin_callback_user_data = job_map[job_id];
+    params.encoder_begin_callback_user_data = j.get();
     params.abort_callback = [](void * user_data) {
         job *j = (job*)user_data;
         return j->is_aborted();
     };
-    params.abort_callback_user_data = job_map[job_id];
-
-    return job_map[job_id];
-}
+    params.abort_callback_user_data = j.get();
+    j->params = params;
 
-job* job_get(int job_id) {
-    if (job_map.find(job_id) != job_map.end()) {
-        return job_map[job_id];
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        if (job_map.emplace(job_id, j).second) {
+            return j;
+        }
     }
+    // The registered job is left to its owner, this one releases its state when it goes out of scope
+    RNWHISPER_LOG_ERROR("rnwhisper::%s: job_id %d is already registered\n", __func__, job_id);
     return nullptr;
 }
 
+std::shared_ptr<job> job_get(int job_id) {
+    std::lock_guard<std::mutex> lock(job_mutex);
+    auto it = job_map.find(job_id);
+    return it != job_map.end() ? it->second : nullptr;
+}
+
 void job_remove(int job_id) {
-    if (job_map.find(job_id) != job_map.end()) {
-        delete job_map[job_id];
+    std::shared_ptr<job> j;
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        auto it = job_map.find(job_id);
+        if (it == job_map.end()) return;
+        j = std::move(it->second);
+        job_map.erase(it);
     }
-    job_map.erase(job_id);
+    // Dropped outside of the lock, releasing the state can take a while if this was the last holder
 }
 
 }
@@ -1,6 +1,8 @@
 #ifndef RNWHISPER_H
 #define RNWHISPER_H
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 #include "whisper.h"
@@ -10,6 +12,51 @@
 namespace rnwhisper {
 
 std::string bench(whisper_context * ctx, int n_threads);
+// Throughput of 1, 2 and 4 jobs running at the same time on their own states
+std::string bench_jobs(whisper_context * ctx, int n_threads);
+
+#define RNWHISPER_CACHE_LINE_SIZE 64
+
+// Fixed-capacity single-producer/single-consumer ring of 16-bit PCM samples.
+// Positions are absolute sample counts since init(), the capture thread appends with write()
+// and the transcription thread reads with view() and gives space back with release().
+// write() never allocates and never blocks, it rejects the samples if they don't fit.
+struct pcm_ring_buffer {
+    // Up to two contiguous spans, the second one is used when the range wraps around
+    struct span {
+        const short* data0 = nullptr;
+        size_t n0 = 0;
+        const short* data1 = nullptr;
+        size_t n1 = 0;
+
+        short operator[](size_t i) const { return i < n0 ? data0[i] : data1[i - n0]; }
+        size_t size() const { return n0 + n1; }
+    };
+
+    void init(size_t capacity);
+
+    size_t capacity() const { return buf.size(); }
+
+    // Producer
+    bool write(const short* src, size_t n);
+    size_t write_pos() const { return head.load(std::memory_order_acquire); }
+
+    // Consumer, view() fails if [pos, pos + n) was already released or not written yet
+    bool view(size_t pos, size_t n, span & out) const;
+    void release(size_t pos);
+
+private:
+    std::vector<short> buf;
+
+    // Written by the producer
+    std::atomic<size_t> head{0};
+    size_t tail_cached = 0;
+    char pad0[RNWHISPER_CACHE_LINE_SIZE];
+
+    // Written by the consumer
+    std::atomic<size_t> tail{0};
+    char pad1[RNWHISPER_CACHE_LINE_SIZE];
+};
 
 struct vad_params {
     bool use_vad = false;
@@ -20,18 +67,58 @@ struct vad_params {
     bool verbose = false;
 };
 
+// Running state of job::vad_simple(), each call only filters the samples captured since the previous one
+struct vad_stream {
+    int slice_index = -1;
+    int pos_begin = 0;   // first sample of the stream, left unfiltered like the first one of high_pass_filter()
+    int pos = 0;         // samples of the slice filtered so far
+    float y_prev = 0.0f; // high-pass filter output at pos - 1
+
+    // Filtered samples of the last vad_ms, sample p is in slot p % ring.size()
+    std::vector<float> ring;
+    // Sums of the filtered magnitudes over the last vad_ms and the last last_ms
+    double sum_all = 0.0;
+    double sum_last = 0.0;
+
+    // New samples converted to float, reused across calls
+    std::vector<float> x;
+};
+
 struct job {
     int job_id;
-    bool aborted = false;
+    std::atomic<bool> aborted{false};
     whisper_full_params params;
 
+    // State leased from the context pool, the job transcribes and keeps its results there
+    whisper_context* ctx = nullptr;
+    whisper_state* state = nullptr;
+
     // Realtime transcription only:
     vad_params vad;
+    vad_stream vad_state;
     int audio_sec = 0;
     int audio_slice_sec = 0;
     float audio_min_sec = 0;
     const char* audio_output_path = nullptr;
-    std::vector<short*> pcm_slices;
+
+    // Captured samples and the ring position where each slice starts
+    pcm_ring_buffer pcm;
+    std::unique_ptr<std::atomic<size_t>[]> slice_offsets;
+    int n_slices_max = 0;
+
+    // Float copy of the slice being transcribed, reused across transcriptions
+    std::vector<float> pcmf32;
+
+    // Incremental mel spectrogram of the slice being transcribed
+    whisper_mel_stream* mel_stream = nullptr;
+    int mel_stream_slice_index = -1;
+
+    // Language detected by the first slice when params.language is auto
+    std::string language;
+
+    // params.initial_prompt tokenized on the first slice, later slices reuse it (even if it has no tokens)
+    std::vector<whisper_token> prompt_tokens;
+    bool prompt_tokenized = false;
 
     // NEW: file pointer for raw audio
     FILE* rawFile = nullptr;
@@ -47,18 +134,29 @@ struct job {
     void append_raw_data(short* data, int n);
     void close_raw_file();
 
-    // For freeing slices after done with them
+    // Give the samples of a slice (and the ones before it) back to the capture ring
     void free_slice(int slice_index);
 
     bool vad_simple(int slice_index, int n_samples, int n);
-    void put_pcm_data(short* pcm, int slice_index, int n_samples, int n);
-    float* pcm_slice_to_f32(int slice_index, int size);
+    // Returns false if the samples don't fit in the ring (the transcription is too far behind)
+    bool put_pcm_data(short* pcm, int slice_index, int n_samples, int n);
+    bool pcm_slice_view(int slice_index, int offset, int n, pcm_ring_buffer::span & out);
+    // Returns the job buffer holding the first size samples of the slice, valid until the next call
+    const float* pcm_slice_to_f32(int slice_index, int size);
+
+    // Transcribe the first n_samples of a slice, only computing mel frames for samples added since the last call
+    int transcribe_slice(int slice_index, int n_samples);
 };
 
+// The registry is thread safe and shares the ownership of the jobs: job_remove() only unregisters a job,
+// it is freed (and its state released) when the last holder drops it
+// Other threads should only abort a running job through job_abort() / job_abort_all()
 void job_abort_all();
-job* job_new(int job_id, struct whisper_full_params params);
+void job_abort(int job_id);
+// Returns nullptr if no state could be leased for the job, or if job_id is already registered
+std::shared_ptr<job> job_new(int job_id, whisper_context* ctx, struct whisper_full_params params);
 void job_remove(int job_id);
-job* job_get(int job_id);
+std::shared_ptr<job> job_get(int job_id);
 
 } // namespace rnwhisper
 
@@ -45,7 +45,11 @@
 #include <cstdarg>
 #include <cstring>
 #include <fstream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 #include <set>
 #include <string>
 #include <thread>
@@ -55,10 +59,29 @@
 #include <functional>
 #include <codecvt>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#endif
+
 #if defined(WSP_GGML_BIG_ENDIAN)
 #include <bit>
 
@@ -163,6 +186,9 @@ static void whisper_log_callback_default(wsp_ggml_log_level level, const char *
 #define WHISPER_MAX_DECODERS 8
 #define WHISPER_MAX_NODES 4096
 
+// granularity of the number of KV cells attended by the decoder, see whisper_decode_internal()
+#define WHISPER_DECODE_KV_PAD 32u
+
 //
 // ggml helpers
 //
@@ -186,15 +212,19 @@ static bool wsp_ggml_graph_compute_helper(
     return wsp_ggml_graph_compute(graph, &plan);
 }
 
+// keep_alloc leaves the graph allocated in the scheduler, so that it can be computed again without a new allocation
 static bool wsp_ggml_graph_compute_helper(
       wsp_ggml_backend_sched_t   sched,
         struct wsp_ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+          wsp_ggml_threadpool_t   threadpool,
+                      bool   keep_alloc = false) {
 
     for (int i = 0; i < wsp_ggml_backend_sched_get_n_backends(sched); ++i) {
         wsp_ggml_backend_t backend = wsp_ggml_backend_sched_get_backend(sched, i);
         if (wsp_ggml_backend_is_cpu(backend)) {
             wsp_ggml_backend_cpu_set_n_threads(backend, n_threads);
+            wsp_ggml_backend_cpu_set_threadpool(backend, threadpool);
         }
 #ifdef WSP_GGML_USE_BLAS
         if (wsp_ggml_backend_is_blas(backend)) {
@@ -204,10 +234,68 @@ static bool wsp_ggml_graph_compute_helper(
     }
 
     bool t = wsp_ggml_backend_sched_graph_compute(sched, graph) == WSP_GGML_STATUS_SUCCESS;
-    wsp_ggml_backend_sched_reset(sched);
+    if (!t || !keep_alloc) {
+        wsp_ggml_backend_sched_reset(sched);
+    }
     return t;
 }
 
+// runs fn(ith, nth) on nth threads
+// with a thread pool, the work is submitted as a single custom op so that the pool threads are reused,
+// otherwise n_threads - 1 threads are spawned for the call
+static void whisper_parallel_for(
+          wsp_ggml_threadpool_t   threadpool,
+         std::vector<uint8_t> & buf,
+                       int   n_threads,
+        const std::function<void(int, int)> & fn) {
+    if (n_threads <= 1) {
+        fn(0, 1);
+        return;
+    }
+
+    if (threadpool == nullptr) {
+        std::vector<std::thread> workers(n_threads - 1);
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw] = std::thread(fn, iw + 1, n_threads);
+        }
+
+        // main thread
+        fn(0, n_threads);
+
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw].join();
+        }
+        return;
+    }
+
+    const size_t mem_size = 2*wsp_ggml_tensor_overhead() + wsp_ggml_graph_overhead_custom(WSP_GGML_DEFAULT_GRAPH_SIZE, false);
+    if (buf.size() < mem_size) {
+        buf.resize(mem_size);
+    }
+
+    struct wsp_ggml_init_params params = {
+        /*.mem_size   =*/ mem_size,
+        /*.mem_buffer =*/ buf.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct wsp_ggml_context * ctx0 = wsp_ggml_init(params);
+
+    struct wsp_ggml_tensor * src = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_F32, 1);
+    struct wsp_ggml_tensor * dst = wsp_ggml_map_custom1(ctx0, src,
+            [](struct wsp_ggml_tensor * /*dst*/, const struct wsp_ggml_tensor * /*src*/, int ith, int nth, void * userdata) {
+                (*(const std::function<void(int, int)> *) userdata)(ith, nth);
+            }, WSP_GGML_N_TASKS_MAX, (void *) &fn);
+
+    struct wsp_ggml_cgraph * gf = wsp_ggml_new_graph_custom(ctx0, WSP_GGML_DEFAULT_GRAPH_SIZE, false);
+    wsp_ggml_build_forward_expand(gf, dst);
+
+    struct wsp_ggml_cplan plan = wsp_ggml_graph_plan(gf, n_threads, threadpool);
+    wsp_ggml_graph_compute(gf, &plan);
+
+    wsp_ggml_free(ctx0);
+}
+
 // faster matrix multiplications for tensors that do not have dimension 0 divisible by "pad"
 // the idea is to represent the original matrix multiplication:
 //
@@ -416,13 +504,118 @@ struct whisper_filters {
 };
 
 struct whisper_vocab {
-    using id    = int32_t;
-    using token = std::string;
+    using id = int32_t;
 
     int n_vocab = 51864;
 
-    std::map<token, id> token_to_id;
-    std::map<id, token> id_to_token;
+    // token strings stored back to back, each NUL-terminated so it can be handed out as a C string
+    // token_offs[id] is the start of token id in token_data, token_offs[size()] is the end of the pool
+    std::vector<char>     token_data;
+    std::vector<uint32_t> token_offs = { 0 };
+
+    // open-addressing hash (linear probing) of token string -> id, -1 for an empty slot
+    std::vector<id> token_index;
+    int token_len_max = 0;
+
+    int size() const {
+        return (int) token_offs.size() - 1;
+    }
+
+    const char * token_to_str(id token) const {
+        return token_data.data() + token_offs[token];
+    }
+
+    int token_len(id token) const {
+        return token_offs[token + 1] - token_offs[token] - 1;
+    }
+
+    // appends the next id
+    void add_token(const char * text, size_t len) {
+        token_data.insert(token_data.end(), text, text + len);
+        token_data.push_back('\0');
+        token_offs.push_back(token_data.size());
+    }
+
+    // FNV-1a, hash_next() extends the hash of a string by one character
+    static uint32_t hash_next(uint32_t h, char c) {
+        return (h ^ (uint8_t) c)*16777619u;
+    }
+
+    static uint32_t hash(const char * text, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i) {
+            h = hash_next(h, text[i]);
+        }
+        return h;
+    }
+
+    // builds token_index once all tokens are added
+    // for duplicate strings the highest id wins
+    void build_index() {
+        size_t n_slots = 1;
+        while (n_slots < 2*(size_t) size()) {
+            n_slots *= 2;
+        }
+        token_index.assign(n_slots, -1);
+        token_len_max = 0;
+
+        for (id i = 0; i < size(); ++i) {
+            const char * text = token_to_str(i);
+            const int    len  = token_len(i);
+
+            token_len_max = std::max(token_len_max, len);
+
+            size_t slot = hash(text, len) & (n_slots - 1);
+            while (token_index[slot] >= 0 && (token_len(token_index[slot]) != len || memcmp(token_to_str(token_index[slot]), text, len) != 0)) {
+                slot = (slot + 1) & (n_slots - 1);
+            }
+            token_index[slot] = i;
+        }
+
+        token_space = find(" ", 1);
+    }
+
+    // id of the token with this exact text and hash, -1 if there is none
+    id find(const char * text, size_t len, uint32_t h) const {
+        if (token_index.empty()) {
+            return -1;
+        }
+
+        const size_t mask = token_index.size() - 1;
+
+        for (size_t slot = h & mask; token_index[slot] >= 0; slot = (slot + 1) & mask) {
+            const id cur = token_index[slot];
+            if ((size_t) token_len(cur) == len && memcmp(token_to_str(cur), text, len) == 0) {
+                return cur;
+            }
+        }
+
+        return -1;
+    }
+
+    id find(const char * text, size_t len) const {
+        return find(text, len, hash(text, len));
+    }
+
+    id find(const std::string & text) const {
+        return find(text.data(), text.size());
+    }
+
+    // length of the longest token that text starts with, 0 if there is none
+    // the prefixes are hashed incrementally, so this is one pass over at most token_len_max characters
+    int find_longest_prefix(const char * text, int len, id & out) const {
+        int best = 0;
+        uint32_t h = hash(text, 0);
+        for (int i = 0; i < std::min(len, token_len_max); ++i) {
+            h = hash_next(h, text[i]);
+            const id cur = find(text, i + 1, h);
+            if (cur >= 0) {
+                best = i + 1;
+                out  = cur;
+            }
+        }
+        return best;
+    }
 
     // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
     id token_eot        = 50256;
@@ -436,6 +629,7 @@ struct whisper_vocab {
     id token_nosp       = 50361;
     id token_not        = 50362; // no timestamps
     id token_beg        = 50363; // begin timestamps
+    id token_space      = -1;    // " ", looked up by build_index()
 
     bool is_multilingual() const {
         return n_vocab >= 51865;
@@ -510,6 +704,15 @@ static void whisper_batch_prep_legacy(whisper_batch & batch, const whisper_token
     batch.logits[n_tokens - 1] = 1;
 }
 
+// number of tokens in the batch whose logits are output
+static int whisper_batch_n_outputs(const whisper_batch & batch) {
+    int n_outputs = 0;
+    for (int i = 0; i < batch.n_tokens; ++i) {
+        n_outputs += batch.logits[i] != 0;
+    }
+    return n_outputs;
+}
+
 // replace std::pair by using customized pair struct (reason: std::pair is very slow)
 template<typename A, typename B>
 struct whisper_pair {
@@ -677,14 +880,43 @@ struct whisper_layer_decoder {
     struct wsp_ggml_tensor * mlp_1_b;
 };
 
-struct whisper_kv_cell {
-    whisper_pos pos = -1;
+// the sequences of a KV cell, one bit per sequence id
+// the decoders use the ids [0, WHISPER_MAX_DECODERS) and the beam search stages its copies in the next WHISPER_MAX_DECODERS
+typedef uint16_t whisper_seq_mask;
 
-    std::set<whisper_seq_id> seq_id;
+static_assert(2*WHISPER_MAX_DECODERS <= 8*sizeof(whisper_seq_mask), "whisper_seq_mask is too small for the sequence ids");
 
-    bool has_seq_id(const whisper_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
-    }
+static inline whisper_seq_mask whisper_seq_bit(whisper_seq_id id) {
+    return (whisper_seq_mask) (1u << id);
+}
+
+// the last decoder graph, kept in sched_decode.meta and reused by the next decode with the same shape
+// only the views that store the new K/V cells depend on kv_self.head, they are moved to the new head in place
+struct whisper_decode_graph {
+    wsp_ggml_cgraph * gf = nullptr;
+
+    // key
+    int  n_tokens     = 0;
+    int  n_outputs    = 0;
+    int  n_kv         = 0;
+    int  n_audio_ctx  = 0;
+    bool save_aheads  = false;
+
+    int32_t kv_head = 0;
+
+    // views into kv_self written by the graph and their byte stride per cell
+    std::vector<std::pair<wsp_ggml_tensor *, size_t>> kv_store;
+
+    wsp_ggml_tensor * embd     = nullptr;
+    wsp_ggml_tensor * position = nullptr;
+    wsp_ggml_tensor * KQ_mask  = nullptr;
+    wsp_ggml_tensor * out_ids  = nullptr;
+    wsp_ggml_tensor * logits   = nullptr;
+
+    wsp_ggml_tensor * aheads_cross_QKs = nullptr;
+
+    // sched_decode still holds the allocation of gf
+    bool allocated = false;
 };
 
 struct whisper_kv_cache {
@@ -694,7 +926,12 @@ struct whisper_kv_cache {
     // computed before each graph build
     uint32_t n = 0;
 
-    std::vector<whisper_kv_cell> cells;
+    // cell metadata: pos is -1 for a free cell, seq is the mask of the sequences the cell belongs to
+    std::vector<whisper_pos>      pos;
+    std::vector<whisper_seq_mask> seq;
+
+    // all the cells at or above used_max are free
+    uint32_t used_max = 0;
 
     struct wsp_ggml_tensor * k;
     struct wsp_ggml_tensor * v;
@@ -704,6 +941,63 @@ struct whisper_kv_cache {
     std::vector<uint8_t> ctx_buf;
 };
 
+// read-only mapping of the model file
+// the CPU weights point straight into it, so they are clean file-backed pages that the OS can share and reclaim
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+    size_t pos  = 0; // read position of the model loader
+
+    whisper_mmap() = default;
+    whisper_mmap(const whisper_mmap &) = delete;
+    whisper_mmap & operator=(const whisper_mmap &) = delete;
+
+    // the tensors are not aligned in the file: only 64-bit targets, which also have the address space for
+    // the larger models, load them unaligned safely
+#if defined(_POSIX_MAPPED_FILES) && defined(__LP64__) && !defined(WSP_GGML_BIG_ENDIAN)
+    static constexpr bool SUPPORTED = true;
+
+    bool open(const char * path) {
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+
+        void * res = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (res == MAP_FAILED) {
+            return false;
+        }
+
+        // start reading ahead while the hparams and vocab are parsed
+        posix_madvise(res, (size_t) st.st_size, POSIX_MADV_WILLNEED);
+
+        addr = res;
+        size = (size_t) st.st_size;
+
+        return true;
+    }
+
+    ~whisper_mmap() {
+        if (addr) {
+            munmap(addr, size);
+        }
+    }
+#else
+    static constexpr bool SUPPORTED = false;
+
+    bool open(const char * /*path*/) {
+        return false;
+    }
+#endif
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -744,6 +1038,9 @@ struct whisper_model {
     // the model backend data is read-only and can be shared between processors
     wsp_ggml_backend_buffer_t buffer = nullptr;
 
+    // set when the model is loaded from a mapped file, the CPU weights are views into it
+    std::unique_ptr<whisper_mmap> mapping;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct wsp_ggml_tensor *> tensors;
@@ -789,7 +1086,7 @@ struct whisper_decoder {
     // grammar parse state of generated sequence of tokens
     whisper_grammar  grammar;
 
-    int i_batch;    // the index of the token in the current batch
+    int i_batch;    // the row of the token's logits in state->logits
     int seek_delta; // the window shift found so far based on the decoded timestamp tokens
 
     bool failed;    // has the current segment failed to decode?
@@ -801,6 +1098,12 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
+    // computed along with probs by whisper_process_logits() so that the samplers don't scan the vocab again
+    whisper_token best_id; // token with the highest probability
+    whisper_token ts_id;   // timestamp token with the highest probability, -1 if all timestamps have probability 0
+    double        ts_max;  // probability of ts_id
+    double        ts_sum;  // sum of the probabilities of the timestamp tokens
+
     // work container used to avoid memory allocations
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
 
@@ -851,26 +1154,46 @@ struct whisper_state {
 
     std::vector<wsp_ggml_backend_t> backends;
 
+    // thread pool of the context for the duration of a whisper_full call, nullptr to spawn threads per call
+    wsp_ggml_threadpool_t threadpool = nullptr;
+
+    // graph memory for the work submitted to the thread pool
+    // kept alive between calls, since the pool threads read the graph once more after the final barrier
+    std::vector<uint8_t> buf_parallel;
+
     // - stores meta info about the intermediate tensors into the `meta` buffers
     whisper_sched sched_conv;
     whisper_sched sched_encode;
     whisper_sched sched_cross;
     whisper_sched sched_decode;
 
+    whisper_decode_graph decode_graph;
+
     // result of the encoder
     struct wsp_ggml_tensor * embd_conv = nullptr;
     struct wsp_ggml_tensor * embd_enc  = nullptr;
 
+    // mel offset and exp_n_audio_ctx that embd_enc and kv_cross were computed for, -1 when they don't match the mel
+    int enc_mel_offset  = -1;
+    int enc_n_audio_ctx = -1;
+
     // helpers for GPU offloading
     std::vector<float> inp_mel;
     std::vector<float> inp_mask;
+    std::vector<int32_t> inp_out_ids;
 
-    // decode output (2-dimensional array: [n_tokens][n_vocab])
+    // decode output (2-dimensional array: [n_outputs][n_vocab]), one row per batch token with batch.logits set
     std::vector<float> logits;
 
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
+    // sorted ids suppressed by params.suppress_regex and params.suppress_non_speech_tokens, see whisper_suppress_ids()
+    std::vector<whisper_token> suppress_ids;
+    std::string                suppress_ids_regex;
+    bool                       suppress_ids_non_speech = false;
+    bool                       suppress_ids_valid      = false;
+
     int lang_id = 0; // english by default
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
@@ -904,6 +1227,11 @@ struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
+    // model loading I/O, see whisper_prefetch_loader
+    int64_t load_bytes     = 0;
+    int64_t t_load_read_us = 0;
+    int64_t t_load_wait_us = 0;
+
     wsp_ggml_type wtype = wsp_ggml_type::WSP_GGML_TYPE_F16; // weight type (FP32 / FP16 / QX)
     wsp_ggml_type itype = wsp_ggml_type::WSP_GGML_TYPE_F16; // intermediate type (FP32 or FP16)
 
@@ -915,6 +1243,16 @@ struct whisper_context {
     whisper_state * state = nullptr;
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
+
+    // persistent thread pool, created on first use by whisper_full with params.use_threadpool
+    // held by one whisper_full call at a time, concurrent calls fall back to per-call threads
+    wsp_ggml_threadpool_t threadpool = nullptr;
+    wsp_ggml_threadpool_params threadpool_params;
+    std::mutex threadpool_mutex;
+
+    // idle states returned by whisper_state_release(), see whisper_state_acquire()
+    std::vector<whisper_state *> state_pool;
+    std::mutex state_pool_mutex;
 };
 
 struct whisper_global {
@@ -952,8 +1290,9 @@ static bool whisper_kv_cache_init(
     cache.head = 0;
     cache.size = n_ctx;
 
-    cache.cells.clear();
-    cache.cells.resize(n_ctx);
+    cache.pos.assign(n_ctx, -1);
+    cache.seq.assign(n_ctx, 0);
+    cache.used_max = 0;
 
     struct wsp_ggml_context * ctx = wsp_ggml_init(params);
 
@@ -1002,9 +1341,13 @@ static bool whisper_kv_cache_find_slot(
             continue;
         }
 
+        if (cache.head >= cache.used_max) {
+            break;
+        }
+
         bool found = true;
         for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
+            if (cache.pos[cache.head + i] >= 0) {
                 found = false;
                 cache.head += i + 1;
                 n_tested   += i + 1;
@@ -1023,32 +1366,34 @@ static bool whisper_kv_cache_find_slot(
     }
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+        cache.pos[cache.head + i] = batch.pos[i];
 
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            cache.seq[cache.head + i] |= whisper_seq_bit(batch.seq_id[i][j]);
         }
     }
 
+    cache.used_max = std::max(cache.used_max, cache.head + n_tokens);
+
     return true;
 }
 
-// find how many cells are currently in use
-static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
-    for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
-            return i + 1;
-        }
+// lower used_max past the cells freed at the top of the cache
+static void whisper_kv_cache_trim_used(struct whisper_kv_cache & cache) {
+    while (cache.used_max > 0 && cache.pos[cache.used_max - 1] < 0) {
+        cache.used_max--;
     }
+}
 
-    return 1;
+// find how many cells are currently in use
+static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
+    return std::max(1u, cache.used_max);
 }
 
 static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
-    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
-    }
+    std::fill(cache.pos.begin(), cache.pos.end(), -1);
+    std::fill(cache.seq.begin(), cache.seq.end(), 0);
+    cache.used_max = 0;
     cache.head = 0;
 
     wsp_ggml_backend_buffer_clear(cache.buffer, 0);
@@ -1064,22 +1409,20 @@ static void whisper_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<whisper_pos>::max();
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
-            }
-            if (cache.cells[i].seq_id.empty()) {
-                cache.cells[i].pos = -1;
+    const whisper_seq_mask bit = seq_id < 0 ? (whisper_seq_mask) ~0u : whisper_seq_bit(seq_id);
+
+    for (uint32_t i = 0; i < cache.used_max; ++i) {
+        if (cache.pos[i] >= p0 && cache.pos[i] < p1 && (cache.seq[i] & bit)) {
+            cache.seq[i] &= ~bit;
+            if (cache.seq[i] == 0) {
+                cache.pos[i] = -1;
                 if (new_head == cache.size) new_head = i;
             }
         }
     }
 
+    whisper_kv_cache_trim_used(cache);
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size) cache.head = new_head;
 }
@@ -1095,9 +1438,62 @@ static void whisper_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+    const whisper_seq_mask bit_src = whisper_seq_bit(seq_id_src);
+    const whisper_seq_mask bit_dst = whisper_seq_bit(seq_id_dst);
+
+    for (uint32_t i = 0; i < cache.used_max; ++i) {
+        if ((cache.seq[i] & bit_src) && cache.pos[i] >= p0 && cache.pos[i] < p1) {
+            cache.seq[i] |= bit_dst;
+        }
+    }
+}
+
+// drop everything but the first n_past positions and give them back to sequence 0 alone
+// returns false if some of these positions are no longer in the cache
+static bool whisper_kv_cache_seq_keep_prefix(
+        struct whisper_kv_cache & cache,
+                    whisper_pos   n_past) {
+    whisper_kv_cache_seq_rm(cache, -1, n_past, -1);
+
+    whisper_pos n_found = 0;
+
+    const whisper_seq_mask bit = whisper_seq_bit(0);
+
+    for (uint32_t i = 0; i < cache.used_max; ++i) {
+        if (cache.pos[i] < 0) {
+            continue;
+        }
+        if (!(cache.seq[i] & bit)) {
+            cache.pos[i] = -1;
+            cache.seq[i] = 0;
+            continue;
+        }
+        cache.seq[i] = bit;
+        n_found++;
+    }
+
+    whisper_kv_cache_trim_used(cache);
+
+    cache.head = 0;
+
+    return n_found == n_past;
+}
+
+// fill the attention mask of each token of the batch over the first n_kv cells:
+// -INFINITY for the cells that are not in its sequence or come after it, 0 otherwise
+static void whisper_kv_cache_mask(
+    const struct whisper_kv_cache & cache,
+        const struct whisper_batch & batch,
+                            int32_t   n_kv,
+                              float * data) {
+    for (int j = 0; j < batch.n_tokens; ++j) {
+        const whisper_pos      pos = batch.pos[j];
+        const whisper_seq_mask bit = whisper_seq_bit(batch.seq_id[j][0]);
+
+        float * row = data + j*n_kv;
+
+        for (int i = 0; i < n_kv; ++i) {
+            row[i] = (cache.seq[i] & bit) && cache.pos[i] <= pos ? 0.0f : -INFINITY;
         }
     }
 }
@@ -1505,6 +1901,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         tmp.reserve(128);
 
+        // ~7.5 bytes per token for the multilingual vocab
+        vocab.token_data.reserve(8*std::max(n_vocab, model.hparams.n_vocab));
+        vocab.token_offs.reserve(std::max(n_vocab, model.hparams.n_vocab) + 1);
+
         for (int i = 0; i < n_vocab; i++) {
             uint32_t len;
             read_safe(loader, len);
@@ -1512,17 +1912,15 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             if (len > 0) {
                 tmp.resize(len);
                 loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-                word.assign(&tmp[0], tmp.size());
             } else {
                 // seems like we have an empty-string token in multi-language models (i = 50256)
                 //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
-                word = "";
+                tmp.clear();
             }
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            vocab.add_token(tmp.data(), tmp.size());
 
-            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+            //printf("%s: vocab[%d] = '%s'\n", __func__, i, vocab.token_to_str(i));
         }
 
         vocab.n_vocab = model.hparams.n_vocab;
@@ -1570,11 +1968,12 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 } else {
                     word = "[_extra_token_" + std::to_string(i) + "]";
                 }
-                vocab.token_to_id[word] = i;
-                vocab.id_to_token[i] = word;
+                vocab.add_token(word.data(), word.size());
             }
         }
 
+        vocab.build_index();
+
         WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
     }
 
@@ -1800,7 +2199,12 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     }
 
     // allocate tensors in the backend buffers
-    model.buffer = wsp_ggml_backend_alloc_ctx_tensors_from_buft(model.ctx, whisper_default_buffer_type(wctx.params));
+    // weights loaded from a mapped file are placed by the loop below
+    if (model.mapping) {
+        model.buffer = wsp_ggml_backend_cpu_buffer_from_ptr(model.mapping->addr, model.mapping->size);
+    } else {
+        model.buffer = wsp_ggml_backend_alloc_ctx_tensors_from_buft(model.ctx, whisper_default_buffer_type(wctx.params));
+    }
     if (!model.buffer) {
         WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
         return false;
@@ -1815,6 +2219,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         model.n_loaded = 0;
 
+        std::string name;
         std::vector<char> read_buf;
 
         while (true) {
@@ -1837,10 +2242,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 nelements *= ne[i];
             }
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+            name.resize(length);
+            loader->read(loader->context, &name[0], name.size());
 
             if (model.tensors.find(name) == model.tensors.end()) {
                 WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
@@ -1874,7 +2277,17 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
             //printf("%s: [%5.5s] %s\n", __func__, wsp_ggml_backend_name(backend), name.c_str());
 
-            if (wsp_ggml_backend_buffer_is_host(model.buffer)) {
+            if (model.mapping) {
+                // the tensor data is used in place from the mapped file
+                auto & mapping = *model.mapping;
+                if (mapping.pos + wsp_ggml_nbytes(tensor) > mapping.size) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' is truncated in model file\n", __func__, name.data());
+                    return false;
+                }
+
+                wsp_ggml_backend_tensor_alloc(model.buffer, tensor, (char *) mapping.addr + mapping.pos);
+                mapping.pos += wsp_ggml_nbytes(tensor);
+            } else if (wsp_ggml_backend_buffer_is_host(model.buffer)) {
                 // for the CPU and Metal backend, we can read directly into the tensor
                 loader->read(loader->context, tensor->data, wsp_ggml_nbytes(tensor));
                 BYTESWAP_TENSOR(tensor);
@@ -2318,6 +2731,8 @@ static bool whisper_encode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = wsp_ggml_time_us();
 
+    wstate.enc_mel_offset = -1;
+
     // conv
     {
         auto & sched = wstate.sched_conv.sched;
@@ -2357,7 +2772,7 @@ static bool whisper_encode_internal(
         }
 
         if (!whisper_encode_external(wstate)) {
-            if (!wsp_ggml_graph_compute_helper(sched, gf, n_threads)) {
+            if (!wsp_ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
                 return false;
             }
         } else {
@@ -2380,7 +2795,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!wsp_ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!wsp_ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
             return false;
         }
     }
@@ -2396,7 +2811,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!wsp_ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!wsp_ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
             return false;
         }
     }
@@ -2404,7 +2819,14 @@ static bool whisper_encode_internal(
     wstate.t_encode_us += wsp_ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
-    return !(abort_callback && abort_callback(abort_callback_data));
+    if (abort_callback && abort_callback(abort_callback_data)) {
+        return false;
+    }
+
+    wstate.enc_mel_offset  = mel_offset;
+    wstate.enc_n_audio_ctx = wstate.exp_n_audio_ctx;
+
+    return true;
 }
 
 static struct wsp_ggml_cgraph * whisper_build_graph_decoder(
@@ -2432,6 +2854,9 @@ static struct wsp_ggml_cgraph * whisper_build_graph_decoder(
 
     const int n_audio_ctx_pad = WSP_GGML_PAD(n_audio_ctx, 256);
 
+    // at most one sampled row per decoder in the worst case
+    const int n_outputs = worst_case ? std::min(n_tokens, WHISPER_MAX_DECODERS) : whisper_batch_n_outputs(batch);
+
     const int32_t n_kv    = worst_case ? n_ctx            : kv_self.n;
     const int32_t kv_head = worst_case ? n_ctx - n_tokens : kv_self.head;
 
@@ -2447,6 +2872,9 @@ static struct wsp_ggml_cgraph * whisper_build_graph_decoder(
 
     wsp_ggml_cgraph * gf = wsp_ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
+    // the graph overwrites the previous one in the meta buffer
+    wstate.decode_graph = whisper_decode_graph();
+
     struct wsp_ggml_tensor * embd = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_I32, n_tokens);
     wsp_ggml_set_name(embd, "embd");
     wsp_ggml_set_input(embd);
@@ -2538,8 +2966,21 @@ static struct wsp_ggml_cgraph * whisper_build_graph_decoder(
                             (il*n_ctx)*wsp_ggml_element_size(kv_self.v)*n_state + kv_head*wsp_ggml_element_size(kv_self.v));
                 }
 
-                wsp_ggml_build_forward_expand(gf, wsp_ggml_cpy(ctx0, Kcur, k));
-                wsp_ggml_build_forward_expand(gf, wsp_ggml_cpy(ctx0, Vcur, v));
+                struct wsp_ggml_tensor * k_cpy = wsp_ggml_cpy(ctx0, Kcur, k);
+                struct wsp_ggml_tensor * v_cpy = wsp_ggml_cpy(ctx0, Vcur, v);
+
+                wsp_ggml_build_forward_expand(gf, k_cpy);
+                wsp_ggml_build_forward_expand(gf, v_cpy);
+
+                if (!worst_case) {
+                    const size_t k_stride = wsp_ggml_element_size(kv_self.k)*n_state;
+                    const size_t v_stride = wsp_ggml_element_size(kv_self.v)*(wctx.params.flash_attn ? n_state : 1);
+
+                    wstate.decode_graph.kv_store.push_back({ k,     k_stride });
+                    wstate.decode_graph.kv_store.push_back({ k_cpy, k_stride });
+                    wstate.decode_graph.kv_store.push_back({ v,     v_stride });
+                    wstate.decode_graph.kv_store.push_back({ v_cpy, v_stride });
+                }
             }
 
             // ------
@@ -2752,6 +3193,16 @@ static struct wsp_ggml_cgraph * whisper_build_graph_decoder(
 
     cur = inpL;
 
+    // compute logits only for the tokens that have batch.logits set
+    // always through get_rows, so that the graph keeps the same nodes as the worst case one
+    if (n_outputs > 0) {
+        struct wsp_ggml_tensor * out_ids = wsp_ggml_new_tensor_1d(ctx0, WSP_GGML_TYPE_I32, n_outputs);
+        wsp_ggml_set_name(out_ids, "out_ids");
+        wsp_ggml_set_input(out_ids);
+
+        cur = wsp_ggml_get_rows(ctx0, cur, out_ids);
+    }
+
     // norm
     {
         cur = wsp_ggml_norm(ctx0, cur, hparams.eps);
@@ -2763,11 +3214,6 @@ static struct wsp_ggml_cgraph * whisper_build_graph_decoder(
                 model.d_ln_b);
     }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all n_tokens
-    // might be useful in the future
-    //cur = wsp_ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
-
     struct wsp_ggml_tensor * logits = wsp_ggml_mul_mat(ctx0, model.d_te, cur);
 
     // [EXPERIMENTAL] Token-level timestamps with DTW
@@ -2787,6 +3233,32 @@ static struct wsp_ggml_cgraph * whisper_build_graph_decoder(
     return gf;
 }
 
+// drop the cached decoder graph and its allocation in sched_decode
+static void whisper_decode_graph_reset(whisper_state & wstate) {
+    if (wstate.decode_graph.allocated) {
+        wsp_ggml_backend_sched_reset(wstate.sched_decode.sched);
+    }
+    wstate.decode_graph = whisper_decode_graph();
+}
+
+// move the K/V store views of the cached decoder graph to a new kv_self.head
+static void whisper_decode_graph_set_kv_head(whisper_decode_graph & g, int32_t kv_head) {
+    if (kv_head == g.kv_head) {
+        return;
+    }
+
+    const int64_t delta = (int64_t) kv_head - g.kv_head;
+
+    for (auto & store : g.kv_store) {
+        wsp_ggml_tensor * t = store.first;
+
+        t->view_offs = (size_t) ((int64_t) t->view_offs + delta*(int64_t) store.second);
+        t->data      = (char *) t->view_src->data + t->view_offs;
+    }
+
+    g.kv_head = kv_head;
+}
+
 // evaluate the decoder
 //
 // given text prompt + audio features -> computes the logits for the next token
@@ -2810,8 +3282,9 @@ static bool whisper_decode_internal(
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_vocab  = hparams.n_vocab;
-    const int n_tokens = batch.n_tokens;
+    const int n_vocab   = hparams.n_vocab;
+    const int n_tokens  = batch.n_tokens;
+    const int n_outputs = whisper_batch_n_outputs(batch);
 
     auto & logits_out = wstate.logits;
 
@@ -2825,7 +3298,8 @@ static bool whisper_decode_internal(
             return false;
         }
 
-        const uint32_t pad = whisper_kv_cache_get_padding(wctx);
+        // n_kv is rounded up so that consecutive steps can reuse the decoder graph, the extra cells are masked out
+        const uint32_t pad = std::max(whisper_kv_cache_get_padding(wctx), WHISPER_DECODE_KV_PAD);
         kv_self.n = std::min(kv_self.size, std::max(pad, WSP_GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
 
         //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
@@ -2834,76 +3308,97 @@ static bool whisper_decode_internal(
 
     // decoder
     {
-        auto & sched = wstate.sched_decode.sched;
+        auto & sched   = wstate.sched_decode.sched;
+        auto & kv_self = wstate.kv_self;
+        auto & g       = wstate.decode_graph;
 
-        wsp_ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+        const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-        if (!wsp_ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+        const bool reuse =
+            g.gf          != nullptr     &&
+            g.n_tokens    == n_tokens    &&
+            g.n_outputs   == n_outputs   &&
+            g.n_kv        == (int) kv_self.n &&
+            g.n_audio_ctx == n_audio_ctx &&
+            g.save_aheads == save_alignment_heads_QKs;
 
-        // set the inputs
-        {
-            struct wsp_ggml_tensor * embd = wsp_ggml_graph_get_tensor(gf, "embd");
-            wsp_ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*wsp_ggml_element_size(embd));
+        if (reuse) {
+            whisper_decode_graph_set_kv_head(g, kv_self.head);
+
+            wstate.aheads_cross_QKs = g.aheads_cross_QKs;
+        } else {
+            whisper_decode_graph_reset(wstate);
+
+            wsp_ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+
+            g.gf          = gf;
+            g.n_tokens    = n_tokens;
+            g.n_outputs   = n_outputs;
+            g.n_kv        = kv_self.n;
+            g.n_audio_ctx = n_audio_ctx;
+            g.save_aheads = save_alignment_heads_QKs;
+            g.kv_head     = kv_self.head;
+
+            g.embd     = wsp_ggml_graph_get_tensor(gf, "embd");
+            g.position = wsp_ggml_graph_get_tensor(gf, "position");
+            g.KQ_mask  = wsp_ggml_graph_get_tensor(gf, "KQ_mask");
+            g.out_ids  = n_outputs > 0 ? wsp_ggml_graph_get_tensor(gf, "out_ids") : nullptr;
+            g.logits   = wsp_ggml_graph_node(gf, -1);
+
+            g.aheads_cross_QKs = save_alignment_heads_QKs ? wstate.aheads_cross_QKs : nullptr;
         }
 
-        {
-            struct wsp_ggml_tensor * position = wsp_ggml_graph_get_tensor(gf, "position");
-            for (int i = 0; i < n_tokens; ++i) {
-                const int32_t val = batch.pos[i];
-                wsp_ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
+        wsp_ggml_cgraph * gf = g.gf;
+
+        if (!g.allocated) {
+            if (!wsp_ggml_backend_sched_alloc_graph(sched, gf)) {
+                // should never happen as we pre-allocate the memory
+                return false;
             }
+            g.allocated = true;
         }
 
-        {
-            struct wsp_ggml_tensor * KQ_mask = wsp_ggml_graph_get_tensor(gf, "KQ_mask");
-
-            auto & kv_self = wstate.kv_self;
+        // set the inputs
+        wsp_ggml_backend_tensor_set(g.embd,     batch.token, 0, n_tokens*wsp_ggml_element_size(g.embd));
+        wsp_ggml_backend_tensor_set(g.position, batch.pos,   0, n_tokens*wsp_ggml_element_size(g.position));
 
+        {
             const int32_t n_kv = kv_self.n;
 
-            wstate.inp_mask.resize(wsp_ggml_nelements(KQ_mask));
+            wstate.inp_mask.resize(wsp_ggml_nelements(g.KQ_mask));
 
             float * data = wstate.inp_mask.data();
-            memset(data, 0, wsp_ggml_nbytes(KQ_mask));
 
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+            whisper_kv_cache_mask(kv_self, batch, n_kv, data);
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                        }
-                    }
-                }
+            std::fill(data + n_tokens*n_kv, data + wsp_ggml_nelements(g.KQ_mask), -INFINITY);
 
-                for (int i = n_tokens; i < WSP_GGML_PAD(n_tokens, WSP_GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                    }
+            wsp_ggml_backend_tensor_set(g.KQ_mask, data, 0, wsp_ggml_nbytes(g.KQ_mask));
+        }
+
+        if (g.out_ids) {
+            wstate.inp_out_ids.clear();
+            for (int i = 0; i < n_tokens; ++i) {
+                if (batch.logits[i]) {
+                    wstate.inp_out_ids.push_back(i);
                 }
             }
 
-            wsp_ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, wsp_ggml_nelements(KQ_mask)*sizeof(float));
+            wsp_ggml_backend_tensor_set(g.out_ids, wstate.inp_out_ids.data(), 0, n_outputs*sizeof(int32_t));
         }
 
-        logits = wsp_ggml_graph_node(gf, -1);
+        logits = g.logits;
 
-        if (!wsp_ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!wsp_ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool, true)) {
+            g.allocated = false;
             return false;
         }
     }
 
-    logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
-            continue;
-        }
-        wsp_ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
+    // the graph computed only the rows that are output, in batch order
+    logits_out.resize(n_outputs*n_vocab);
+    if (n_outputs > 0) {
+        wsp_ggml_backend_tensor_get(logits, logits_out.data(), 0, sizeof(float)*n_outputs*n_vocab);
     }
 
     if (batch.n_tokens > 1) {
@@ -2947,7 +3442,41 @@ static std::string to_timestamp(int64_t t, bool comma = false) {
 }
 
 #define SIN_COS_N_COUNT WHISPER_N_FFT
+#define WHISPER_FFT_MAX_STAGES 16
+
 namespace {
+// one pass of the iterative Stockham FFT used by whisper_fft_plan
+struct whisper_fft_stage {
+    int radix;
+    int n;      // length of the sub-transforms at this stage
+    int stride; // number of interleaved sub-transforms
+
+    // twiddle factors w^(k*p), stored as [k - 1][p] for k = 1..radix-1, p = 0..n/radix-1
+    std::vector<float> tw_re;
+    std::vector<float> tw_im;
+};
+
+// Real-input FFT of size n, planned once at startup
+//
+// The real frame is packed into a complex sequence of n/2 points, transformed with a mixed-radix
+// (4, 2, 5) Stockham FFT - iterative, self-sorting, no scratch allocation - and split back into
+// the n/2 + 1 bins of the real spectrum. All twiddles are read from the sin/cos tables.
+struct whisper_fft_plan {
+    int n      = 0;
+    int n_half = 0;
+
+    int n_stages = 0;
+    whisper_fft_stage stages[WHISPER_FFT_MAX_STAGES];
+
+    // cos/sin of 2*pi/5 and 4*pi/5 for the radix-5 butterfly
+    float c5_1, c5_2, s5_1, s5_2;
+
+    // number of floats of scratch space needed by whisper_rfft()
+    int scratch_size() const {
+        return 4*n_half;
+    }
+};
+
 struct whisper_global_cache {
     // In FFT, we frequently use sine and cosine operations with the same values.
     // We can use precalculated values to speed up the process.
@@ -2959,9 +3488,17 @@ struct whisper_global_cache {
     // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
     float hann_window[WHISPER_N_FFT];
 
+    // FFT plan for the mel front-end
+    whisper_fft_plan fft_plan;
+
+    // log mel value of an all-zero frame
+    float log_mel_silence;
+
     whisper_global_cache() {
         fill_sin_cos_table();
         fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
+        fill_fft_plan(WHISPER_N_FFT, fft_plan);
+        log_mel_silence = log10(1e-10);
     }
 
     void fill_sin_cos_table() {
@@ -2981,140 +3518,337 @@ struct whisper_global_cache {
             output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
         }
     }
-} global_cache;
-}
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const float* in, int N, float* out) {
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+    void fill_fft_plan(int n, whisper_fft_plan & plan) {
+        // all twiddles must be representable in the sin/cos tables
+        assert(n % 2 == 0 && SIN_COS_N_COUNT % n == 0);
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+        plan.n      = n;
+        plan.n_half = n/2;
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*global_cache.cos_vals[idx]; // cos(t)
-            im -= in[n]*global_cache.sin_vals[idx]; // sin(t)
-        }
+        plan.c5_1 = cos_vals[1*SIN_COS_N_COUNT/5];
+        plan.c5_2 = cos_vals[2*SIN_COS_N_COUNT/5];
+        plan.s5_1 = sin_vals[1*SIN_COS_N_COUNT/5];
+        plan.s5_2 = sin_vals[2*SIN_COS_N_COUNT/5];
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
-    }
-}
+        // factorize, preferring radix-4 so that the later (wider) stages can be vectorized
+        int len    = plan.n_half;
+        int stride = 1;
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(float* in, int N, float* out) {
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
-    }
+        plan.n_stages = 0;
+        while (len > 1) {
+            int radix = 0;
+            if      (len % 4 == 0) radix = 4;
+            else if (len % 2 == 0) radix = 2;
+            else if (len % 5 == 0) radix = 5;
 
-    const int half_N = N / 2;
-    if (N - half_N*2 == 1) {
-        dft(in, N, out);
-        return;
-    }
+            assert(radix != 0 && "unsupported FFT size");
+            assert(plan.n_stages < WHISPER_FFT_MAX_STAGES);
 
-    float* even = in + N;
-    for (int i = 0; i < half_N; ++i) {
-        even[i]= in[2*i];
-    }
-    float* even_fft = out + 2 * N;
-    fft(even, half_N, even_fft);
+            whisper_fft_stage & stage = plan.stages[plan.n_stages++];
 
-    float* odd = even;
-    for (int i = 0; i < half_N; ++i) {
-        odd[i] = in[2*i + 1];
-    }
-    float* odd_fft = even_fft + N;
-    fft(odd, half_N, odd_fft);
+            const int m    = len/radix;
+            const int step = SIN_COS_N_COUNT/len; // t = 2*M_PI*k*p/len
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < half_N; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = global_cache.cos_vals[idx]; // cos(t)
-        float im = -global_cache.sin_vals[idx]; // sin(t)
+            stage.radix  = radix;
+            stage.n      = len;
+            stage.stride = stride;
+            stage.tw_re.resize((radix - 1)*m);
+            stage.tw_im.resize((radix - 1)*m);
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+            for (int k = 1; k < radix; k++) {
+                for (int p = 0; p < m; p++) {
+                    const int idx = (k*p*step) % SIN_COS_N_COUNT;
+                    stage.tw_re[(k - 1)*m + p] =  cos_vals[idx];
+                    stage.tw_im[(k - 1)*m + p] = -sin_vals[idx];
+                }
+            }
+
+            len    /= radix;
+            stride *= radix;
+        }
+    }
+} global_cache;
+
+// minimal vector abstraction so that each butterfly is written once for the scalar and SIMD paths
+inline float fft_ld (const float * p, float) { return *p; }
+inline void  fft_st (float * p, float v)     { *p = v; }
+inline float fft_set(float v, float)         { return v; }
+inline float fft_add(float a, float b)       { return a + b; }
+inline float fft_sub(float a, float b)       { return a - b; }
+inline float fft_mul(float a, float b)       { return a * b; }
+
+#if defined(__ARM_NEON)
+#define WHISPER_FFT_VEC_WIDTH 4
+typedef float32x4_t whisper_fft_vec;
+inline whisper_fft_vec fft_ld (const float * p, whisper_fft_vec)      { return vld1q_f32(p); }
+inline void            fft_st (float * p, whisper_fft_vec v)          { vst1q_f32(p, v); }
+inline whisper_fft_vec fft_set(float v, whisper_fft_vec)              { return vdupq_n_f32(v); }
+inline whisper_fft_vec fft_add(whisper_fft_vec a, whisper_fft_vec b)  { return vaddq_f32(a, b); }
+inline whisper_fft_vec fft_sub(whisper_fft_vec a, whisper_fft_vec b)  { return vsubq_f32(a, b); }
+inline whisper_fft_vec fft_mul(whisper_fft_vec a, whisper_fft_vec b)  { return vmulq_f32(a, b); }
+#elif defined(__AVX2__)
+#define WHISPER_FFT_VEC_WIDTH 8
+typedef __m256 whisper_fft_vec;
+inline whisper_fft_vec fft_ld (const float * p, whisper_fft_vec)      { return _mm256_loadu_ps(p); }
+inline void            fft_st (float * p, whisper_fft_vec v)          { _mm256_storeu_ps(p, v); }
+inline whisper_fft_vec fft_set(float v, whisper_fft_vec)              { return _mm256_set1_ps(v); }
+inline whisper_fft_vec fft_add(whisper_fft_vec a, whisper_fft_vec b)  { return _mm256_add_ps(a, b); }
+inline whisper_fft_vec fft_sub(whisper_fft_vec a, whisper_fft_vec b)  { return _mm256_sub_ps(a, b); }
+inline whisper_fft_vec fft_mul(whisper_fft_vec a, whisper_fft_vec b)  { return _mm256_mul_ps(a, b); }
+#endif
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+// one Stockham pass: reads the sub-transforms of length stage.n from (xr, xi), writes the radix
+// butterflies multiplied by their twiddles into (yr, yi); the W lanes of V run over adjacent sub-transforms
+template <typename V, int W>
+void fft_stage(const whisper_fft_plan & plan, const whisper_fft_stage & stage,
+               const float * xr, const float * xi, float * yr, float * yi) {
+    const int r = stage.radix;
+    const int s = stage.stride;
+    const int m = stage.n/r;
+
+    const V z = V();
+
+    for (int p = 0; p < m; p++) {
+        V wr[4];
+        V wi[4];
+        for (int k = 1; k < r; k++) {
+            wr[k - 1] = fft_set(stage.tw_re[(k - 1)*m + p], z);
+            wi[k - 1] = fft_set(stage.tw_im[(k - 1)*m + p], z);
+        }
+
+        for (int q = 0; q < s; q += W) {
+            V ar[5];
+            V ai[5];
+            for (int j = 0; j < r; j++) {
+                ar[j] = fft_ld(xr + q + s*(p + j*m), z);
+                ai[j] = fft_ld(xi + q + s*(p + j*m), z);
+            }
+
+            V br[5];
+            V bi[5];
+            switch (r) {
+                case 2:
+                    {
+                        br[0] = fft_add(ar[0], ar[1]); bi[0] = fft_add(ai[0], ai[1]);
+                        br[1] = fft_sub(ar[0], ar[1]); bi[1] = fft_sub(ai[0], ai[1]);
+                    } break;
+                case 4:
+                    {
+                        const V t0r = fft_add(ar[0], ar[2]), t0i = fft_add(ai[0], ai[2]);
+                        const V t1r = fft_sub(ar[0], ar[2]), t1i = fft_sub(ai[0], ai[2]);
+                        const V t2r = fft_add(ar[1], ar[3]), t2i = fft_add(ai[1], ai[3]);
+                        const V t3r = fft_sub(ar[1], ar[3]), t3i = fft_sub(ai[1], ai[3]);
+
+                        br[0] = fft_add(t0r, t2r); bi[0] = fft_add(t0i, t2i);
+                        br[2] = fft_sub(t0r, t2r); bi[2] = fft_sub(t0i, t2i);
+                        br[1] = fft_add(t1r, t3i); bi[1] = fft_sub(t1i, t3r); // t1 - i*t3
+                        br[3] = fft_sub(t1r, t3i); bi[3] = fft_add(t1i, t3r); // t1 + i*t3
+                    } break;
+                case 5:
+                    {
+                        const V c1 = fft_set(plan.c5_1, z), c2 = fft_set(plan.c5_2, z);
+                        const V s1 = fft_set(plan.s5_1, z), s2 = fft_set(plan.s5_2, z);
+
+                        const V t1r = fft_add(ar[1], ar[4]), t1i = fft_add(ai[1], ai[4]);
+                        const V t2r = fft_add(ar[2], ar[3]), t2i = fft_add(ai[2], ai[3]);
+                        const V t3r = fft_sub(ar[1], ar[4]), t3i = fft_sub(ai[1], ai[4]);
+                        const V t4r = fft_sub(ar[2], ar[3]), t4i = fft_sub(ai[2], ai[3]);
+
+                        br[0] = fft_add(ar[0], fft_add(t1r, t2r));
+                        bi[0] = fft_add(ai[0], fft_add(t1i, t2i));
+
+                        const V m1r = fft_add(ar[0], fft_add(fft_mul(c1, t1r), fft_mul(c2, t2r)));
+                        const V m1i = fft_add(ai[0], fft_add(fft_mul(c1, t1i), fft_mul(c2, t2i)));
+                        const V m2r = fft_add(ar[0], fft_add(fft_mul(c2, t1r), fft_mul(c1, t2r)));
+                        const V m2i = fft_add(ai[0], fft_add(fft_mul(c2, t1i), fft_mul(c1, t2i)));
+
+                        const V n1r = fft_add(fft_mul(s1, t3r), fft_mul(s2, t4r));
+                        const V n1i = fft_add(fft_mul(s1, t3i), fft_mul(s2, t4i));
+                        const V n2r = fft_sub(fft_mul(s2, t3r), fft_mul(s1, t4r));
+                        const V n2i = fft_sub(fft_mul(s2, t3i), fft_mul(s1, t4i));
+
+                        br[1] = fft_add(m1r, n1i); bi[1] = fft_sub(m1i, n1r); // m1 - i*n1
+                        br[4] = fft_sub(m1r, n1i); bi[4] = fft_add(m1i, n1r); // m1 + i*n1
+                        br[2] = fft_add(m2r, n2i); bi[2] = fft_sub(m2i, n2r); // m2 - i*n2
+                        br[3] = fft_sub(m2r, n2i); bi[3] = fft_add(m2i, n2r); // m2 + i*n2
+                    } break;
+                default:
+                    assert(false && "unsupported FFT radix");
+            }
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+            fft_st(yr + q + s*r*p, br[0]);
+            fft_st(yi + q + s*r*p, bi[0]);
+            for (int k = 1; k < r; k++) {
+                fft_st(yr + q + s*(r*p + k), fft_sub(fft_mul(br[k], wr[k - 1]), fft_mul(bi[k], wi[k - 1])));
+                fft_st(yi + q + s*(r*p + k), fft_add(fft_mul(br[k], wi[k - 1]), fft_mul(bi[k], wr[k - 1])));
+            }
+        }
     }
 }
+}
 
-static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
-
-    int n_fft = filters.n_fft;
-    int i = ith;
+// FFT of a real frame of plan.n samples, using the precomputed plan
+// scratch must hold plan.scratch_size() floats
+// output is the complex half-spectrum: plan.n/2 + 1 interleaved (re, im) pairs
+static void whisper_rfft(const whisper_fft_plan & plan, const float * in, float * scratch, float * out) {
+    const int M = plan.n_half;
 
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    assert(n_fft == 1 + (frame_size / 2));
+    float * xr = scratch;
+    float * xi = scratch + M;
+    float * yr = scratch + 2*M;
+    float * yi = scratch + 3*M;
 
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+    // pack the even/odd samples as the real/imaginary parts of a half-length complex sequence
+    for (int i = 0; i < M; i++) {
+        xr[i] = in[2*i + 0];
+        xi[i] = in[2*i + 1];
+    }
 
-        // apply Hann window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
+    for (int i = 0; i < plan.n_stages; i++) {
+        const whisper_fft_stage & stage = plan.stages[i];
+#ifdef WHISPER_FFT_VEC_WIDTH
+        if (stage.stride % WHISPER_FFT_VEC_WIDTH == 0) {
+            fft_stage<whisper_fft_vec, WHISPER_FFT_VEC_WIDTH>(plan, stage, xr, xi, yr, yi);
+        } else
+#endif
+        {
+            fft_stage<float, 1>(plan, stage, xr, xi, yr, yi);
         }
+        std::swap(xr, yr);
+        std::swap(xi, yi);
+    }
+
+    // split the half-length spectrum Z into the spectrum X of the real input:
+    //   X[k] = (Z[k] + conj(Z[M-k]))/2 - i*w^k*(Z[k] - conj(Z[M-k]))/2, w = exp(-2*pi*i/n)
+    const int sin_cos_step = SIN_COS_N_COUNT / plan.n;
+    for (int k = 0; k <= M; k++) {
+        const float zr  = xr[k % M];
+        const float zi  = xi[k % M];
+        const float zcr =  xr[(M - k) % M];
+        const float zci = -xi[(M - k) % M];
 
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
+        const float er = 0.5f*(zr + zcr);
+        const float ei = 0.5f*(zi + zci);
+        const float or_ =  0.5f*(zi - zci);
+        const float oi  = -0.5f*(zr - zcr);
+
+        const float wr =  global_cache.cos_vals[k*sin_cos_step];
+        const float wi = -global_cache.sin_vals[k*sin_cos_step];
+
+        out[2*k + 0] = er + wr*or_ - wi*oi;
+        out[2*k + 1] = ei + wr*oi  + wi*or_;
+    }
+}
+
+// log mel spectrum of a single windowed frame
+// fft_in holds frame_size samples, the result (log10 of the mel power) is written to out[j*out_stride]
+static void log_mel_spectrogram_frame(const whisper_fft_plan & plan, const float * fft_in, float * fft_out, float * fft_scratch,
+                                      const whisper_filters & filters, int n_mel, float * out, int out_stride) {
+    const int n_fft = filters.n_fft;
+
+    // FFT
+    whisper_rfft(plan, fft_in, fft_scratch, fft_out);
+
+    // Calculate modulus^2 of complex numbers
+    // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
+    for (int j = 0; j < n_fft; j++) {
+        fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+    }
+
+    // mel spectrogram
+    for (int j = 0; j < n_mel; j++) {
+        double sum = 0.0;
+        // unroll loop (suggested by GH user @lunixbochs)
+        int k = 0;
+        for (k = 0; k < n_fft - 3; k += 4) {
+            sum +=
+                    fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
+                    fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
+                    fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
+                    fft_out[k + 3] * filters.data[j * n_fft + k + 3];
+        }
+        // handle n_fft remainder
+        for (; k < n_fft; k++) {
+            sum += fft_out[k] * filters.data[j * n_fft + k];
         }
+        sum = log10(std::max(sum, 1e-10));
+        out[j * out_stride] = sum;
+    }
+}
 
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
+// The input of log_mel_spectrogram() as seen by the STFT: n_pad reflected samples in front of the
+// audio, followed by the audio and zeros. The padding is computed on the fly, nothing is copied.
+// The audio is either float or 16-bit PCM, the latter is scaled to [-1, 1) while it is windowed.
+struct whisper_padded_view {
+    const float   * samples;
+    const int16_t * samples_i16;
+    int n_samples;
+    int n_pad;
+
+    // the padded signal is zero from this position on
+    int n_data() const {
+        return n_pad + n_samples;
+    }
+
+    // unpadded sample k, 0 <= k < n_samples
+    float sample(int k) const {
+        return samples_i16 ? samples_i16[k] * (1.0f/32768.0f) : samples[k];
+    }
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+    // padded sample at position k
+    float at(int k) const {
+        k -= n_pad;
+        if (k < 0) {
+            k = -k; // reflect around samples[0]
         }
+        return k < n_samples ? sample(k) : 0.0f;
+    }
+
+    // Hann-windowed frame of frame_size samples starting at padded position offset
+    void load_frame(int offset, const float * hann, int frame_size, float * out) const {
+        const int k0 = offset - n_pad;
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
+        if (k0 >= 0 && k0 + frame_size <= n_samples && samples_i16) {
+            // scaling by a power of 2 is exact, so this matches converting to float first
+            const int16_t * src = samples_i16 + k0;
+            for (int j = 0; j < frame_size; j++) {
+                out[j] = hann[j] * (src[j] * (1.0f/32768.0f));
             }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
+        } else if (k0 >= 0 && k0 + frame_size <= n_samples) {
+            const float * src = samples + k0;
+            for (int j = 0; j < frame_size; j++) {
+                out[j] = hann[j] * src[j];
+            }
+        } else {
+            for (int j = 0; j < frame_size; j++) {
+                out[j] = hann[j] * at(offset + j);
             }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
         }
     }
+};
 
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
-        }
+static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const whisper_padded_view & samples,
+                                              int n_frames, int frame_size, int frame_step, int n_threads,
+                                              const whisper_filters & filters, whisper_mel & mel) {
+    const whisper_fft_plan & plan = global_cache.fft_plan;
+
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_out(frame_size + 2);
+    std::vector<float> fft_scratch(plan.scratch_size());
+
+    int n_fft = filters.n_fft;
+    int i = ith;
+
+    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+    assert(n_fft == 1 + (frame_size / 2));
+
+    // calculate FFT only when fft_in are not all zero, the remaining frames are filled by the caller
+    for (; i < n_frames; i += n_threads) {
+        // apply Hann window (~10% faster)
+        samples.load_frame(i * frame_step, hann, frame_size, fft_in.data());
+
+        log_mel_spectrogram_frame(plan, fft_in.data(), fft_out.data(), fft_scratch.data(), filters, mel.n_mel, mel.data.data() + i, mel.n_len);
     }
 }
 
@@ -3122,6 +3856,7 @@ static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const
 static bool log_mel_spectrogram(
               whisper_state & wstate,
               const float * samples,
+            const int16_t * samples_i16,
               const int   n_samples,
               const int   /*sample_rate*/,
               const int   frame_size,
@@ -3133,6 +3868,9 @@ static bool log_mel_spectrogram(
               whisper_mel & mel) {
     const int64_t t_start_us = wsp_ggml_time_us();
 
+    // the encoder output belongs to the previous mel
+    wstate.enc_mel_offset = -1;
+
     // Hann window
     WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
     const float * hann = global_cache.hann_window;
@@ -3141,58 +3879,55 @@ static bool log_mel_spectrogram(
     int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
     int64_t stage_2_pad = frame_size / 2;
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
-    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
-
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
-
-    // reflective pad 200 samples at the beginning of audio
-    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+    // reflective pad 200 samples at the beginning of audio, pad 30 seconds of zeros (480,000 samples) + 200 samples at the end
+    const whisper_padded_view samples_padded = { samples, samples_i16, n_samples, (int) stage_2_pad };
 
     mel.n_mel     = n_mel;
     // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
     // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    mel.n_len     = (n_samples + stage_1_pad + stage_2_pad * 2 - frame_size) / frame_step;
     // Calculate semi-padded sample length to ensure compatibility
     mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
     mel.data.resize(mel.n_mel * mel.n_len);
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, hann, samples_padded,
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
-
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+    // frames past this one only see zero padding
+    const int n_frames = std::min(samples_padded.n_data() / frame_step + 1, mel.n_len);
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
-    }
+    whisper_parallel_for(wstate.threadpool, wstate.buf_parallel, n_threads, [&](int ith, int nth) {
+        log_mel_spectrogram_worker_thread(ith, hann, samples_padded, n_frames, frame_size, frame_step, nth, filters, mel);
+    });
 
     // clamping and normalization
+    const float silence = global_cache.log_mel_silence;
+
     double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+    for (int j = 0; j < mel.n_mel; j++) {
+        const float * row = mel.data.data() + j*mel.n_len;
+        for (int i = 0; i < n_frames; i++) {
+            if (row[i] > mmax) {
+                mmax = row[i];
+            }
         }
     }
+    if (mel.n_len > n_frames && silence > mmax) {
+        mmax = silence;
+    }
 
     mmax -= 8.0;
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
+    // the all-zero frames share the same normalized value
+    const float silence_norm = ((silence < mmax ? (float) mmax : silence) + 4.0)/4.0;
+
+    for (int j = 0; j < mel.n_mel; j++) {
+        float * row = mel.data.data() + j*mel.n_len;
+        for (int i = 0; i < n_frames; i++) {
+            if (row[i] < mmax) {
+                row[i] = mmax;
+            }
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+            row[i] = (row[i] + 4.0)/4.0;
+        }
+        std::fill(row + n_frames, row + mel.n_len, silence_norm);
     }
 
     wstate.t_mel_us += wsp_ggml_time_us() - t_start_us;
@@ -3211,6 +3946,131 @@ static bool log_mel_spectrogram(
     return true;
 }
 
+// incremental log mel spectrogram, see whisper_full_with_mel()
+struct whisper_mel_stream {
+    const whisper_filters * filters = nullptr;
+
+    // number of samples seen by the last update
+    int n_samples = 0;
+
+    // raw log10 mel power of the frames that are fully covered by the samples seen so far,
+    // stored frame by frame: [n_frames][n_mel]
+    int n_frames = 0;
+    std::vector<float> frames;
+
+    // max of the cached frames
+    float mmax = -1e20f;
+};
+
+// computes frames [i0, i1) into out, [i1 - i0][n_mel]
+static void log_mel_stream_worker_thread(int ith, int n_threads, const float * samples, int n_samples,
+                                         int i0, int i1, const whisper_filters & filters, float * out) {
+    const whisper_fft_plan & plan = global_cache.fft_plan;
+
+    std::vector<float> fft_in(WHISPER_N_FFT, 0.0);
+    std::vector<float> fft_out(WHISPER_N_FFT + 2);
+    std::vector<float> fft_scratch(plan.scratch_size());
+
+    const whisper_padded_view view = { samples, nullptr, n_samples, WHISPER_N_FFT/2 };
+
+    for (int i = i0 + ith; i < i1; i += n_threads) {
+        view.load_frame(i*WHISPER_HOP_LENGTH, global_cache.hann_window, WHISPER_N_FFT, fft_in.data());
+        log_mel_spectrogram_frame(plan, fft_in.data(), fft_out.data(), fft_scratch.data(), filters, filters.n_mel, out + (i - i0)*filters.n_mel, 1);
+    }
+}
+
+// brings the stream up to n_samples and writes the normalized spectrogram to state.mel
+// the result is identical to log_mel_spectrogram() over the same samples
+static void whisper_mel_stream_update(whisper_mel_stream & stream, const float * samples, int n_samples, int n_threads, whisper_state & state) {
+    state.enc_mel_offset = -1;
+
+    const whisper_filters & filters = *stream.filters;
+
+    whisper_mel & mel = state.mel;
+
+    const int n_mel       = filters.n_mel;
+    const int frame_step  = WHISPER_HOP_LENGTH;
+    const int stage_1_pad = WHISPER_SAMPLE_RATE * 30;
+    const int stage_2_pad = WHISPER_N_FFT / 2;
+
+    if (n_samples < stream.n_samples) {
+        // the audio was restarted
+        whisper_mel_stream_reset(&stream);
+    }
+    stream.n_samples = n_samples;
+
+    // same frame layout as log_mel_spectrogram()
+    const int n_len      = (n_samples + stage_1_pad) / frame_step;
+    const int n_computed = std::min((n_samples + stage_2_pad) / frame_step + 1, n_len);
+
+    // frame i covers the samples [i*frame_step - stage_2_pad, i*frame_step + stage_2_pad) and won't change anymore
+    // once all of them are available
+    const int n_stable = std::min(n_samples > stage_2_pad ? (n_samples - stage_2_pad + frame_step - 1) / frame_step : 0, n_computed);
+
+    if (n_stable > stream.n_frames) {
+        const int i0 = stream.n_frames;
+        const int i1 = n_stable;
+
+        stream.frames.resize(n_stable*n_mel);
+        float * out = stream.frames.data() + i0*n_mel;
+
+        whisper_parallel_for(state.threadpool, state.buf_parallel, std::max(1, std::min(n_threads, i1 - i0)), [&](int ith, int nth) {
+            log_mel_stream_worker_thread(ith, nth, samples, n_samples, i0, i1, filters, out);
+        });
+
+        for (int i = 0; i < (i1 - i0)*n_mel; i++) {
+            stream.mmax = std::max(stream.mmax, out[i]);
+        }
+
+        stream.n_frames = n_stable;
+    }
+
+    // frames that still overlap the end of the audio are recomputed every time
+    std::vector<float> tail((n_computed - n_stable)*n_mel);
+    log_mel_stream_worker_thread(0, 1, samples, n_samples, n_stable, n_computed, filters, tail.data());
+
+    // clamping and normalization
+    const float silence = global_cache.log_mel_silence;
+
+    double mmax = stream.mmax;
+    for (size_t i = 0; i < tail.size(); i++) {
+        if (tail[i] > mmax) {
+            mmax = tail[i];
+        }
+    }
+    if (n_len > n_computed && silence > mmax) {
+        mmax = silence;
+    }
+
+    mmax -= 8.0;
+
+    auto normalize = [mmax](float v) -> float {
+        if (v < mmax) {
+            v = mmax;
+        }
+        return (v + 4.0)/4.0;
+    };
+
+    mel.n_mel     = n_mel;
+    mel.n_len     = n_len;
+    mel.n_len_org = 1 + (n_samples + stage_2_pad - WHISPER_N_FFT) / frame_step;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+    const float silence_norm = normalize(silence);
+
+    for (int j = 0; j < n_mel; j++) {
+        float * dst = mel.data.data() + j*n_len;
+
+        for (int i = 0; i < n_stable; i++) {
+            dst[i] = normalize(stream.frames[i*n_mel + j]);
+        }
+        for (int i = n_stable; i < n_computed; i++) {
+            dst[i] = normalize(tail[(i - n_stable)*n_mel + j]);
+        }
+        std::fill(dst + n_computed, dst + n_len, silence_norm);
+    }
+}
+
 // split text into tokens
 //
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
@@ -3221,47 +4081,78 @@ static bool log_mel_spectrogram(
 // Regex (C++):
 // R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+// the pre-tokenizer below matches the C++ regex by hand, the character classes are ASCII as in the "C" locale
+static bool whisper_tok_is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+static bool whisper_tok_is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool whisper_tok_is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
 
-        std::regex re(pat);
-        std::smatch m;
+static bool whisper_tok_is_other(char c) {
+    return !whisper_tok_is_space(c) && !whisper_tok_is_alpha(c) && !whisper_tok_is_digit(c);
+}
+
+// length of the word starting at text[i]
+static int whisper_tok_word_len(const char * text, int i, int n) {
+    const char c = text[i];
+
+    // 's|'t|'re|'ve|'m|'ll|'d
+    if (c == '\'' && i + 1 < n) {
+        const char c1 = text[i + 1];
+        if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+            return 2;
+        }
+        if (i + 2 < n) {
+            const char c2 = text[i + 2];
+            if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+                return 3;
+            }
+        }
+    }
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
+    // ` ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+`
+    const int j = c == ' ' && i + 1 < n ? i + 1 : i;
+    for (auto is_class : { whisper_tok_is_alpha, whisper_tok_is_digit, whisper_tok_is_other }) {
+        if (is_class(text[j])) {
+            int k = j + 1;
+            while (k < n && is_class(text[k])) {
+                ++k;
             }
-            str = m.suffix();
+            return k - i;
         }
     }
 
-    // find the longest tokens that form the words:
+    // `\s+(?!\S)|\s+`: a whitespace run leaves its last character to the word that follows it
+    int k = i + 1;
+    while (k < n && whisper_tok_is_space(text[k])) {
+        ++k;
+    }
+    return k < n && k - i > 1 ? k - i - 1 : k - i;
+}
+
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
     std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
 
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
-                    break;
-                }
-                --j;
-            }
-            if (!found) {
+    const char * str = text.data();
+    const int    n   = text.size();
+
+    // split the text into words and find the longest tokens that form each word
+    for (int i = 0; i < n; ) {
+        const int end = i + whisper_tok_word_len(str, i, n);
+
+        while (i < end) {
+            whisper_vocab::id id = -1;
+            const int len = vocab.find_longest_prefix(str + i, end - i, id);
+            if (len > 0) {
+                tokens.push_back(id);
+                i += len;
+            } else {
                 WHISPER_LOG_ERROR("unknown token\n");
                 ++i;
             }
@@ -3410,7 +4301,10 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     }
 #endif
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+    // one row of logits per decoder, see whisper_decode_internal()
+    state->logits.reserve(ctx->vocab.n_vocab * WHISPER_MAX_DECODERS);
+
+    WHISPER_LOG_INFO("%s: logits buffer = %7.2f MB\n", __func__, state->logits.capacity()*sizeof(float) / 1e6);
 
     state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
 
@@ -3563,7 +4457,9 @@ struct whisper_context_params whisper_context_default_params() {
         /*.use_gpu              =*/ true,
         /*.use_coreml           =*/ false,
         /*.flash_attn           =*/ false,
+        /*.use_mmap             =*/ true,
         /*.gpu_device           =*/ 0,
+        /*.n_states_idle_max    =*/ 4,
 
         /*.dtw_token_timestamps =*/ false,
         /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
@@ -3577,8 +4473,67 @@ struct whisper_context_params whisper_context_default_params() {
     return result;
 }
 
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+      struct whisper_context_params   params,
+       std::unique_ptr<whisper_mmap>   mapping);
+
+// map the model file when its weights go to the CPU buffer type, they can then be used without a copy
+static struct whisper_context * whisper_init_from_mmap_with_params_no_state(const char * path_model, struct whisper_context_params params) {
+    if (!whisper_mmap::SUPPORTED || !params.use_mmap ||
+        whisper_default_buffer_type(params) != wsp_ggml_backend_cpu_buffer_type()) {
+        return nullptr;
+    }
+
+    std::unique_ptr<whisper_mmap> mapping(new whisper_mmap);
+    if (!mapping->open(path_model)) {
+        WHISPER_LOG_WARN("%s: failed to map '%s', reading it instead\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = mapping.get();
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+        const size_t size_to_copy = std::min(read_size, mapping->size - mapping->pos);
+
+        memcpy(output, (const char *) mapping->addr + mapping->pos, size_to_copy);
+        mapping->pos += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        whisper_mmap * mapping = (whisper_mmap *) ctx;
+        return mapping->pos >= mapping->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    const int64_t size = (int64_t) mapping->size;
+
+    auto ctx = whisper_init_with_params_no_state_impl(&loader, params, std::move(mapping));
+    if (ctx) {
+        ctx->load_bytes = size;
+    }
+
+    return ctx;
+}
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
+
+    if (whisper_mmap::SUPPORTED && params.use_mmap) {
+        auto ctx = whisper_init_from_mmap_with_params_no_state(path_model, params);
+        if (ctx) {
+            ctx->path_model = path_model;
+            return ctx;
+        }
+    }
+
 #ifdef _MSC_VER
     // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
     std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
@@ -3599,7 +4554,7 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
     loader.read = [](void * ctx, void * output, size_t read_size) {
         std::ifstream * fin = (std::ifstream*)ctx;
         fin->read((char *)output, read_size);
-        return read_size;
+        return (size_t) fin->gcount();
     };
 
     loader.eof = [](void * ctx) {
@@ -3655,75 +4610,258 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
 
     loader.close = [](void * /*ctx*/) { };
 
-    return whisper_init_with_params_no_state(&loader, params);
+    // already in memory, nothing to prefetch
+    return whisper_init_with_params_no_state_impl(&loader, params, nullptr);
 }
 
-struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    wsp_ggml_time_init();
-
-    if (params.flash_attn && params.dtw_token_timestamps) {
-        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
-        params.dtw_token_timestamps = false;
-    }
+// reads the model from another loader on a background thread, in large chunks and one chunk ahead of
+// whisper_model_load(), so that the I/O of slow sources (assets, streams) overlaps with placing the tensors
+struct whisper_prefetch_loader {
+    static constexpr size_t CHUNK_SIZE = 4*1024*1024;
 
-    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
-    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
-    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
-    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    struct chunk {
+        std::vector<uint8_t> data;
+        size_t size  = 0;
+        bool   ready = false; // filled by the I/O thread, owned by the reader until consumed
+        bool   last  = false;
+    };
 
-    // TODO: temporary call to force backend registry initialization
-    WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, wsp_ggml_backend_reg_count());
+    whisper_model_loader * src;
 
-    whisper_context * ctx = new whisper_context;
-    ctx->params = params;
+    chunk  chunks[2];
+    int    cur       = 0;     // chunk being consumed
+    bool   cur_ready = false; // the reader has seen the current chunk ready
+    size_t pos       = 0;     // read position in the current chunk
 
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
-    }
+    bool stop = false;
 
-    loader->close(loader->context);
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::thread             worker;
 
-    return ctx;
-}
+    // stats
+    int64_t n_bytes     = 0;
+    int64_t t_read_us   = 0; // time spent in src->read, on the I/O thread
+    int64_t t_wait_us   = 0; // time the reader waited for the I/O thread
 
-struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
-    if (!ctx) {
-        return nullptr;
+    explicit whisper_prefetch_loader(whisper_model_loader * src) : src(src) {
+        worker = std::thread([this]() { run(); });
     }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    ~whisper_prefetch_loader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
     }
 
-    return ctx;
-}
+    void run() {
+        for (int i = 0; ; i ^= 1) {
+            chunk & c = chunks[i];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return stop || !c.ready; });
+                if (stop) {
+                    return;
+                }
+            }
 
-struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
-    if (!ctx) {
-        return nullptr;
-    }
+            const int64_t t_start_us = wsp_ggml_time_us();
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
-    }
+            c.data.resize(CHUNK_SIZE);
+            c.size = 0;
+            c.last = false;
 
-    return ctx;
-}
+            // sources such as streams may return less than asked, fill the chunk unless the source ends
+            while (c.size < CHUNK_SIZE) {
+                const size_t n_req = CHUNK_SIZE - c.size;
+                size_t n = src->read(src->context, c.data.data() + c.size, n_req);
+                if (n > n_req) {
+                    n = 0; // error reported through a negative count
+                }
+                c.size += n;
+                if (n < n_req && (n == 0 || src->eof(src->context))) {
+                    c.last = true;
+                    break;
+                }
+            }
 
-struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
-    if (!ctx) {
-        return nullptr;
-    }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                t_read_us += wsp_ggml_time_us() - t_start_us;
+                n_bytes   += c.size;
+                c.ready = true;
+            }
+            cv.notify_all();
+
+            if (c.last) {
+                return;
+            }
+        }
+    }
+
+    // waits for the current chunk, returns false at the end of the source
+    bool acquire() {
+        chunk * c = &chunks[cur];
+        for (;;) {
+            if (!cur_ready) {
+                const int64_t t_start_us = wsp_ggml_time_us();
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return c->ready; });
+                t_wait_us += wsp_ggml_time_us() - t_start_us;
+                cur_ready = true;
+            }
+            if (pos < c->size) {
+                return true;
+            }
+            if (c->last) {
+                return false;
+            }
+
+            // hand the consumed chunk back to the I/O thread
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                c->ready = false;
+            }
+            cv.notify_all();
+
+            cur ^= 1;
+            cur_ready = false;
+            pos = 0;
+            c   = &chunks[cur];
+        }
+    }
+
+    size_t read(void * output, size_t read_size) {
+        size_t n_read = 0;
+        while (n_read < read_size && acquire()) {
+            const chunk & c = chunks[cur];
+            const size_t n = std::min(read_size - n_read, c.size - pos);
+            memcpy((uint8_t *) output + n_read, c.data.data() + pos, n);
+            n_read += n;
+            pos    += n;
+        }
+        return n_read;
+    }
+
+    bool eof() {
+        return !acquire();
+    }
+};
+
+struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    whisper_context * ctx = nullptr;
+
+    {
+        whisper_prefetch_loader prefetch(loader);
+
+        whisper_model_loader loader_prefetch = {};
+
+        loader_prefetch.context = &prefetch;
+
+        loader_prefetch.read = [](void * ctx, void * output, size_t read_size) {
+            return ((whisper_prefetch_loader *) ctx)->read(output, read_size);
+        };
+
+        loader_prefetch.eof = [](void * ctx) {
+            return ((whisper_prefetch_loader *) ctx)->eof();
+        };
+
+        // the source is closed once the I/O thread has stopped
+        loader_prefetch.close = [](void * /*ctx*/) { };
+
+        ctx = whisper_init_with_params_no_state_impl(&loader_prefetch, params, nullptr);
+
+        if (ctx) {
+            ctx->load_bytes     = prefetch.n_bytes;
+            ctx->t_load_read_us = prefetch.t_read_us;
+            ctx->t_load_wait_us = prefetch.t_wait_us;
+        }
+    }
+
+    loader->close(loader->context);
+
+    if (ctx) {
+        WHISPER_LOG_INFO("%s: read %.2f MB in %.2f ms, waited %.2f ms for I/O\n", __func__,
+                ctx->load_bytes/1e6, ctx->t_load_read_us/1000.0, ctx->t_load_wait_us/1000.0);
+    }
+
+    return ctx;
+}
+
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+      struct whisper_context_params   params,
+       std::unique_ptr<whisper_mmap>   mapping) {
+    wsp_ggml_time_init();
+
+    if (params.flash_attn && params.dtw_token_timestamps) {
+        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
+        params.dtw_token_timestamps = false;
+    }
+
+    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
+    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
+    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
+    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    WHISPER_LOG_INFO("%s: mmap       = %d\n", __func__, mapping != nullptr);
+
+    // TODO: temporary call to force backend registry initialization
+    WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, wsp_ggml_backend_reg_count());
+
+    whisper_context * ctx = new whisper_context;
+    ctx->params = params;
+    ctx->model.mapping = std::move(mapping);
+
+    if (!whisper_model_load(loader, *ctx)) {
+        loader->close(loader->context);
+        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
+    if (!ctx) {
+        return nullptr;
+    }
 
     ctx->state = whisper_init_state(ctx);
     if (!ctx->state) {
@@ -3796,6 +4934,100 @@ void whisper_free_state(struct whisper_state * state) {
     }
 }
 
+// forget everything a transcription left in the state, so a pooled state behaves like a new one
+// the KV caches, backends and scheduler graphs are kept, the KV cache is cleared by every whisper_full call
+static void whisper_state_reset(struct whisper_state * state) {
+    state->t_sample_us = 0;
+    state->t_encode_us = 0;
+    state->t_decode_us = 0;
+    state->t_batchd_us = 0;
+    state->t_prompt_us = 0;
+    state->t_mel_us    = 0;
+
+    state->n_sample = 0;
+    state->n_encode = 0;
+    state->n_decode = 0;
+    state->n_batchd = 0;
+    state->n_prompt = 0;
+    state->n_fail_p = 0;
+    state->n_fail_h = 0;
+
+    // the mel grows with the length of the audio, an idle state doesn't hold on to it
+    state->mel.n_len     = 0;
+    state->mel.n_len_org = 0;
+    std::vector<float>().swap(state->mel.data);
+    std::vector<float>().swap(state->energy);
+
+    state->enc_mel_offset  = -1;
+    state->enc_n_audio_ctx = -1;
+
+    state->result_all.clear();
+    state->prompt_past.clear();
+
+    state->lang_id = 0;
+    state->t_beg   = 0;
+    state->t_last  = 0;
+
+    state->exp_n_audio_ctx = 0;
+
+    // the other decoders are reseeded by every whisper_full call
+    state->decoders[0].rng = std::mt19937(0);
+}
+
+struct whisper_state * whisper_state_acquire(struct whisper_context * ctx) {
+    {
+        std::lock_guard<std::mutex> lock(ctx->state_pool_mutex);
+        if (!ctx->state_pool.empty()) {
+            whisper_state * state = ctx->state_pool.back();
+            ctx->state_pool.pop_back();
+            return state;
+        }
+    }
+
+    // built outside of the lock, other threads can keep leasing idle states meanwhile
+    return whisper_init_state(ctx);
+}
+
+void whisper_state_release(struct whisper_context * ctx, struct whisper_state * state) {
+    if (state == nullptr) {
+        return;
+    }
+
+    whisper_state_reset(state);
+
+    // a state left without a KV cache by a failed transcription is not worth keeping
+    if (state->kv_self.buffer != nullptr) {
+        std::lock_guard<std::mutex> lock(ctx->state_pool_mutex);
+        if ((int) ctx->state_pool.size() < ctx->params.n_states_idle_max) {
+            ctx->state_pool.push_back(state);
+            return;
+        }
+    }
+
+    whisper_free_state(state);
+}
+
+int whisper_state_pool_trim(struct whisper_context * ctx, int n_keep) {
+    std::vector<whisper_state *> trimmed;
+    {
+        std::lock_guard<std::mutex> lock(ctx->state_pool_mutex);
+        while ((int) ctx->state_pool.size() > std::max(0, n_keep)) {
+            trimmed.push_back(ctx->state_pool.back());
+            ctx->state_pool.pop_back();
+        }
+    }
+
+    for (auto * state : trimmed) {
+        whisper_free_state(state);
+    }
+
+    if (!trimmed.empty()) {
+        WHISPER_LOG_INFO("%s: freed %d idle states\n", __func__, (int) trimmed.size());
+    }
+
+    return (int) trimmed.size();
+}
+
 void whisper_free(struct whisper_context * ctx) {
     if (ctx) {
         wsp_ggml_free(ctx->model.ctx);
@@ -3804,6 +5036,14 @@ void whisper_free(struct whisper_context * ctx) {
 
         whisper_free_state(ctx->state);
 
+        for (auto * state : ctx->state_pool) {
+            whisper_free_state(state);
+        }
+
+        if (ctx->threadpool) {
+            wsp_ggml_threadpool_free(ctx->threadpool);
+        }
+
         delete ctx;
     }
 }
@@ -3821,7 +5061,16 @@ void whisper_free_params(struct whisper_full_params * params) {
 }
 
 int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+    if (!log_mel_spectrogram(*state, samples, nullptr, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int whisper_pcm_i16_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const int16_t * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram(*state, nullptr, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
         WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -3833,6 +5082,24 @@ int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int
     return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
 }
 
+struct whisper_mel_stream * whisper_mel_stream_init(struct whisper_context * ctx) {
+    whisper_mel_stream * stream = new whisper_mel_stream;
+    stream->filters = &ctx->model.filters;
+
+    return stream;
+}
+
+void whisper_mel_stream_reset(struct whisper_mel_stream * stream) {
+    stream->n_samples = 0;
+    stream->n_frames  = 0;
+    stream->frames.clear();
+    stream->mmax = -1e20f;
+}
+
+void whisper_mel_stream_free(struct whisper_mel_stream * stream) {
+    delete stream;
+}
+
 int whisper_set_mel_with_state(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -3848,6 +5115,8 @@ int whisper_set_mel_with_state(
     state->mel.n_len_org = n_len;
     state->mel.n_mel     = n_mel;
 
+    state->enc_mel_offset = -1;
+
     state->mel.data.resize(n_len*n_mel);
     memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
 
@@ -4147,7 +5416,10 @@ float * whisper_get_logits_from_state(struct whisper_state * state) {
 }
 
 const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
-    return ctx->vocab.id_to_token.at(token).c_str();
+    if (token < 0 || token >= ctx->vocab.size()) {
+        throw std::out_of_range("whisper_token_to_str: invalid token");
+    }
+    return ctx->vocab.token_to_str(token);
 }
 
 whisper_token whisper_token_eot(struct whisper_context * ctx) {
@@ -4190,35 +5462,47 @@ whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
     return ctx->vocab.token_transcribe;
 }
 
-struct whisper_timings * whisper_get_timings(struct whisper_context * ctx) {
-    if (ctx->state == nullptr) {
+struct whisper_timings * whisper_get_timings_from_state(struct whisper_context * ctx, struct whisper_state * state) {
+    if (state == nullptr) {
         return nullptr;
     }
     return new whisper_timings {
         .load_us = ctx->t_load_us,
         .t_start_us = ctx->t_start_us,
-        .fail_p = ctx->state->n_fail_p,
-        .fail_h = ctx->state->n_fail_h,
-        .t_mel_us = ctx->state->t_mel_us,
-        .n_sample = ctx->state->n_sample,
-        .n_encode = ctx->state->n_encode,
-        .n_decode = ctx->state->n_decode,
-        .n_batchd = ctx->state->n_batchd,
-        .n_prompt = ctx->state->n_prompt,
-        .t_sample_us = ctx->state->t_sample_us,
-        .t_encode_us = ctx->state->t_encode_us,
-        .t_decode_us = ctx->state->t_decode_us,
-        .t_batchd_us = ctx->state->t_batchd_us,
-        .t_prompt_us = ctx->state->t_prompt_us,
+        .fail_p = state->n_fail_p,
+        .fail_h = state->n_fail_h,
+        .t_mel_us = state->t_mel_us,
+        .n_sample = state->n_sample,
+        .n_encode = state->n_encode,
+        .n_decode = state->n_decode,
+        .n_batchd = state->n_batchd,
+        .n_prompt = state->n_prompt,
+        .t_sample_us = state->t_sample_us,
+        .t_encode_us = state->t_encode_us,
+        .t_decode_us = state->t_decode_us,
+        .t_batchd_us = state->t_batchd_us,
+        .t_prompt_us = state->t_prompt_us,
+        .load_bytes = ctx->load_bytes,
+        .t_load_read_us = ctx->t_load_read_us,
+        .t_load_wait_us = ctx->t_load_wait_us,
+        .n_audio_ctx = state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : ctx->model.hparams.n_audio_ctx,
     };
 }
 
+struct whisper_timings * whisper_get_timings(struct whisper_context * ctx) {
+    return whisper_get_timings_from_state(ctx, ctx->state);
+}
+
 void whisper_print_timings(struct whisper_context * ctx) {
     const int64_t t_end_us = wsp_ggml_time_us();
     const struct whisper_timings * timings = whisper_get_timings(ctx);
 
     WHISPER_LOG_INFO("\n");
     WHISPER_LOG_INFO("%s:     load time = %8.2f ms\n", __func__, timings->load_us / 1000.0f);
+    if (timings->load_bytes > 0 && timings->load_us > 0) {
+        WHISPER_LOG_INFO("%s:     load size = %8.2f MB (%8.2f MB/s, read %8.2f ms, waited %8.2f ms)\n", __func__,
+                timings->load_bytes/1e6f, timings->load_bytes/(float) timings->load_us, timings->t_load_read_us/1000.0f, timings->t_load_wait_us/1000.0f);
+    }
     if (ctx->state != nullptr) {
         const int32_t n_sample = std::max(1, ctx->state->n_sample);
         const int32_t n_encode = std::max(1, ctx->state->n_encode);
@@ -4227,6 +5511,7 @@ void whisper_print_timings(struct whisper_context * ctx) {
         const int32_t n_prompt = std::max(1, ctx->state->n_prompt);
 
         WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, timings->fail_p, timings->fail_h);
+        WHISPER_LOG_INFO("%s:     audio ctx = %5d\n", __func__, timings->n_audio_ctx);
         WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, timings->t_mel_us/1000.0f);
         WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * timings->t_sample_us, n_sample, 1e-3f * timings->t_sample_us / n_sample);
         WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * timings->t_encode_us, n_encode, 1e-3f * timings->t_encode_us / n_encode);
@@ -4665,9 +5950,9 @@ static void whisper_suppress_invalid_grammar(
     std::vector<whisper_grammar_candidate>                              candidates_grammar;
 
     for (whisper_token id = 0; id < eot; ++id) {
-        const std::string & text = ctx.vocab.id_to_token[id];
-        if (!text.empty()) {
-            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
+        const char * text = ctx.vocab.token_to_str(id);
+        if (text[0] != '\0') {
+            candidates_decoded.push_back(decode_utf8(text, grammar.partial_utf8));
             candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
     }
@@ -4690,18 +5975,18 @@ static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar
         return;
     }
 
-    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.id_to_token[token].c_str());
+    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.token_to_str(token));
 
-    const std::string & text = ctx.vocab.id_to_token[token];
+    const char * text = ctx.vocab.token_to_str(token);
 
-    if (text.rfind("[_", 0) == 0) {
+    if (strncmp(text, "[_", 2) == 0) {
         // fprintf(stderr, " (skipped)\n");
         return;
     }
     // fprintf(stderr, "\n");
 
     // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
+    const auto   decoded     = decode_utf8(text, grammar.partial_utf8);
     const auto & code_points = decoded.first;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
         grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
@@ -4736,9 +6021,12 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.strategy          =*/ strategy,
 
         /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.use_threadpool    =*/ false,
+        /*.cpu_mask          =*/ 0,
         /*.n_max_text_ctx    =*/ 16384,
         /*.offset_ms         =*/ 0,
         /*.duration_ms       =*/ 0,
+        /*.parallel_overlap_ms =*/ 0,
 
         /*.translate         =*/ false,
         /*.no_context        =*/ true,
@@ -4758,6 +6046,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.debug_mode        =*/ false,
         /*.audio_ctx         =*/ 0,
+        /*.audio_ctx_auto    =*/ false,
 
         /*.tdrz_enable       =*/ false,
 
@@ -4776,6 +6065,8 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.temperature       =*/  0.0f,
         /*.max_initial_ts    =*/  1.0f,
         /*.length_penalty    =*/ -1.0f,
+        /*.top_k             =*/ 0,
+        /*.top_p             =*/ 1.0f,
 
         /*.temperature_inc   =*/  0.2f,
         /*.entropy_thold     =*/  2.4f,
@@ -4834,7 +6125,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 }
 
 // forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
+static std::vector<float> get_signal_energy(const whisper_padded_view & signal, int n_samples_per_half_window);
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context & ctx,
           struct whisper_state & state,
@@ -4875,8 +6166,8 @@ static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_sta
             continue;
         }
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
+        const auto txt = ctx.vocab.token_to_str(token.id);
+        const int cur = ctx.vocab.token_len(token.id);
 
         if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
             state.result_all.back().text = std::move(text);
@@ -4921,6 +6212,267 @@ static const std::vector<std::string> non_speech_tokens = {
     "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
 };
 
+// the tokens suppressed by params.suppress_regex and params.suppress_non_speech_tokens
+// they don't depend on the decoded sequence, so the list is built once per whisper_full call, before the decoders
+// may process their logits in parallel, and kept on the state until these params change
+static void whisper_update_suppress_ids(
+        const struct whisper_context     & ctx,
+              struct whisper_state       & state,
+        const struct whisper_full_params & params) {
+    const auto & vocab = ctx.vocab;
+
+    const std::string regex = params.suppress_regex != nullptr ? params.suppress_regex : "";
+
+    if (state.suppress_ids_valid && state.suppress_ids_regex == regex && state.suppress_ids_non_speech == params.suppress_non_speech_tokens) {
+        return;
+    }
+
+    auto & ids = state.suppress_ids;
+    ids.clear();
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    if (!regex.empty()) {
+        std::regex re(regex);
+        for (whisper_vocab::id i = 0; i < vocab.size(); ++i) {
+            const char * text = vocab.token_to_str(i);
+            if (std::regex_match(text, text + vocab.token_len(i), re)) {
+                ids.push_back(i);
+            }
+        }
+    }
+
+    // suppress non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    if (params.suppress_non_speech_tokens) {
+        for (const std::string & token : non_speech_tokens) {
+            const std::string suppress_tokens[] = {token, " " + token};
+            for (const std::string & suppress_token : suppress_tokens) {
+                const whisper_vocab::id id = vocab.find(suppress_token);
+                if (id >= 0) {
+                    ids.push_back(id);
+                }
+            }
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        for (const char * token : { " -", " '" }) {
+            const whisper_vocab::id id = vocab.find(token, 2);
+            if (id >= 0) {
+                ids.push_back(id);
+            }
+        }
+    }
+
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    state.suppress_ids_regex      = regex;
+    state.suppress_ids_non_speech = params.suppress_non_speech_tokens;
+    state.suppress_ids_valid      = true;
+}
+
+// vectorized kernels of whisper_process_logits()
+//
+// whisper_v_expf is wsp_ggml_v_expf from ggml.c, adapted from arm limited optimized routine:
+// the maximum error is 1.45358 plus 0.5 ulps, numbers beneath -103.97 (and -INFINITY) flush to zero
+// (the hex float constants of the original are spelled in decimal, hex floats need C++17)
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define WHISPER_LOGITS_VEC_WIDTH 4
+typedef float32x4_t whisper_logits_vec;
+
+inline static float32x4_t whisper_v_expf(float32x4_t x) {
+    const float32x4_t r = vdupq_n_f32(12582912.0f);
+    const float32x4_t z = vfmaq_f32(r, x, vdupq_n_f32(1.442695f));
+    const float32x4_t n = vsubq_f32(z, r);
+    const float32x4_t b = vfmsq_f32(vfmsq_f32(x, n, vdupq_n_f32(0.69314575f)), n,
+                                    vdupq_n_f32(1.4286068e-06f));
+    const uint32x4_t e = vshlq_n_u32(vreinterpretq_u32_f32(z), 23);
+    const float32x4_t k = vreinterpretq_f32_u32(vaddq_u32(e, vreinterpretq_u32_f32(vdupq_n_f32(1))));
+    const uint32x4_t c = vcagtq_f32(n, vdupq_n_f32(126));
+    const float32x4_t u = vmulq_f32(b, b);
+    const float32x4_t j = vfmaq_f32(
+        vmulq_f32(vdupq_n_f32(0.9999994f), b),
+        vfmaq_f32(vfmaq_f32(vdupq_n_f32(0.49999127f), vdupq_n_f32(0.16668396f), b),
+                  vfmaq_f32(vdupq_n_f32(0.041899767f), vdupq_n_f32(0.00824739f), b), u), u);
+    if (!vpaddd_u64(vreinterpretq_u64_u32(c)))
+        return vfmaq_f32(k, j, k);
+    const uint32x4_t d = vandq_u32(vclezq_f32(n), vdupq_n_u32(0x82000000));
+    const float32x4_t s1 = vreinterpretq_f32_u32(vaddq_u32(d, vdupq_n_u32(0x7f000000)));
+    const float32x4_t s2 = vreinterpretq_f32_u32(vsubq_u32(e, d));
+    return vbslq_f32(vcagtq_f32(n, vdupq_n_f32(192)), vmulq_f32(s1, s1),
+                     vbslq_f32(c, vmulq_f32(vfmaq_f32(s2, s2, j), s1), vfmaq_f32(k, k, j)));
+}
+
+inline static whisper_logits_vec whisper_v_load(const float * p)                      { return vld1q_f32(p); }
+inline static void               whisper_v_store(float * p, whisper_logits_vec v)     { vst1q_f32(p, v); }
+inline static whisper_logits_vec whisper_v_set(float v)                               { return vdupq_n_f32(v); }
+inline static whisper_logits_vec whisper_v_sub(whisper_logits_vec a, whisper_logits_vec b) { return vsubq_f32(a, b); }
+inline static whisper_logits_vec whisper_v_mul(whisper_logits_vec a, whisper_logits_vec b) { return vmulq_f32(a, b); }
+inline static whisper_logits_vec whisper_v_div(whisper_logits_vec a, whisper_logits_vec b) { return vdivq_f32(a, b); }
+inline static whisper_logits_vec whisper_v_max(whisper_logits_vec a, whisper_logits_vec b) { return vmaxq_f32(a, b); }
+inline static float              whisper_v_hmax(whisper_logits_vec v)                 { return vmaxvq_f32(v); }
+inline static float              whisper_v_hsum(whisper_logits_vec v)                 { return vaddvq_f32(v); }
+inline static whisper_logits_vec whisper_v_add(whisper_logits_vec a, whisper_logits_vec b) { return vaddq_f32(a, b); }
+inline static bool               whisper_v_any_ge(whisper_logits_vec a, whisper_logits_vec b) { return vmaxvq_u32(vcgeq_f32(a, b)) != 0; }
+#elif defined(__AVX2__) && defined(__FMA__)
+#define WHISPER_LOGITS_VEC_WIDTH 8
+typedef __m256 whisper_logits_vec;
+
+inline static __m256 whisper_v_expf(__m256 x) {
+    const __m256 r = _mm256_set1_ps(12582912.0f);
+    const __m256 z = _mm256_fmadd_ps(x, _mm256_set1_ps(1.442695f), r);
+    const __m256 n = _mm256_sub_ps(z, r);
+    const __m256 b = _mm256_fnmadd_ps(n, _mm256_set1_ps(1.4286068e-06f),
+                                      _mm256_fnmadd_ps(n, _mm256_set1_ps(0.69314575f), x));
+    const __m256i e = _mm256_slli_epi32(_mm256_castps_si256(z), 23);
+    const __m256 k = _mm256_castsi256_ps(
+        _mm256_add_epi32(e, _mm256_castps_si256(_mm256_set1_ps(1))));
+    const __m256i c = _mm256_castps_si256(
+        _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.f), n),
+                      _mm256_set1_ps(126), _CMP_GT_OQ));
+    const __m256 u = _mm256_mul_ps(b, b);
+    const __m256 j = _mm256_fmadd_ps(_mm256_fmadd_ps(_mm256_fmadd_ps(_mm256_set1_ps(0.00824739f), b,
+                                                                     _mm256_set1_ps(0.041899767f)), u,
+                                                     _mm256_fmadd_ps(_mm256_set1_ps(0.16668396f), b,
+                                                                     _mm256_set1_ps(0.49999127f))),
+                                     u, _mm256_mul_ps(_mm256_set1_ps(0.9999994f), b));
+    if (!_mm256_movemask_ps(_mm256_castsi256_ps(c)))
+        return _mm256_fmadd_ps(j, k, k);
+    const __m256i g = _mm256_and_si256(
+        _mm256_castps_si256(_mm256_cmp_ps(n, _mm256_setzero_ps(), _CMP_LE_OQ)),
+        _mm256_set1_epi32(0x82000000u));
+    const __m256 s1 =
+        _mm256_castsi256_ps(_mm256_add_epi32(g, _mm256_set1_epi32(0x7f000000u)));
+    const __m256 s2 = _mm256_castsi256_ps(_mm256_sub_epi32(e, g));
+    const __m256i d = _mm256_castps_si256(
+        _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.f), n),
+                      _mm256_set1_ps(192), _CMP_GT_OQ));
+    return _mm256_or_ps(
+        _mm256_and_ps(_mm256_castsi256_ps(d), _mm256_mul_ps(s1, s1)),
+        _mm256_andnot_ps(
+            _mm256_castsi256_ps(d),
+            _mm256_or_ps(
+                _mm256_and_ps(_mm256_castsi256_ps(c),
+                              _mm256_mul_ps(_mm256_fmadd_ps(s2, j, s2), s1)),
+                _mm256_andnot_ps(_mm256_castsi256_ps(c), _mm256_fmadd_ps(k, j, k)))));
+}
+
+inline static whisper_logits_vec whisper_v_load(const float * p)                      { return _mm256_loadu_ps(p); }
+inline static void               whisper_v_store(float * p, whisper_logits_vec v)     { _mm256_storeu_ps(p, v); }
+inline static whisper_logits_vec whisper_v_set(float v)                               { return _mm256_set1_ps(v); }
+inline static whisper_logits_vec whisper_v_sub(whisper_logits_vec a, whisper_logits_vec b) { return _mm256_sub_ps(a, b); }
+inline static whisper_logits_vec whisper_v_mul(whisper_logits_vec a, whisper_logits_vec b) { return _mm256_mul_ps(a, b); }
+inline static whisper_logits_vec whisper_v_div(whisper_logits_vec a, whisper_logits_vec b) { return _mm256_div_ps(a, b); }
+inline static whisper_logits_vec whisper_v_max(whisper_logits_vec a, whisper_logits_vec b) { return _mm256_max_ps(a, b); }
+inline static whisper_logits_vec whisper_v_add(whisper_logits_vec a, whisper_logits_vec b) { return _mm256_add_ps(a, b); }
+inline static bool               whisper_v_any_ge(whisper_logits_vec a, whisper_logits_vec b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GE_OQ)) != 0; }
+
+inline static float whisper_v_hmax(whisper_logits_vec v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_movehdup_ps(m));
+    return _mm_cvtss_f32(m);
+}
+
+inline static float whisper_v_hsum(whisper_logits_vec v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+// dst = src/temperature, a plain copy when temperature <= 0
+static void whisper_logits_scale(float * dst, const float * src, int n, float temperature) {
+    if (temperature <= 0.0f) {
+        memcpy(dst, src, n*sizeof(float));
+        return;
+    }
+
+    int i = 0;
+#if defined(WHISPER_LOGITS_VEC_WIDTH)
+    const whisper_logits_vec t = whisper_v_set(temperature);
+    for (; i + WHISPER_LOGITS_VEC_WIDTH <= n; i += WHISPER_LOGITS_VEC_WIDTH) {
+        whisper_v_store(dst + i, whisper_v_div(whisper_v_load(src + i), t));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = src[i]/temperature;
+    }
+}
+
+// max of x[0, n), n > 0, and the first index holding it
+// the vector path keeps the block where the max was found and looks for the index in that block at the end
+static float whisper_logits_max(const float * x, int n, int & imax) {
+    float max = -INFINITY;
+    int   i   = 0;
+
+    imax = 0;
+#if defined(WHISPER_LOGITS_VEC_WIDTH)
+    const int n_blk = 8*WHISPER_LOGITS_VEC_WIDTH;
+    int i_blk = -1;
+    for (; i + n_blk <= n; i += n_blk) {
+        whisper_logits_vec m = whisper_v_load(x + i);
+        for (int j = WHISPER_LOGITS_VEC_WIDTH; j < n_blk; j += WHISPER_LOGITS_VEC_WIDTH) {
+            m = whisper_v_max(m, whisper_v_load(x + i + j));
+        }
+        const float m_blk = whisper_v_hmax(m);
+        if (m_blk > max) {
+            max   = m_blk;
+            i_blk = i;
+        }
+    }
+    if (i_blk >= 0) {
+        for (imax = i_blk; x[imax] != max; ++imax) {
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (x[i] > max) {
+            max  = x[i];
+            imax = i;
+        }
+    }
+    return max;
+}
+
+// y = expf(x - max), returns the sum of y
+static double whisper_logits_exp(float * y, const float * x, int n, float max) {
+    double sum = 0.0;
+    int    i   = 0;
+#if defined(WHISPER_LOGITS_VEC_WIDTH)
+    const whisper_logits_vec m = whisper_v_set(max);
+    for (; i + WHISPER_LOGITS_VEC_WIDTH <= n; i += WHISPER_LOGITS_VEC_WIDTH) {
+        const whisper_logits_vec e = whisper_v_expf(whisper_v_sub(whisper_v_load(x + i), m));
+        whisper_v_store(y + i, e);
+        sum += whisper_v_hsum(e);
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] = expf(x[i] - max);
+        sum += y[i];
+    }
+    return sum;
+}
+
+// logprobs = logits - lse and probs *= scale, where probs holds expf(logits - max) from whisper_logits_exp()
+static void whisper_logits_normalize(float * logprobs, float * probs, const float * logits, int n, float lse, float scale) {
+    int i = 0;
+#if defined(WHISPER_LOGITS_VEC_WIDTH)
+    const whisper_logits_vec l = whisper_v_set(lse);
+    const whisper_logits_vec s = whisper_v_set(scale);
+    for (; i + WHISPER_LOGITS_VEC_WIDTH <= n; i += WHISPER_LOGITS_VEC_WIDTH) {
+        whisper_v_store(logprobs + i, whisper_v_sub(whisper_v_load(logits + i), l));
+        whisper_v_store(probs    + i, whisper_v_mul(whisper_v_load(probs  + i), s));
+    }
+#endif
+    for (; i < n; ++i) {
+        logprobs[i] = logits[i] - lse;
+        probs[i]   *= scale;
+    }
+}
+
 // process the logits for the selected decoder
 // - applies logit filters
 // - computes logprobs and probs
@@ -4935,7 +6487,7 @@ static void whisper_process_logits(
     const auto & tokens_cur = decoder.sequence.tokens;
 
     const bool is_initial = tokens_cur.size() == 0;
-    const int  n_logits   = vocab.id_to_token.size();
+    const int  n_logits   = vocab.size();
 
     WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
 
@@ -4946,13 +6498,7 @@ static void whisper_process_logits(
     auto & logprobs = decoder.logprobs;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
-
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
-            }
-        }
+        whisper_logits_scale(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits, temperature);
 
         // will be populated a bit later
         probs.resize(n_logits);
@@ -4966,8 +6512,10 @@ static void whisper_process_logits(
         // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
         if (params.suppress_blank) {
             if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
+                logits[vocab.token_eot] = -INFINITY;
+                if (vocab.token_space >= 0) {
+                    logits[vocab.token_space] = -INFINITY;
+                }
             }
         }
 
@@ -4975,9 +6523,7 @@ static void whisper_process_logits(
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
         logits[vocab.token_not] = -INFINITY;
         if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
+            std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
         }
 
         // suppress sot and nosp tokens
@@ -5006,36 +6552,9 @@ static void whisper_process_logits(
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
         }
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
-            }
-        }
-
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
+        // suppress the tokens matching params.suppress_regex and the non-speech tokens
+        for (const whisper_token id : state.suppress_ids) {
+            logits[id] = -INFINITY;
         }
 
         // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
@@ -5048,13 +6567,9 @@ static void whisper_process_logits(
 
             if (last_was_timestamp) {
                 if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
                 } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    std::fill(logits.begin(), logits.begin() + vocab.token_eot, -INFINITY);
                 }
             }
         }
@@ -5065,8 +6580,8 @@ static void whisper_process_logits(
             const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
             const int   tid0      = std::round(params.max_initial_ts/precision);
 
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
+            if (vocab.token_beg + tid0 + 1 < n_logits) {
+                std::fill(logits.begin() + vocab.token_beg + tid0 + 1, logits.end(), -INFINITY);
             }
         }
 
@@ -5075,93 +6590,79 @@ static void whisper_process_logits(
         if (decoder.has_ts) {
             const int tid0 = decoder.seek_delta/2;
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
-            }
+            std::fill(logits.begin() + vocab.token_beg, logits.begin() + std::min(vocab.token_beg + tid0, n_logits), -INFINITY);
         }
 
-        // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
-            }
-            logsumexp = logf(logsumexp) + logit_max;
+        // log_softmax in three passes over the vocab: the max, the exponentials and their sum, then logprobs and probs
+        // the text tokens are [0, token_beg) and the timestamp tokens [token_beg, n_logits), each range keeps its own
+        // max and sum so that the timestamp rule below needs no extra pass
+        const int n_text = vocab.token_beg;
+        const int n_ts   = n_logits - n_text;
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
-                }
-            }
-        }
+        int text_imax = 0;
+        int ts_imax   = 0;
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+        float  text_max  = 0.0f;
+        float  ts_max    = 0.0f;
+        float  exp_max   = 0.0f;
+        double text_sum  = 0.0;
+        double ts_sum    = 0.0;
+        float  logsumexp = 0.0f;
+
+        auto log_softmax = [&]() {
+            text_max = whisper_logits_max(logits.data(),          n_text, text_imax);
+            ts_max   = whisper_logits_max(logits.data() + n_text, n_ts,   ts_imax);
+            ts_imax += n_text;
+
+            // -INFINITY when all tokens are suppressed, then every logprob is -INFINITY as well
+            const float logit_max = std::max(text_max, ts_max);
+            exp_max = logit_max > -INFINITY ? logit_max : 0.0f;
+
+            text_sum  = whisper_logits_exp(probs.data(),          logits.data(),          n_text, exp_max);
+            ts_sum    = whisper_logits_exp(probs.data() + n_text, logits.data() + n_text, n_ts,   exp_max);
+            logsumexp = logf(text_sum + ts_sum) + exp_max;
+        };
+
+        log_softmax();
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+        // if sum of probability over timestamps is above any other token, sample timestamp
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+        {
+            // logsumexp over the timestamp logprobs
+            const float timestamp_logprob      = ts_sum > 0.0 ? logf(ts_sum) + exp_max - logsumexp : -INFINITY;
+            const float max_text_token_logprob = text_max - logsumexp;
 
             //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
             if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
+                // the logprobs are not renormalized over the timestamps
+                std::fill(logits.begin(), logits.begin() + n_text, -INFINITY);
+                std::fill(probs.begin(),  probs.begin()  + n_text, 0.0f);
+                text_max  = -INFINITY;
+                text_imax = 0;
             } else {
                 if (params.n_grammar_rules > 0) {
                     whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
-
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
+                    log_softmax();
                 }
             }
         }
-    }
 
-    // compute probs
-    {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
+        // probs = expf(logprobs), from the exponentials already in probs
+        const double sum = text_sum + ts_sum;
+        whisper_logits_normalize(logprobs.data(), probs.data(), logits.data(), n_logits, logsumexp, sum > 0.0 ? (float) (1.0/sum) : 0.0f);
+
+        // the samplers only need the best token and the timestamp stats
+        decoder.best_id = text_max >= ts_max ? text_imax : ts_imax;
+        decoder.ts_id   = -1;
+        decoder.ts_max  = 0.0;
+        decoder.ts_sum  = 0.0;
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            decoder.ts_sum += probs[i];
+            if (decoder.ts_max < probs[i]) {
+                decoder.ts_max = probs[i];
+                decoder.ts_id  = i;
             }
         }
     }
@@ -5189,7 +6690,7 @@ static void whisper_process_logits(
         });
 
         for (int i = 0; i < 10; i++) {
-            const auto token   = vocab.id_to_token.at(pairs[i].second);
+            const auto token   = std::string(vocab.token_to_str(pairs[i].second));
             const auto prob    = pairs[i].first;
             const auto logit   = logits[pairs[i].second];
             const auto logprob = logprobs[pairs[i].second];
@@ -5200,23 +6701,23 @@ static void whisper_process_logits(
     }
 
     // "And", "and", " And", " and"
-    //printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
-    //printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
-    //printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
-    //printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
-    //printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
-
-    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
-    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
-    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
-    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
-    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
-
-    //printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
-    //printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
-    //printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
-    //printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
-    //printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
+    //printf("logits[\"and\"]  = %f\n", logits[vocab.find("and")]);
+    //printf("logits[\"And\"]  = %f\n", logits[vocab.find("And")]);
+    //printf("logits[\" and\"] = %f\n", logits[vocab.find(" and")]);
+    //printf("logits[\" And\"] = %f\n", logits[vocab.find(" And")]);
+    //printf("logits[\" so\"]  = %f\n", logits[vocab.find(" so")]);
+
+    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.find("and")]);
+    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.find("And")]);
+    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.find(" and")]);
+    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.find(" And")]);
+    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.find(" so")]);
+
+    //printf("probs[\"and\"]  = %f\n", probs[vocab.find("and")]);
+    //printf("probs[\"And\"]  = %f\n", probs[vocab.find("And")]);
+    //printf("probs[\" and\"] = %f\n", probs[vocab.find(" and")]);
+    //printf("probs[\" And\"] = %f\n", probs[vocab.find(" And")]);
+    //printf("probs[\" so\"]  = %f\n", probs[vocab.find(" so")]);
 #endif
 }
 
@@ -5233,9 +6734,160 @@ static bool whisper_sequence_tokens_equal(const whisper_sequence & a, const whis
     return true;
 }
 
+// sum of x[0, n)
+static float whisper_probs_sum(const float * x, int n) {
+    float sum = 0.0f;
+    int   i   = 0;
+#if defined(WHISPER_LOGITS_VEC_WIDTH)
+    whisper_logits_vec acc = whisper_v_set(0.0f);
+    for (; i + WHISPER_LOGITS_VEC_WIDTH <= n; i += WHISPER_LOGITS_VEC_WIDTH) {
+        acc = whisper_v_add(acc, whisper_v_load(x + i));
+    }
+    sum = whisper_v_hsum(acc);
+#endif
+    for (; i < n; ++i) {
+        sum += x[i];
+    }
+    return sum;
+}
+
+// the first index where the running sum of x exceeds u, the last non-zero x if rounding leaves u beyond the total
+// the sums of blocks of WHISPER_SAMPLE_BLOCK values are scanned first, then the values of the block that holds u
+#define WHISPER_SAMPLE_BLOCK 64
+
+static int whisper_probs_pick(const float * x, int n, double u) {
+    double cum = 0.0;
+    for (int i = 0; i < n; i += WHISPER_SAMPLE_BLOCK) {
+        const int   n_blk = std::min(WHISPER_SAMPLE_BLOCK, n - i);
+        const float sum   = whisper_probs_sum(x + i, n_blk);
+        if (cum + sum <= u) {
+            cum += sum;
+            continue;
+        }
+        for (int j = i; j < i + n_blk; ++j) {
+            cum += x[j];
+            if (cum > u && x[j] > 0.0f) {
+                return j;
+            }
+        }
+    }
+    int last = n - 1;
+    while (last > 0 && x[last] == 0.0f) {
+        --last;
+    }
+    return last;
+}
+
+// the tokens whisper_sample_probs() draws from at t > 0: the top_k most likely tokens (top_k > 0), cut down to the
+// most likely ones whose probabilities add up to top_p (top_p < 1)
+// without a restriction every token can be drawn and all is set, otherwise the candidates are stored in
+// decoder.logits_id sorted by probability, at least the best token even for top_p <= 0; returns the probability
+// mass of the candidates
+static double whisper_sample_candidates(whisper_decoder & decoder, int top_k, float top_p, bool & all) {
+    const auto & probs = decoder.probs;
+    const int    n     = probs.size();
+
+    const double total = whisper_probs_sum(probs.data(), n);
+
+    all = (top_k <= 0 || top_k >= n) && top_p >= 1.0f;
+    if (all) {
+        return total;
+    }
+
+    // collect the tokens at or above a threshold below the best probability, lowered until the candidates hold the
+    // top_k tokens and the top_p mass; the vector loop skips the blocks that have no token above the threshold
+    auto & cand = decoder.logits_id;
+
+    const float p_max = probs[decoder.best_id];
+
+    for (int iter = 0; ; ++iter) {
+        const float thold = iter < 12 ? p_max*std::pow(2.0f, -2.0f*(iter + 1)) : std::numeric_limits<float>::denorm_min();
+
+        cand.clear();
+        double mass = 0.0;
+
+        int i = 0;
+#if defined(WHISPER_LOGITS_VEC_WIDTH)
+        const whisper_logits_vec t = whisper_v_set(thold);
+        for (; i + WHISPER_LOGITS_VEC_WIDTH <= n; i += WHISPER_LOGITS_VEC_WIDTH) {
+            if (!whisper_v_any_ge(whisper_v_load(probs.data() + i), t)) {
+                continue;
+            }
+            for (int j = i; j < i + WHISPER_LOGITS_VEC_WIDTH; ++j) {
+                if (probs[j] >= thold) {
+                    cand.push_back({ probs[j], j });
+                    mass += probs[j];
+                }
+            }
+        }
+#endif
+        for (; i < n; ++i) {
+            if (probs[i] >= thold) {
+                cand.push_back({ probs[i], i });
+                mass += probs[i];
+            }
+        }
+
+        if (iter >= 12 || ((top_k <= 0 || (int) cand.size() >= top_k) && (top_p >= 1.0f || mass >= top_p*total))) {
+            break;
+        }
+    }
+
+    using pair_type = std::remove_reference<decltype(cand)>::type::value_type;
+    const auto cmp = [](const pair_type & a, const pair_type & b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+
+    // sort the candidates in growing chunks until the top_k tokens or the top_p mass are in front
+    const size_t n_max = top_k > 0 ? std::min(cand.size(), (size_t) top_k) : cand.size();
+
+    size_t n_keep = 0;
+    double mass   = 0.0;
+    for (size_t chunk = 64; n_keep < n_max; chunk *= 2) {
+        const size_t end = std::min(n_max, n_keep + chunk);
+        std::partial_sort(cand.begin() + n_keep, cand.begin() + end, cand.end(), cmp);
+
+        for (; n_keep < end && (n_keep == 0 || top_p >= 1.0f || mass < top_p*total); ++n_keep) {
+            mass += cand[n_keep].first;
+        }
+        if (n_keep < end) {
+            break;
+        }
+    }
+    cand.resize(n_keep);
+
+    return mass;
+}
+
+// draws one token from the candidates of whisper_sample_candidates()
+static whisper_token whisper_sample_probs(whisper_decoder & decoder, bool all, double mass) {
+    // nothing to draw from when all the probabilities are 0
+    if (!(mass > 0.0) || (!all && decoder.logits_id.empty())) {
+        return decoder.best_id;
+    }
+
+    const double u = std::uniform_real_distribution<double>(0.0, mass)(decoder.rng);
+
+    if (all) {
+        return whisper_probs_pick(decoder.probs.data(), decoder.probs.size(), u);
+    }
+
+    const auto & cand = decoder.logits_id;
+
+    double cum = 0.0;
+    for (const auto & c : cand) {
+        cum += c.first;
+        if (cum > u) {
+            return c.second;
+        }
+    }
+    return cand.back().second;
+}
+
 static whisper_token_data whisper_sample_token(
             whisper_context & ctx,
-      const whisper_decoder & decoder,
+            whisper_decoder & decoder,
+      const whisper_full_params & params,
                        bool   best) {
     whisper_token_data result = {
         0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, -1, 0.0f,
@@ -5246,40 +6898,22 @@ static whisper_token_data whisper_sample_token(
     const auto & probs    = decoder.probs;
     const auto & logprobs = decoder.logprobs;
 
-    const int n_logits = vocab.n_vocab;
-
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
-
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
-
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
-            }
-        }
-
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
+    // the timestamp stats and the best token come from whisper_process_logits()
+    if (decoder.ts_id >= 0) {
+        result.tid = decoder.ts_id;
     }
+    result.pt    = decoder.ts_max/(decoder.ts_sum + 1e-10);
+    result.ptsum = decoder.ts_sum;
 
     if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
-        }
+        result.id   = decoder.best_id;
+        result.p    = probs[result.id];
+        result.plog = logprobs[result.id];
     } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
+        bool all = true;
+        const double mass = whisper_sample_candidates(decoder, params.top_k, params.top_p, all);
 
-        result.id   = dist(decoder.rng);
+        result.id   = whisper_sample_probs(decoder, all, mass);
         result.p    = probs[result.id];
         result.plog = logprobs[result.id];
     }
@@ -5292,6 +6926,8 @@ static whisper_token_data whisper_sample_token(
     return result;
 }
 
+// draws k tokens for the beam search, with replacement
+// the beam candidates are drawn from the whole distribution: top_k / top_p only restrict sampling at t > 0
 static std::vector<whisper_token_data> whisper_sample_token_topk(
             whisper_context & ctx,
             whisper_decoder & decoder,
@@ -5299,61 +6935,21 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
     const auto & vocab = ctx.vocab;
 
     const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
     const auto & logprobs = decoder.logprobs;
 
-    const int n_logits = vocab.n_vocab;
-
-    auto & logits_id = decoder.logits_id;
-
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
-
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+    bool all = true;
+    const double mass = whisper_sample_candidates(decoder, 0, 1.0f, all);
 
     std::vector<whisper_token_data> result;
     result.reserve(k);
 
-    whisper_token tid = vocab.token_beg;
-
-    float pt    = 0.0;
-    float ptsum = 0.0;
+    const whisper_token tid = decoder.ts_id >= 0 ? decoder.ts_id : vocab.token_beg;
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
-
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
-
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
-        }
-
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
-    }
-
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    const float pt    = decoder.ts_max/(decoder.ts_sum + 1e-10);
+    const float ptsum = decoder.ts_sum;
 
     for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
+        const auto id = whisper_sample_probs(decoder, all, mass);
         //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
 
         result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
@@ -5416,30 +7012,147 @@ static void whisper_sequence_score(
     }
 }
 
-int whisper_full_with_state(
+// returns the thread pool of the context, (re)created when the requested configuration changes
+static wsp_ggml_threadpool_t whisper_threadpool_get(struct whisper_context * ctx, int n_threads, uint64_t cpu_mask) {
+    struct wsp_ggml_threadpool_params tpp = wsp_ggml_threadpool_params_default(std::max(1, n_threads));
+    for (int i = 0; i < 64 && i < WSP_GGML_MAX_N_THREADS; i++) {
+        tpp.cpumask[i] = (cpu_mask >> i) & 1;
+    }
+    // idle threads sleep until the next graph is submitted, the default hybrid polling would keep them spinning
+    // on the cores the app and the audio callback need between the graphs of a run
+    tpp.paused = true;
+    tpp.poll   = 0;
+
+    if (ctx->threadpool && wsp_ggml_threadpool_params_match(&ctx->threadpool_params, &tpp)) {
+        return ctx->threadpool;
+    }
+
+    if (ctx->threadpool) {
+        wsp_ggml_threadpool_free(ctx->threadpool);
+    }
+
+    ctx->threadpool        = wsp_ggml_threadpool_new(&tpp);
+    ctx->threadpool_params = tpp;
+
+    if (ctx->threadpool == nullptr) {
+        WHISPER_LOG_WARN("%s: failed to create thread pool, falling back to per-call threads\n", __func__);
+    }
+
+    return ctx->threadpool;
+}
+
+// lends the context thread pool to a state for the duration of a whisper_full call
+// the pool is detached from the CPU backends and paused on exit, so it can be safely replaced by the next call
+// and its idle workers sleep instead of polling
+// if another state is already using the pool, this call runs with per-call threads instead of waiting for it
+// with a cpu_mask, the pool pins the calling thread (the JNI or dispatch queue thread) when it resumes: its
+// affinity is restored on exit so the mask doesn't leak into the rest of the app
+struct whisper_threadpool_scope {
+    whisper_context * ctx;
+    whisper_state * state;
+    bool locked = false;
+
+#if defined(__linux__)
+    bool      affinity_saved = false;
+    cpu_set_t affinity;
+#endif
+
+    whisper_threadpool_scope(struct whisper_context * ctx, struct whisper_state * state, const struct whisper_full_params & params) : ctx(ctx), state(state) {
+        locked = params.use_threadpool && ctx->threadpool_mutex.try_lock();
+        state->threadpool = locked ? whisper_threadpool_get(ctx, params.n_threads, params.cpu_mask) : nullptr;
+
+#if defined(__linux__)
+        if (state->threadpool != nullptr && params.cpu_mask != 0) {
+            affinity_saved = sched_getaffinity(0, sizeof(affinity), &affinity) == 0;
+        }
+#endif
+    }
+
+    ~whisper_threadpool_scope() {
+        if (state->threadpool != nullptr) {
+            for (auto & backend : state->backends) {
+                if (wsp_ggml_backend_is_cpu(backend)) {
+                    wsp_ggml_backend_cpu_set_threadpool(backend, nullptr);
+                }
+            }
+            // the next call resumes the pool, which pins that call's thread again
+            wsp_ggml_threadpool_pause(state->threadpool);
+            state->threadpool = nullptr;
+        }
+#if defined(__linux__)
+        if (affinity_saved) {
+            sched_setaffinity(0, sizeof(affinity), &affinity);
+        }
+#endif
+        if (locked) {
+            ctx->threadpool_mutex.unlock();
+        }
+    }
+};
+
+// one window of a longer audio, see whisper_full_i16_windowed()
+struct whisper_full_window {
+    bool has_prev; // keep the results of the previous windows
+    bool has_next; // the audio continues after seek_end
+    int  seek;     // [out] mel frame where the decoding stopped
+};
+
+// audio_ctx for params.audio_ctx_auto: the encoder positions covering n_frames mel frames plus a ~1.3 s margin,
+// rounded up to a multiple of 64 and never below 256 (~5 s) since very short contexts degrade the transcription
+// returns 0 (use the model default) when the audio fills the whole window
+static int whisper_audio_ctx_auto(const struct whisper_context * ctx, int n_frames) {
+    const int n_audio_ctx = ctx->model.hparams.n_audio_ctx;
+
+    int n = WSP_GGML_PAD((n_frames + 1)/2 + 64, 64);
+    n = std::max(n, 256);
+
+    return n < n_audio_ctx ? n : 0;
+}
+
+// runs the model on the log mel spectrogram already stored in the state
+// samples are only used for the signal energy when token timestamps are enabled
+static int whisper_full_from_mel(
         struct whisper_context * ctx,
           struct whisper_state * state,
     struct whisper_full_params   params,
                    const float * samples,
-                           int   n_samples) {
+                 const int16_t * samples_i16,
+                           int   n_samples,
+           whisper_full_window * window = nullptr) {
     // clear old results
     auto & result_all = state->result_all;
 
-    result_all.clear();
+    if (window == nullptr || !window->has_prev) {
+        result_all.clear();
+    }
 
-    if (n_samples > 0) {
-        // compute log mel spectrogram
-        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
-            return -2;
+    // size audio_ctx from the audio when it fits in a single window
+    if (params.audio_ctx_auto && params.audio_ctx == 0) {
+        const int seek_start = params.offset_ms/10;
+        const int seek_end   = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+
+        if (window == nullptr || !window->has_next) {
+            params.audio_ctx = whisper_audio_ctx_auto(ctx, std::min(seek_end, whisper_n_len_from_state(state)) - seek_start);
         }
     }
 
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    whisper_update_suppress_ids(*ctx, *state, params);
+
     // auto-detect language if not specified
+    // the first window is encoded with the same offset and audio_ctx as the main loop, which then reuses it
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+        const int offset_ms = params.offset_ms/10 < state->mel.n_len_org ? params.offset_ms : 0;
+
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, offset_ms, params.n_threads, probs.data());
         if (lang_id < 0) {
             WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
             return -3;
@@ -5458,13 +7171,18 @@ int whisper_full_with_state(
         state->t_last   = 0;
         state->tid_last = 0;
         if (n_samples > 0) {
-            state->energy = get_signal_energy(samples, n_samples, 32);
+            const whisper_padded_view signal = { samples, samples_i16, n_samples, 0 };
+            state->energy = get_signal_energy(signal, 32);
         }
     }
 
     const int seek_start = params.offset_ms/10;
     const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
 
+    if (window) {
+        window->seek = seek_end;
+    }
+
     // if length of spectrogram is less than 1.0s (100 frames), then return
     // basically don't process anything that is less than 1.0s
     // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
@@ -5552,13 +7270,6 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
@@ -5591,6 +7302,11 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // prompt decoded in kv_self for the current window and the logits of its last token
+    // temperature fallbacks with the same prompt start from them instead of decoding it again
+    std::vector<whisper_token> prompt_cached;
+    std::vector<float>         prompt_logits;
+
     struct beam_candidate {
         int decoder_idx;
         int seek_delta;
@@ -5625,20 +7341,24 @@ int whisper_full_with_state(
             }
         }
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        // encode audio features starting at offset seek, unless the language detection already did
+        const bool is_encoded = state->enc_mel_offset == seek && state->enc_n_audio_ctx == state->exp_n_audio_ctx;
+        if (!is_encoded && !whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
 
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
-        if (seek > seek_start && seek + 500 >= seek_end) {
+        if (seek > seek_start && seek + 500 >= seek_end && !(window && window->has_next)) {
             prompt_past.clear();
         }
 
         int best_decoder_id = 0;
 
+        // the encoder output changed, the cached prompt belongs to the previous window
+        prompt_cached.clear();
+
         for (int it = 0; it < (int) temperatures.size(); ++it) {
             const float t_cur = temperatures[it];
 
@@ -5691,7 +7411,6 @@ int whisper_full_with_state(
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
@@ -5709,7 +7428,7 @@ int whisper_full_with_state(
                 // print the prompt
                 WHISPER_LOG_DEBUG("\n\n");
                 for (int i = 0; i < (int) prompt.size(); i++) {
-                    WHISPER_LOG_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
+                    WHISPER_LOG_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.token_to_str(prompt[i]));
                 }
                 WHISPER_LOG_DEBUG("\n\n");
 
@@ -5717,6 +7436,7 @@ int whisper_full_with_state(
                 if (state->kv_self_n_dec < n_decoders_cur) {
                     WHISPER_LOG_DEBUG("%s: recreating KV cache: n_decoders_cur = %d\n", __func__, n_decoders_cur);
 
+                    whisper_decode_graph_reset(*state);
                     whisper_kv_cache_free(state->kv_self);
 
                     // overallocate to workaround KV cache fragmentation issues
@@ -5727,27 +7447,54 @@ int whisper_full_with_state(
                                 ctx->model.hparams.n_text_layer,
                                 WSP_GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
                         WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
-                        whisper_free_state(state);
+
+                        // the state belongs to the caller (often leased from the context pool), so it is not freed here
+                        // fall back to the single decoder cache of a new state, so it can still be reused or released
+                        state->kv_self.buffer = nullptr;
+                        state->kv_self_n_dec  = 0;
+                        if (whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+                                    ctx->model.hparams.n_text_state,
+                                    ctx->model.hparams.n_text_layer,
+                                    WSP_GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
+                            state->kv_self_n_dec = 1;
+                        } else {
+                            state->kv_self.buffer = nullptr;
+                        }
                         return -7;
                     }
 
                     state->kv_self_n_dec = n_decoders_cur;
+
+                    prompt_cached.clear();
                 }
 
-                whisper_kv_cache_clear(state->kv_self);
+                const int n_vocab = whisper_n_vocab(ctx);
+
+                if (prompt == prompt_cached && whisper_kv_cache_seq_keep_prefix(state->kv_self, prompt.size())) {
+                    // same prompt as the previous temperature: keep its KV cells and restore its logits
+                    state->logits.assign(prompt_logits.begin(), prompt_logits.end());
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                    state->decoders[0].i_batch = 0;
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
+
+                    whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -8;
+                    }
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                    WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                    return -8;
+                    // only the last prompt token has its logits output
+                    state->decoders[0].i_batch = 0;
+
+                    prompt_cached = prompt;
+                    prompt_logits.assign(state->logits.begin(), state->logits.begin() + n_vocab);
                 }
 
                 {
                     const int64_t t_start_sample_us = wsp_ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
-
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
                     for (int j = 1; j < n_decoders_cur; ++j) {
@@ -5758,6 +7505,11 @@ int whisper_full_with_state(
                         memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
                         memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
                         memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+
+                        decoder.best_id = state->decoders[0].best_id;
+                        decoder.ts_id   = state->decoders[0].ts_id;
+                        decoder.ts_max  = state->decoders[0].ts_max;
+                        decoder.ts_sum  = state->decoders[0].ts_sum;
                     }
 
                     state->t_sample_us += wsp_ggml_time_us() - t_start_sample_us;
@@ -5796,9 +7548,9 @@ int whisper_full_with_state(
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
                                     {
                                         if (t_cur < 1e-6f) {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
+                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, params, true));
                                         } else {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, false));
+                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, params, false));
                                         }
 
                                         decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
@@ -5884,7 +7636,7 @@ int whisper_full_with_state(
                         whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
 
                         WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                                __func__, j, cur.decoder_idx, ctx->vocab.token_to_str(decoder.sequence.tokens.back().id), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
                     }
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
@@ -5940,9 +7692,9 @@ int whisper_full_with_state(
 
 #ifdef WHISPER_DEBUG
                         {
-                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
+                            const auto tt = token.pt > 0.10 ? std::string(ctx->vocab.token_to_str(token.tid)) : "[?]";
                             WHISPER_LOG_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
-                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
+                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.token_to_str(token.id));
                         }
 #endif
 
@@ -6143,7 +7895,7 @@ int whisper_full_with_state(
 
             if (success) {
                 //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
-                //    WHISPER_LOG_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
+                //    WHISPER_LOG_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.token_to_str(token.tid), ctx->vocab.token_to_str(token.id));
                 //}
 
                 break;
@@ -6185,11 +7937,11 @@ int whisper_full_with_state(
 
                 for (int i = 0; i < (int) tokens_cur.size(); i++) {
                     //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+                    //        ctx->vocab.token_to_str(tokens_cur[i].id), tokens_cur[i].p,
+                    //        ctx->vocab.token_to_str(tokens_cur[i].tid), tokens_cur[i].pt);
 
                     if (params.print_special || tokens_cur[i].id < whisper_token_eot(ctx)) {
-                        text += whisper_token_to_str(ctx, tokens_cur[i].id);
+                        text.append(ctx->vocab.token_to_str(tokens_cur[i].id), ctx->vocab.token_len(tokens_cur[i].id));
                     }
 
                     // [TDRZ] record if speaker turn was predicted after current segment
@@ -6213,7 +7965,7 @@ int whisper_full_with_state(
                                 }
                             }
 
-                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
+                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.token_to_str(tokens_cur[i].id), tokens_cur[i].id, tokens_cur[i].tid);
 
                             result_all.push_back({ tt0, tt1, text, {}, speaker_turn_next });
                             for (int j = i0; j <= i; j++) {
@@ -6304,9 +8056,32 @@ int whisper_full_with_state(
         }
     }
 
+    if (window) {
+        window->seek = seek;
+    }
+
     return 0;
 }
 
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    whisper_threadpool_scope threadpool_scope(ctx, state, params);
+
+    if (n_samples > 0) {
+        // compute log mel spectrogram
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+    }
+
+    return whisper_full_from_mel(ctx, state, params, samples, nullptr, n_samples);
+}
+
 int whisper_full(
         struct whisper_context * ctx,
     struct whisper_full_params   params,
@@ -6315,121 +8090,662 @@ int whisper_full(
     return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
 }
 
-int whisper_full_parallel(
+int whisper_full_i16_with_state(
         struct whisper_context * ctx,
-        struct whisper_full_params params,
-        const float * samples,
-        int n_samples,
-        int n_processors) {
-    if (n_processors == 1) {
-        return whisper_full(ctx, params, samples, n_samples);
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                 const int16_t * samples,
+                           int   n_samples) {
+    whisper_threadpool_scope threadpool_scope(ctx, state, params);
+
+    if (n_samples > 0) {
+        // compute log mel spectrogram
+        if (whisper_pcm_i16_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
     }
-    int ret = 0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+    return whisper_full_from_mel(ctx, state, params, nullptr, samples, n_samples);
+}
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+int whisper_full_i16(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                 const int16_t * samples,
+                           int   n_samples) {
+    return whisper_full_i16_with_state(ctx, ctx->state, params, samples, n_samples);
+}
 
-    // the calling thread will process the first chunk
-    // while the other threads will process the remaining chunks
+// moves a segment and its token timestamps by t_offset (10 ms units), unset token timestamps stay unset
+static void whisper_segment_shift(whisper_segment & segment, int64_t t_offset) {
+    segment.t0 += t_offset;
+    segment.t1 += t_offset;
+    for (auto & token : segment.tokens) {
+        if (token.t0 >= 0) token.t0 += t_offset;
+        if (token.t1 >= 0) token.t1 += t_offset;
+        if (token.t_dtw >= 0) token.t_dtw += t_offset;
+    }
+}
 
-    std::vector<std::thread> workers(n_processors - 1);
+// forwards the callbacks of a window of whisper_full_i16_windowed() with the timestamps and progress
+// relative to the whole audio
+struct whisper_full_windowed_callbacks {
+    whisper_full_params params;
+
+    int64_t t_offset;  // start of the window, in 10 ms units
+    size_t  n_shifted; // segments already moved to the whole audio timeline
+
+    int progress_begin;
+    int progress_end;
+
+    void shift(struct whisper_state * state) {
+        auto & result_all = state->result_all;
+        for (; n_shifted < result_all.size(); n_shifted++) {
+            whisper_segment_shift(result_all[n_shifted], t_offset);
+        }
+    }
+
+    static void new_segment(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+        auto * cb = (whisper_full_windowed_callbacks *) user_data;
+        cb->shift(state);
+        if (cb->params.new_segment_callback) {
+            cb->params.new_segment_callback(ctx, state, n_new, cb->params.new_segment_callback_user_data);
+        }
+    }
+
+    static void progress(struct whisper_context * ctx, struct whisper_state * state, int progress, void * user_data) {
+        auto * cb = (whisper_full_windowed_callbacks *) user_data;
+        if (cb->params.progress_callback) {
+            const int progress_cur = cb->progress_begin + (cb->progress_end - cb->progress_begin)*progress/100;
+            cb->params.progress_callback(ctx, state, progress_cur, cb->params.progress_callback_user_data);
+        }
+    }
+};
+
+int whisper_full_i16_windowed_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                 const int16_t * samples,
+                           int   n_samples) {
+    whisper_threadpool_scope threadpool_scope(ctx, state, params);
+
+    // each window decodes WHISPER_CHUNK_SIZE seconds, the mel also covers the next WHISPER_CHUNK_SIZE seconds so
+    // that the segments crossing the end of the window are decoded from the real audio
+    const int n_step  = WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE;
+    const int n_ahead = WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE;
+
+    const int i_begin = std::min(n_samples, (int) ((int64_t) params.offset_ms*WHISPER_SAMPLE_RATE/1000));
+    const int i_end   = params.duration_ms > 0 ? std::min(n_samples, i_begin + (int) ((int64_t) params.duration_ms*WHISPER_SAMPLE_RATE/1000)) : n_samples;
+
+    whisper_full_windowed_callbacks cb = { params, 0, 0, 0, 0 };
+
+    whisper_full_params params_cur = params;
+    params_cur.offset_ms = 0;
+    params_cur.new_segment_callback           = whisper_full_windowed_callbacks::new_segment;
+    params_cur.new_segment_callback_user_data = &cb;
+    params_cur.progress_callback              = whisper_full_windowed_callbacks::progress;
+    params_cur.progress_callback_user_data    = &cb;
+
+    whisper_full_window window = { false, false, 0 };
+
+    std::string language;
+
+    int pos = i_begin;
+    do {
+        const int n_cur = std::min(i_end - pos, n_step + n_ahead);
+
+        window.has_next = pos + n_cur < i_end;
+        params_cur.duration_ms = window.has_next ? 1000*n_step/WHISPER_SAMPLE_RATE : 0;
+
+        cb.t_offset       = pos/WHISPER_HOP_LENGTH;
+        cb.progress_begin = i_end > i_begin ? (int) (100*(int64_t) (pos - i_begin)/(i_end - i_begin)) : 0;
+        cb.progress_end   = window.has_next ? (int) (100*(int64_t) (pos + n_step - i_begin)/(i_end - i_begin)) : 100;
+
+        // the mel of this window only, the previous one is overwritten
+        if (whisper_pcm_i16_to_mel_with_state(ctx, state, samples + pos, n_cur, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+
+        const int ret = whisper_full_from_mel(ctx, state, params_cur, nullptr, samples + pos, n_cur, &window);
+        cb.shift(state);
+
+        if (ret != 0) {
+            return ret;
+        }
+
+        // stopped before the end of the window: aborted, or only detecting the language
+        if (!window.has_next || window.seek + 100 < params_cur.duration_ms/10 || params.detect_language) {
+            break;
+        }
+
+        pos += window.seek*WHISPER_HOP_LENGTH;
+
+        // the next windows continue the same transcription
+        if (!window.has_prev) {
+            window.has_prev = true;
+
+            language = whisper_lang_str(state->lang_id);
+            params_cur.language       = language.c_str();
+            params_cur.no_context     = false;
+            params_cur.initial_prompt = nullptr;
+            params_cur.prompt_tokens  = nullptr;
+        }
+    } while (pos < i_end);
+
+    return 0;
+}
+
+int whisper_full_i16_windowed(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                 const int16_t * samples,
+                           int   n_samples) {
+    return whisper_full_i16_windowed_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
+int whisper_full_with_mel_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+     struct whisper_mel_stream * stream,
+                   const float * samples,
+                           int   n_samples) {
+    whisper_threadpool_scope threadpool_scope(ctx, state, params);
+
+    if (n_samples > 0) {
+        const int64_t t_start_us = wsp_ggml_time_us();
+
+        // only the frames covering new samples are computed
+        whisper_mel_stream_update(*stream, samples, n_samples, params.n_threads, *state);
+
+        state->t_mel_us += wsp_ggml_time_us() - t_start_us;
+    }
+
+    return whisper_full_from_mel(ctx, state, params, samples, nullptr, n_samples);
+}
+
+int whisper_full_with_mel(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+     struct whisper_mel_stream * stream,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_with_mel_with_state(ctx, ctx->state, params, stream, samples, n_samples);
+}
+
+static float whisper_sample_abs(float x)   { return std::fabs(x); }
+static float whisper_sample_abs(int16_t x) { return std::fabs(x/32768.0f); }
+
+static int whisper_full_chunk_with_state(struct whisper_context * ctx, struct whisper_state * state, struct whisper_full_params params, const float * samples, int n_samples) {
+    return whisper_full_with_state(ctx, state, params, samples, n_samples);
+}
+
+static int whisper_full_chunk_with_state(struct whisper_context * ctx, struct whisper_state * state, struct whisper_full_params params, const int16_t * samples, int n_samples) {
+    return whisper_full_i16_with_state(ctx, state, params, samples, n_samples);
+}
+
+// the middle of the quietest 200 ms of [center - radius, center + radius), the closest one to center on ties
+// the energy is the mean absolute amplitude over 10 ms blocks, so silence between words or sentences wins
+template <typename T>
+static int whisper_parallel_split_point(const T * samples, int i_begin, int i_end, int center, int radius) {
+    const int n_block  = WHISPER_SAMPLE_RATE/100;
+    const int n_window = 20;
+
+    const int i0 = std::max(i_begin, center - radius);
+    const int i1 = std::min(i_end,   center + radius);
+
+    const int n_blocks = (i1 - i0)/n_block;
+    if (n_blocks < n_window) {
+        return center;
+    }
+
+    std::vector<float> energy(n_blocks, 0.0f);
+    for (int b = 0; b < n_blocks; ++b) {
+        const T * x = samples + i0 + b*n_block;
+        for (int i = 0; i < n_block; ++i) {
+            energy[b] += whisper_sample_abs(x[i]);
+        }
+    }
+
+    float sum = 0.0f;
+    for (int b = 0; b < n_window; ++b) {
+        sum += energy[b];
+    }
+
+    int   best     = center;
+    float best_sum = std::numeric_limits<float>::max();
+
+    for (int b = 0; b + n_window <= n_blocks; ++b) {
+        if (b > 0) {
+            sum += energy[b + n_window - 1] - energy[b - 1];
+        }
+
+        const int mid = i0 + (b + n_window/2)*n_block;
+        if (sum < best_sum || (sum == best_sum && std::abs(mid - center) < std::abs(best - center))) {
+            best     = mid;
+            best_sum = sum;
+        }
+    }
+
+    return best;
+}
+
+// a piece of the audio decoded by one of the workers of whisper_full_parallel()
+struct whisper_parallel_chunk {
+    int s0, s1; // samples owned by this chunk
+    int d0, d1; // samples decoded, the owned ones plus the overlap with the neighbours
+
+    int ret;
+
+    std::vector<whisper_segment> segments;
+
+    // range of the kept text tokens, indices into the text tokens of all segments
+    int keep_begin;
+    int keep_end;
+};
+
+// reports the progress of the chunks decoded by the calling thread of whisper_full_parallel() as a
+// fraction of the whole audio
+struct whisper_parallel_progress {
+    whisper_full_params params;
+
+    const std::atomic<int> * n_done;
+    int n_chunks;
+    int last;
+
+    static void progress(struct whisper_context * ctx, struct whisper_state * state, int progress, void * user_data) {
+        auto * cb = (whisper_parallel_progress *) user_data;
+        const int progress_cur = std::min(100, (100*cb->n_done->load() + progress)/cb->n_chunks);
+        if (progress_cur > cb->last && cb->params.progress_callback) {
+            cb->last = progress_cur;
+            cb->params.progress_callback(ctx, state, progress_cur, cb->params.progress_callback_user_data);
+        }
+    }
+};
+
+// text tokens (everything before EOT) of the segments, in decoding order
+static std::vector<const whisper_token_data *> whisper_parallel_text_tokens(struct whisper_context * ctx, const std::vector<whisper_segment> & segments) {
+    std::vector<const whisper_token_data *> tokens;
+    for (const auto & segment : segments) {
+        for (const auto & token : segment.tokens) {
+            if (token.id < whisper_token_eot(ctx)) {
+                tokens.push_back(&token);
+            }
+        }
+    }
+    return tokens;
+}
+
+static int64_t whisper_token_mid(const whisper_token_data * token) {
+    return (token->t0 + token->t1)/2;
+}
+
+// decides where the transcriptions of two neighbouring chunks are joined
+// both chunks decoded [split - overlap, split + overlap): the longest run of identical tokens at about the
+// same time in both is the same speech, the left chunk keeps the first half of it and the right chunk the rest
+// without such a run, each chunk keeps the tokens on its side of the split
+static void whisper_parallel_stitch(
+        struct whisper_context * ctx,
+        whisper_parallel_chunk & left,
+        whisper_parallel_chunk & right,
+        int64_t split,
+        int64_t overlap) {
+    const auto tokens_l = whisper_parallel_text_tokens(ctx, left.segments);
+    const auto tokens_r = whisper_parallel_text_tokens(ctx, right.segments);
+
+    // the tokens of the left chunk past split - overlap and of the right chunk before split + overlap
+    int l0 = (int) tokens_l.size();
+    while (l0 > 0 && whisper_token_mid(tokens_l[l0 - 1]) >= split - overlap) {
+        --l0;
+    }
+
+    int r1 = 0;
+    while (r1 < (int) tokens_r.size() && whisper_token_mid(tokens_r[r1]) < split + overlap) {
+        ++r1;
+    }
+
+    const int n_l = (int) tokens_l.size() - l0;
+    const int n_r = r1;
+
+    // longest common run, match[i][j] = run length ending at tokens_l[l0 + i - 1] and tokens_r[j - 1]
+    std::vector<int> match((n_l + 1)*(n_r + 1), 0);
+
+    int best_len = 0;
+    int best_l   = 0;
+    int best_r   = 0;
+
+    for (int i = 1; i <= n_l; ++i) {
+        for (int j = 1; j <= n_r; ++j) {
+            const auto * tl = tokens_l[l0 + i - 1];
+            const auto * tr = tokens_r[j - 1];
+            if (tl->id != tr->id || std::abs(whisper_token_mid(tl) - whisper_token_mid(tr)) > overlap) {
+                continue;
+            }
+
+            const int len = match[(i - 1)*(n_r + 1) + (j - 1)] + 1;
+            match[i*(n_r + 1) + j] = len;
+
+            if (len > best_len) {
+                best_len = len;
+                best_l   = l0 + i - len;
+                best_r   = j - len;
+            }
+        }
+    }
+
+    if (best_len >= 2) {
+        const int m = best_len/2;
+        left.keep_end    = std::min(left.keep_end, best_l + m);
+        right.keep_begin = std::max(right.keep_begin, best_r + m);
+        return;
+    }
+
+    int l1 = l0;
+    while (l1 < (int) tokens_l.size() && whisper_token_mid(tokens_l[l1]) < split) {
+        ++l1;
+    }
+
+    int r0 = 0;
+    while (r0 < r1 && whisper_token_mid(tokens_r[r0]) < split) {
+        ++r0;
+    }
+
+    left.keep_end    = std::min(left.keep_end, l1);
+    right.keep_begin = std::max(right.keep_begin, r0);
+}
+
+// drops the text tokens of the chunk outside [keep_begin, keep_end), the segments cut by the range are
+// rebuilt from the tokens they keep and the empty ones are removed
+static void whisper_parallel_trim(struct whisper_context * ctx, whisper_parallel_chunk & chunk) {
+    std::vector<whisper_segment> segments;
+
+    int f0 = 0;
+    for (auto & segment : chunk.segments) {
+        int n_text = 0;
+        for (const auto & token : segment.tokens) {
+            n_text += token.id < whisper_token_eot(ctx);
+        }
+
+        const int f1 = f0 + n_text;
+
+        if (f0 >= chunk.keep_begin && f1 <= chunk.keep_end) {
+            if (n_text > 0 || f0 < chunk.keep_end) {
+                segments.push_back(std::move(segment));
+            }
+        } else if (std::max(f0, chunk.keep_begin) < std::min(f1, chunk.keep_end)) {
+            whisper_segment kept = { segment.t0, segment.t1, "", {}, segment.speaker_turn_next };
+
+            int f = f0;
+            for (const auto & token : segment.tokens) {
+                if (token.id >= whisper_token_eot(ctx)) {
+                    continue;
+                }
+                if (f >= chunk.keep_begin && f < chunk.keep_end) {
+                    kept.text.append(ctx->vocab.token_to_str(token.id), ctx->vocab.token_len(token.id));
+                    kept.tokens.push_back(token);
+                }
+                ++f;
+            }
+
+            kept.t0 = std::max(segment.t0, std::min(segment.t1, kept.tokens.front().t0));
+            kept.t1 = std::min(segment.t1, std::max(kept.t0,      kept.tokens.back().t1));
+
+            segments.push_back(std::move(kept));
+        }
+
+        f0 = f1;
+    }
+
+    chunk.segments = std::move(segments);
+}
+
+template <typename T>
+static int whisper_full_parallel_impl(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                       const T * samples,
+                           int   n_samples,
+                           int   n_processors) {
+    const int i_begin = std::min(n_samples, (int) ((int64_t) params.offset_ms*WHISPER_SAMPLE_RATE/1000));
+    const int i_end   = params.duration_ms > 0 ? std::min(n_samples, i_begin + (int) ((int64_t) params.duration_ms*WHISPER_SAMPLE_RATE/1000)) : n_samples;
+
+    // no worker gets less than 10 s of audio: whisper_full() skips chunks under a second, and short chunks lose
+    // the context at their edges, so short clips run on fewer workers or on the target state alone
+    const int n_chunk_abs = 10*WHISPER_SAMPLE_RATE;
+    n_processors = std::min(n_processors, std::max(1, (i_end - i_begin)/n_chunk_abs));
+
+    // more chunks than workers, so a worker done with quiet audio takes more work while the others
+    // are busy with dense speech, but not less than a minute of audio per chunk unless that leaves workers idle
+    const int n_chunk_min = 60*WHISPER_SAMPLE_RATE;
+    const int n_chunks    = std::max(1, std::min(4*n_processors, std::max(n_processors, (i_end - i_begin)/n_chunk_min)));
+
+    if (n_processors <= 1 || n_chunks <= 1 || params.detect_language) {
+        return whisper_full_chunk_with_state(ctx, state, params, samples, n_samples);
+    }
+
+    // lease separate states for each thread, they stay warm in the context pool between calls
+    std::vector<whisper_state*> states;
     for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+        whisper_state * state_cur = whisper_state_acquire(ctx);
+        if (state_cur == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to acquire state for worker %d\n", __func__, i + 1);
+            for (auto * s : states) {
+                whisper_state_release(ctx, s);
+            }
+            return -1;
+        }
+        states.push_back(state_cur);
+    }
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+    // split near the equal-length boundaries, at the quietest point within a quarter of a chunk (at most 5 s)
+    const int n_per_chunk = (i_end - i_begin)/n_chunks;
+    const int radius      = std::min(5*WHISPER_SAMPLE_RATE, n_per_chunk/4);
+    const int n_overlap   = std::min(5*WHISPER_SAMPLE_RATE, std::max(0, (int) ((int64_t) params.parallel_overlap_ms*WHISPER_SAMPLE_RATE/1000)));
+
+    std::vector<whisper_parallel_chunk> chunks(n_chunks);
+    for (int i = 0; i < n_chunks; ++i) {
+        auto & chunk = chunks[i];
+
+        chunk.s0 = i == 0 ? i_begin : chunks[i - 1].s1;
+        chunk.s1 = i == n_chunks - 1 ? i_end : whisper_parallel_split_point(samples, i_begin, i_end, i_begin + (i + 1)*n_per_chunk, radius);
+        chunk.d0 = std::max(i_begin, chunk.s0 - n_overlap);
+        chunk.d1 = std::min(i_end,   chunk.s1 + n_overlap);
+
+        chunk.ret        = 0;
+        chunk.keep_begin = 0;
+        chunk.keep_end   = std::numeric_limits<int>::max();
+    }
 
-        auto params_cur = params;
+    auto params_cur = params;
 
-        params_cur.offset_ms = 0;
-        params_cur.print_progress = false;
-        params_cur.print_realtime = false;
+    params_cur.offset_ms      = 0;
+    params_cur.duration_ms    = 0;
+    params_cur.print_progress = false;
+    params_cur.print_realtime = false;
 
-        params_cur.new_segment_callback = nullptr;
-        params_cur.new_segment_callback_user_data = nullptr;
+    params_cur.new_segment_callback = nullptr;
+    params_cur.new_segment_callback_user_data = nullptr;
 
-        params_cur.progress_callback = nullptr;
-        params_cur.progress_callback_user_data = nullptr;
+    params_cur.progress_callback = nullptr;
+    params_cur.progress_callback_user_data = nullptr;
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+    // the context thread pool can only serve one graph at a time
+    params_cur.use_threadpool = false;
+
+    // the overlaps are matched by the token times
+    if (n_overlap > 0) {
+        params_cur.token_timestamps = true;
     }
 
+    // the workers take the next chunk from a shared counter until there is none left, or one of them failed
+    std::atomic<int>  i_next(0);
+    std::atomic<int>  n_done(0);
+    std::atomic<bool> failed(false);
+
+    // a state goes through chunks that are not adjacent, so the text context of one chunk must not leak
+    // into the next one it takes: only the first chunk continues from the context of the target state,
+    // and the target state continues from the last chunk
+    const std::vector<whisper_token> prompt_first = state->prompt_past;
+    std::vector<whisper_token> prompt_last;
+
+    auto work = [&](whisper_state * state_cur, whisper_full_params params_work) {
+        for (int i = i_next++; i < n_chunks && !failed; i = i_next++) {
+            auto & chunk = chunks[i];
+
+            if (i == 0) {
+                state_cur->prompt_past = prompt_first;
+            } else {
+                state_cur->prompt_past.clear();
+            }
+
+            chunk.ret = whisper_full_chunk_with_state(ctx, state_cur, params_work, samples + chunk.d0, chunk.d1 - chunk.d0);
+            if (chunk.ret != 0) {
+                failed = true;
+                break;
+            }
+
+            if (i == n_chunks - 1) {
+                prompt_last = state_cur->prompt_past;
+            }
+
+            chunk.segments = std::move(state_cur->result_all);
+            state_cur->result_all.clear();
+
+            const int64_t t_offset = (int64_t) chunk.d0*100/WHISPER_SAMPLE_RATE;
+            for (auto & segment : chunk.segments) {
+                whisper_segment_shift(segment, t_offset);
+            }
+
+            n_done++;
+        }
+    };
+
+    std::vector<std::thread> workers(n_processors - 1);
+    for (int i = 0; i < n_processors - 1; ++i) {
+        workers[i] = std::thread(work, states[i], params_cur);
+    }
+
+    // the calling thread works on the target state and is the only one reporting the progress
     {
-        auto params_cur = params;
+        whisper_parallel_progress cb = { params, &n_done, n_chunks, -1 };
 
-        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
-        params_cur.print_realtime = false;
+        auto params_main = params_cur;
+        params_main.progress_callback           = whisper_parallel_progress::progress;
+        params_main.progress_callback_user_data = &cb;
 
-        // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+        work(state, params_main);
     }
 
     for (int i = 0; i < n_processors - 1; ++i) {
         workers[i].join();
     }
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    state->prompt_past = std::move(prompt_last);
 
-    // combine results into result_state->result_all from all other states
-    for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
+    int ret = 0;
+    for (const auto & chunk : chunks) {
+        if (chunk.ret != 0) {
+            ret = chunk.ret;
+            break;
+        }
+    }
+
+    // join the chunks, dropping what was decoded twice in the overlaps
+    if (ret == 0 && n_overlap > 0) {
+        for (int i = 0; i < n_chunks - 1; ++i) {
+            whisper_parallel_stitch(ctx, chunks[i], chunks[i + 1], (int64_t) chunks[i].s1*100/WHISPER_SAMPLE_RATE, (int64_t) n_overlap*100/WHISPER_SAMPLE_RATE);
+        }
+        for (auto & chunk : chunks) {
+            whisper_parallel_trim(ctx, chunk);
+        }
+    }
 
-        for (auto& result : results_i) {
-            // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+    auto & result_all = state->result_all;
+    result_all.clear();
 
+    for (auto & chunk : chunks) {
+        for (auto & segment : chunk.segments) {
             // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+            if (!result_all.empty()) {
+                segment.t0 = std::max(segment.t0, result_all.back().t1);
+                segment.t1 = std::max(segment.t1, segment.t0);
             }
 
-            ctx->state->result_all.push_back(std::move(result));
+            result_all.push_back(std::move(segment));
 
             // call the new_segment_callback for each segment
-            if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+            if (ret == 0 && params.new_segment_callback) {
+                params.new_segment_callback(ctx, state, 1, params.new_segment_callback_user_data);
             }
         }
+    }
 
-        ctx->state->t_mel_us += states[i]->t_mel_us;
+    for (auto * state_cur : states) {
+        state->t_mel_us += state_cur->t_mel_us;
 
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
-        ctx->state->t_batchd_us += states[i]->t_batchd_us;
-        ctx->state->t_prompt_us += states[i]->t_prompt_us;
+        state->t_sample_us += state_cur->t_sample_us;
+        state->t_encode_us += state_cur->t_encode_us;
+        state->t_decode_us += state_cur->t_decode_us;
+        state->t_batchd_us += state_cur->t_batchd_us;
+        state->t_prompt_us += state_cur->t_prompt_us;
 
-        ctx->state->n_sample += states[i]->n_sample;
-        ctx->state->n_encode += states[i]->n_encode;
-        ctx->state->n_decode += states[i]->n_decode;
-        ctx->state->n_batchd += states[i]->n_batchd;
-        ctx->state->n_prompt += states[i]->n_prompt;
+        state->n_sample += state_cur->n_sample;
+        state->n_encode += state_cur->n_encode;
+        state->n_decode += state_cur->n_decode;
+        state->n_batchd += state_cur->n_batchd;
+        state->n_prompt += state_cur->n_prompt;
 
-        whisper_free_state(states[i]);
+        whisper_state_release(ctx, state_cur);
     }
 
     // average the timings
-    ctx->state->t_mel_us    /= n_processors;
-    ctx->state->t_sample_us /= n_processors;
-    ctx->state->t_encode_us /= n_processors;
-    ctx->state->t_decode_us /= n_processors;
+    state->t_mel_us    /= n_processors;
+    state->t_sample_us /= n_processors;
+    state->t_encode_us /= n_processors;
+    state->t_decode_us /= n_processors;
 
     // print information about the audio boundaries
-    WHISPER_LOG_WARN("\n");
-    WHISPER_LOG_WARN("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        WHISPER_LOG_WARN("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+    WHISPER_LOG_INFO("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_chunks);
+    for (int i = 0; i < n_chunks - 1; ++i) {
+        WHISPER_LOG_INFO("%s: split %d - %s\n", __func__, (i + 1), to_timestamp((int64_t) chunks[i].s1*100/WHISPER_SAMPLE_RATE).c_str());
     }
-    WHISPER_LOG_WARN("%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
     return ret;
 }
 
+int whisper_full_parallel_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_processors) {
+    return whisper_full_parallel_impl(ctx, state, params, samples, n_samples, n_processors);
+}
+
+int whisper_full_i16_parallel_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                 const int16_t * samples,
+                           int   n_samples,
+                           int   n_processors) {
+    return whisper_full_parallel_impl(ctx, state, params, samples, n_samples, n_processors);
+}
+
+int whisper_full_parallel(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+    return whisper_full_parallel_with_state(ctx, ctx->state, params, samples, n_samples, n_processors);
+}
+
 int whisper_full_n_segments_from_state(struct whisper_state * state) {
     return state->result_all.size();
 }
@@ -6487,11 +8803,11 @@ int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
 }
 
 const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
+    return ctx->vocab.token_to_str(state->result_all[i_segment].tokens[i_token].id);
 }
 
 const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
+    return ctx->vocab.token_to_str(ctx->state->result_all[i_segment].tokens[i_token].id);
 }
 
 whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
@@ -6796,6 +9112,98 @@ WHISPER_API const char * whisper_bench_wsp_ggml_mul_mat_str(int n_threads) {
     return s.c_str();
 }
 
+WHISPER_API int whisper_bench_kv_cache(int beam_size) {
+    fputs(whisper_bench_kv_cache_str(beam_size), stderr);
+    return 0;
+}
+
+// replays the KV cache bookkeeping of a beam search over a 448 token text context, without the model:
+// one slot per beam each step, the self-attention mask and the reordering of the beams through seq_cp / seq_rm
+WHISPER_API const char * whisper_bench_kv_cache_str(int beam_size) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    wsp_ggml_time_init();
+
+    beam_size = std::max(1, std::min(beam_size, WHISPER_MAX_DECODERS));
+
+    const int n_text_ctx = 448;
+    const int n_prompt   = 32;
+    const int n_steps    = n_text_ctx/2;
+    const int n_rep      = 20;
+
+    // sized like the self-attention cache of whisper_full_with_state()
+    whisper_kv_cache cache;
+    cache.size = WSP_GGML_PAD(n_text_ctx, 256)*(beam_size + 2);
+    cache.pos.assign(cache.size, -1);
+    cache.seq.assign(cache.size, 0);
+
+    whisper_batch batch = whisper_batch_init(n_text_ctx, WHISPER_MAX_DECODERS);
+
+    std::vector<float> mask;
+
+    int64_t t_us = 0;
+
+    for (int r = 0; r < n_rep; ++r) {
+        std::fill(cache.pos.begin(), cache.pos.end(), -1);
+        std::fill(cache.seq.begin(), cache.seq.end(), 0);
+        cache.used_max = 0;
+        cache.head     = 0;
+
+        const int64_t t0 = wsp_ggml_time_us();
+
+        whisper_batch_prep_legacy(batch, nullptr, n_prompt, 0, 0);
+        whisper_kv_cache_find_slot(cache, batch);
+
+        for (int j = 1; j < beam_size; ++j) {
+            whisper_kv_cache_seq_cp(cache, 0, j, -1, -1);
+        }
+
+        for (int i = 0; i < n_steps; ++i) {
+            batch.n_tokens = 0;
+            for (int j = 0; j < beam_size; ++j) {
+                batch.pos     [batch.n_tokens]    = n_prompt + i;
+                batch.n_seq_id[batch.n_tokens]    = 1;
+                batch.seq_id  [batch.n_tokens][0] = j;
+                batch.logits  [batch.n_tokens]    = 1;
+                batch.n_tokens++;
+            }
+
+            if (!whisper_kv_cache_find_slot(cache, batch)) {
+                whisper_batch_free(batch);
+                return "error: failed to find a KV cache slot\n";
+            }
+
+            cache.n = whisper_kv_cache_cell_max(cache);
+
+            mask.resize(cache.n*beam_size);
+            whisper_kv_cache_mask(cache, batch, cache.n, mask.data());
+
+            // every beam continues from some other beam
+            for (int j = 0; j < beam_size; ++j) {
+                whisper_kv_cache_seq_cp(cache, (7*j + i) % beam_size, WHISPER_MAX_DECODERS + j, -1, -1);
+            }
+
+            for (int j = 0; j < beam_size; ++j) {
+                whisper_kv_cache_seq_rm(cache, j,                           -1, -1);
+                whisper_kv_cache_seq_cp(cache, WHISPER_MAX_DECODERS + j, j, -1, -1);
+                whisper_kv_cache_seq_rm(cache, WHISPER_MAX_DECODERS + j,    -1, -1);
+            }
+        }
+
+        t_us += wsp_ggml_time_us() - t0;
+    }
+
+    whisper_batch_free(batch);
+
+    snprintf(strbuf, sizeof(strbuf), "kv cache: beam size %d, %d cells: %8.2f us per step (%d steps)\n",
+            beam_size, (int) cache.size, (double) t_us/(n_rep*n_steps), n_rep*n_steps);
+    s += strbuf;
+
+    return s.c_str();
+}
+
 // =================================================================================================
 
 // =================================================================================================
@@ -6848,8 +9256,9 @@ static float voice_length(const std::string & text) {
 }
 
 // average the fabs of the signal
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window) {
+static std::vector<float> get_signal_energy(const whisper_padded_view & signal, int n_samples_per_half_window) {
     const int hw = n_samples_per_half_window;
+    const int n_samples = signal.n_samples;
 
     std::vector<float> result(n_samples);
 
@@ -6857,7 +9266,7 @@ static std::vector<float> get_signal_energy(const float * signal, int n_samples,
         float sum = 0;
         for (int j = -hw; j <= hw; j++) {
             if (i + j >= 0 && i + j < n_samples) {
-                sum += fabs(signal[i + j]);
+                sum += fabs(signal.sample(i + j));
             }
         }
         result[i] = sum/(2*hw + 1);
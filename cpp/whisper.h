@@ -116,7 +116,9 @@ extern "C" {
         bool  use_gpu;
         bool  use_coreml;
         bool  flash_attn;
+        bool  use_mmap;    // map the model file and use the CPU weights in place (whisper_init_from_file_* only)
         int   gpu_device;  // CUDA device
+        int   n_states_idle_max; // idle states kept by whisper_state_release() for reuse, the others are freed
 
         // [EXPERIMENTAL] Token-level timestamps with DTW
         bool dtw_token_timestamps;
@@ -229,6 +231,18 @@ extern "C" {
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // Lease a state from the pool of the context, a new one is created if none is idle
+    // Each leased state can run whisper_full_with_state() concurrently with the others, the model weights are shared
+    // Return it with whisper_state_release(), it's reset to a fresh state (no results, no past prompt) and kept
+    // for reuse, up to params.n_states_idle_max idle states. The pooled states are freed by whisper_free()
+    // All are thread safe, whisper_state_acquire() returns NULL on failure
+    WHISPER_API struct whisper_state * whisper_state_acquire(struct whisper_context * ctx);
+    WHISPER_API void                   whisper_state_release(struct whisper_context * ctx, struct whisper_state * state);
+
+    // Free the idle states of the pool beyond n_keep (e.g. 0 when the system is low on memory)
+    // Returns the number of states freed
+    WHISPER_API int whisper_state_pool_trim(struct whisper_context * ctx, int n_keep);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -292,6 +306,18 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    // Incremental log mel spectrogram for audio that only grows over time (e.g. realtime capture).
+    // The stream keeps the raw log mel frames that no longer depend on future samples, so each
+    // update only computes the frames covering newly appended samples. The clamping and
+    // normalization that depend on the global max are re-applied on every update.
+    // The samples passed to the stream must always start with the samples passed previously.
+    // Call whisper_mel_stream_reset() when starting over with unrelated audio.
+    struct whisper_mel_stream;
+
+    WHISPER_API struct whisper_mel_stream * whisper_mel_stream_init(struct whisper_context * ctx);
+    WHISPER_API void whisper_mel_stream_reset(struct whisper_mel_stream * stream);
+    WHISPER_API void whisper_mel_stream_free (struct whisper_mel_stream * stream);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the default state in the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -398,8 +424,8 @@ extern "C" {
     WHISPER_API int whisper_model_type         (struct whisper_context * ctx);
 
     // Token logits obtained from the last call to whisper_decode()
-    // The logits for the last token are stored in the last row
-    // Rows: n_tokens
+    // Only the logits for the last token are computed and stored
+    // Rows: 1
     // Cols: n_vocab
     WHISPER_API float * whisper_get_logits           (struct whisper_context * ctx);
     WHISPER_API float * whisper_get_logits_from_state(struct whisper_state * state);
@@ -423,7 +449,7 @@ extern "C" {
     WHISPER_API whisper_token whisper_token_translate (struct whisper_context * ctx);
     WHISPER_API whisper_token whisper_token_transcribe(struct whisper_context * ctx);
 
-    // Performance information from the default state.
+    // Performance information from the default state, or from the state that ran with whisper_get_timings_from_state().
     struct whisper_timings {
         int64_t load_us;
         int64_t t_start_us;
@@ -440,8 +466,13 @@ extern "C" {
         int64_t t_decode_us;
         int64_t t_batchd_us;
         int64_t t_prompt_us;
+        int64_t load_bytes;     // bytes of the model file read while loading
+        int64_t t_load_read_us; // time spent reading the model source (I/O thread for loader-based inits)
+        int64_t t_load_wait_us; // time the loader waited on that I/O
+        int32_t n_audio_ctx;    // encoder context used by the last transcription
     };
     WHISPER_API struct whisper_timings * whisper_get_timings(struct whisper_context * ctx);
+    WHISPER_API struct whisper_timings * whisper_get_timings_from_state(struct whisper_context * ctx, struct whisper_state * state);
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
 
@@ -487,9 +518,12 @@ extern "C" {
         enum whisper_sampling_strategy strategy;
 
         int n_threads;
+        bool     use_threadpool; // run the mel front-end and the CPU backend on a persistent thread pool owned by the context
+        uint64_t cpu_mask;       // pin the thread pool to these CPU cores (bit i = core i, 0 = default affinity)
         int n_max_text_ctx;     // max tokens to use from past text as prompt for the decoder
         int offset_ms;          // start offset in ms
         int duration_ms;        // audio duration to process in ms
+        int parallel_overlap_ms; // whisper_full_parallel: audio decoded past each split on both sides, the duplicates are dropped (0 = off)
 
         bool translate;
         bool no_context;        // do not use past transcription (if any) as initial prompt for the decoder
@@ -512,6 +546,7 @@ extern "C" {
         // note: these can significantly reduce the quality of the output
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool audio_ctx_auto;    // size audio_ctx from the audio length when it is shorter than a window (audio_ctx must be 0)
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -538,6 +573,8 @@ extern "C" {
         float temperature;      // initial decoding temperature, ref: https://ai.stackexchange.com/a/32478
         float max_initial_ts;   // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L97
         float length_penalty;   // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L267
+        int   top_k;            // at t > 0 sample only from the top_k most likely tokens (0 = all tokens), beam search candidates are not restricted
+        float top_p;            // at t > 0 sample only from the most likely tokens that add up to top_p (1.0 = all tokens), beam search candidates are not restricted
 
         // fallback parameters
         // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L274-L278
@@ -604,11 +641,62 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
+    // Same as whisper_full(), but takes 16-bit PCM directly
+    // The samples are scaled to [-1, 1) while the mel front-end windows them, no float copy of the audio is made
+    WHISPER_API int whisper_full_i16(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+                         const int16_t * samples,
+                                   int   n_samples);
+
+    WHISPER_API int whisper_full_i16_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                         const int16_t * samples,
+                                   int   n_samples);
+
+    // Same as whisper_full_i16(), but the log mel spectrogram is computed for one 30 s window (plus 30 s of look-ahead)
+    // at a time, so the memory used by the state does not grow with the length of the audio
+    // The timestamps and the progress reported through the callbacks are relative to the whole audio
+    WHISPER_API int whisper_full_i16_windowed(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+                         const int16_t * samples,
+                                   int   n_samples);
+
+    WHISPER_API int whisper_full_i16_windowed_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                         const int16_t * samples,
+                                   int   n_samples);
+
+    // Same as whisper_full(), but the log mel spectrogram is updated incrementally through the given stream
+    // samples + n_samples must contain the whole audio, including the samples seen by previous calls
+    WHISPER_API int whisper_full_with_mel(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+             struct whisper_mel_stream * stream,
+                           const float * samples,
+                                   int   n_samples);
+
+    WHISPER_API int whisper_full_with_mel_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+             struct whisper_mel_stream * stream,
+                           const float * samples,
+                                   int   n_samples);
+
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
-    // Result is stored in the default state of the context
-    // Not thread safe if executed in parallel on the same context.
-    // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
+    // The audio is split at the quietest point near the equal-length boundaries, into more chunks than processors
+    // for long audio, and n_processors threads take the chunks one at a time until none is left.
+    // With params.parallel_overlap_ms > 0, each chunk also decodes that much audio past its splits and the text
+    // decoded twice is matched by the token timestamps (forced on) and kept once.
+    // Result is stored in the default state of the context (or the given state), the other threads use states leased from the pool
+    // Not thread safe if executed in parallel on the same state.
+    // The transcription accuracy can still be worse near the splits, since each chunk is decoded without the previous text.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -616,6 +704,22 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    WHISPER_API int whisper_full_parallel_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples,
+                                   int   n_processors);
+
+    WHISPER_API int whisper_full_i16_parallel_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                         const int16_t * samples,
+                                   int   n_samples,
+                                   int   n_processors);
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
@@ -670,6 +774,8 @@ extern "C" {
     WHISPER_API const char * whisper_bench_memcpy_str      (int n_threads);
     WHISPER_API int          whisper_bench_wsp_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_wsp_ggml_mul_mat_str(int n_threads);
+    WHISPER_API int          whisper_bench_kv_cache            (int beam_size);
+    WHISPER_API const char * whisper_bench_kv_cache_str        (int beam_size);
 
     // Control logging output; default behavior is to print to stderr
 
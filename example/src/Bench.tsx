@@ -4,7 +4,7 @@ import { TouchableOpacity } from 'react-native-gesture-handler'
 import RNFS from 'react-native-fs'
 import Clipboard from '@react-native-clipboard/clipboard'
 import { initWhisper } from '../../src' // whisper.rn
-import { createDir, fileDir, modelHost } from './util'
+import { createDir, fileDir, modelHost, wordErrors } from './util'
 import { Button } from './Button'
 
 const modelList = [
@@ -330,6 +330,95 @@ export default function Bench() {
           )
         }}
       />
+      <Button
+        title="Start concurrent jobs benchmark"
+        onPress={async () => {
+          log('Start concurrent jobs benchmark')
+          log('| Model | Th | 1 job/s | 2 jobs/s | 4 jobs/s |')
+          log('| --- | --- | --- | --- | --- |')
+          await Object.entries(downloadMap).reduce(
+            async (promise, [modelName, downloadNeeded]) => {
+              await promise
+              if (!downloadNeeded) return
+              const filePath = `${fileDir}/ggml-${modelName}.bin`
+              if (!(await RNFS.exists(filePath))) {
+                log(`${modelName} not found, skipping`)
+                return
+              }
+              const ctx = await initWhisper({ filePath, useCoreMLIos: false })
+              try {
+                const { nThreads, jobsPerSec } = await ctx.benchJobs(1)
+                log(
+                  `| ${modelName} | ${nThreads} | ${jobsPerSec
+                    .map((n) => n.toFixed(2))
+                    .join(' | ')} |`,
+                )
+              } finally {
+                await ctx.release()
+              }
+            },
+            Promise.resolve(),
+          )
+        }}
+      />
+      <Button
+        title="Start audioCtxAuto WER benchmark"
+        onPress={async () => {
+          // Corpus: <name>.wav with the reference transcript in <name>.txt
+          const corpusDir = `${fileDir}/corpus`
+          if (!(await RNFS.exists(corpusDir))) {
+            log(`${corpusDir} not found`)
+            return
+          }
+          const corpus = (await RNFS.readDir(corpusDir)).filter((file) =>
+            file.name.endsWith('.wav'),
+          )
+          log(`Start audioCtxAuto WER benchmark (${corpus.length} files)`)
+          log('| Model | audio_ctx | WER | Time (ms) |')
+          log('| --- | --- | --- | --- |')
+          await Object.entries(downloadMap).reduce(
+            async (promise, [modelName, downloadNeeded]) => {
+              await promise
+              if (!downloadNeeded) return
+              const filePath = `${fileDir}/ggml-${modelName}.bin`
+              if (!(await RNFS.exists(filePath))) return
+              const ctx = await initWhisper({ filePath, useCoreMLIos: false })
+              try {
+                await [false, true].reduce(async (prevRun, audioCtxAuto) => {
+                  await prevRun
+                  let errors = 0
+                  let words = 0
+                  let timeMs = 0
+                  await corpus.reduce(async (prevFile, file) => {
+                    await prevFile
+                    const refPath = file.path.replace(/\.wav$/, '.txt')
+                    if (!(await RNFS.exists(refPath))) return
+                    const reference = await RNFS.readFile(refPath)
+                    const t0 = Date.now()
+                    const { result } = await ctx.transcribe(file.path, {
+                      language: 'en',
+                      audioCtxAuto,
+                    }).promise
+                    timeMs += Date.now() - t0
+                    const wer = wordErrors(reference, result)
+                    errors += wer.errors
+                    words += wer.words
+                  }, Promise.resolve())
+                  log(
+                    `| ${modelName} | ${audioCtxAuto ? 'auto' : 'fixed'} | ${(
+                      (100 * errors) /
+                      Math.max(words, 1)
+                    ).toFixed(2)}% | ${timeMs} |`,
+                  )
+                }, Promise.resolve())
+              } finally {
+                await ctx.release()
+              }
+            },
+            Promise.resolve(),
+          )
+        }}
+      />
       <View style={styles.logContainer}>
         {logs.map((msg, index) => (
           <Text key={index} style={styles.logText}>
@@ -33,3 +33,31 @@ export function toTimestamp(t: number, comma = false) {
 
   return timestamp
 }
+
+const normalizeWords = (text: string) =>
+  text
+    .toLowerCase()
+    .replace(/[^\p{L}\p{N}' ]+/gu, ' ')
+    .split(' ')
+    .filter(Boolean)
+
+// Word-level edit distance between a reference and a hypothesis transcript
+export function wordErrors(reference: string, hypothesis: string) {
+  const ref = normalizeWords(reference)
+  const hyp = normalizeWords(hypothesis)
+  let prev = Array.from({ length: hyp.length + 1 }, (_, j) => j)
+  ref.forEach((refWord, i) => {
+    const cur = [i + 1]
+    hyp.forEach((hypWord, j) => {
+      cur.push(
+        Math.min(
+          prev[j + 1]! + 1,
+          cur[j]! + 1,
+          prev[j]! + (refWord === hypWord ? 0 : 1),
+        ),
+      )
+    })
+    prev = cur
+  })
+  return { errors: prev[hyp.length]!, words: ref.length }
+}
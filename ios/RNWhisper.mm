@@ -106,56 +106,71 @@ RCT_REMAP_METHOD(initContext,
   ];
 }
 
+// Transcribe either the samples in data, or the WAV file at path natively
 - (void)transcribeData:(RNWhisperContext *)context
     withContextId:(int)contextId
     withJobId:(int)jobId
     withData:(float *)data
     withDataCount:(int)count
+    withPath:(NSString *)path
     withOptions:(NSDictionary *)options
     withResolver:(RCTPromiseResolveBlock)resolve
     withRejecter:(RCTPromiseRejectBlock)reject
 {
+    void (^onProgress)(int) = ^(int progress) {
+        std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(jobId);
+        if (job && job->is_aborted()) return;
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self sendEventWithName:@"@RNWhisper_onTranscribeProgress"
+                body:@{
+                    @"contextId": [NSNumber numberWithInt:contextId],
+                    @"jobId": [NSNumber numberWithInt:jobId],
+                    @"progress": [NSNumber numberWithInt:progress]
+                }
+            ];
+        });
+    };
+    void (^onNewSegments)(NSDictionary *) = ^(NSDictionary *result) {
+        std::shared_ptr<rnwhisper::job> job = rnwhisper::job_get(jobId);
+        if (job && job->is_aborted()) return;
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self sendEventWithName:@"@RNWhisper_onTranscribeNewSegments"
+                body:@{
+                    @"contextId": [NSNumber numberWithInt:contextId],
+                    @"jobId": [NSNumber numberWithInt:jobId],
+                    @"result": result
+                }
+            ];
+        });
+    };
+    void (^onEnd)(int, NSMutableDictionary *) = ^(int code, NSMutableDictionary *result) {
+        if (code != 0 && code != 999) {
+            reject(@"whisper_cpp_error", [NSString stringWithFormat:@"Failed to transcribe the file. Code: %d", code], nil);
+            return;
+        }
+        resolve(result);
+    };
+
+    if (path != nil) {
+        BOOL ok = [context transcribeFile:jobId
+            path:path
+            options:options
+            onProgress:onProgress
+            onNewSegments:onNewSegments
+            onEnd:onEnd
+        ];
+        if (!ok) reject(@"whisper_error", @"Invalid file", nil);
+        return;
+    }
     [context transcribeData:jobId
         audioData:data
         audioDataCount:count
         options:options
-        onProgress: ^(int progress) {
-            rnwhisper::job* job = rnwhisper::job_get(jobId);
-            if (job && job->is_aborted()) return;
-
-            dispatch_async(dispatch_get_main_queue(), ^{
-                [self sendEventWithName:@"@RNWhisper_onTranscribeProgress"
-                    body:@{
-                        @"contextId": [NSNumber numberWithInt:contextId],
-                        @"jobId": [NSNumber numberWithInt:jobId],
-                        @"progress": [NSNumber numberWithInt:progress]
-                    }
-                ];
-            });
-        }
-        onNewSegments: ^(NSDictionary *result) {
-            rnwhisper::job* job = rnwhisper::job_get(jobId);
-            if (job && job->is_aborted()) return;
-
-            dispatch_async(dispatch_get_main_queue(), ^{
-                [self sendEventWithName:@"@RNWhisper_onTranscribeNewSegments"
-                    body:@{
-                        @"contextId": [NSNumber numberWithInt:contextId],
-                        @"jobId": [NSNumber numberWithInt:jobId],
-                        @"result": result
-                    }
-                ];
-            });
-        }
-        onEnd: ^(int code) {
-            if (code != 0 && code != 999) {
-                reject(@"whisper_cpp_error", [NSString stringWithFormat:@"Failed to transcribe the file. Code: %d", code], nil);
-                return;
-            }
-            NSMutableDictionary *result = [context getTextSegments];
-            result[@"isAborted"] = @([context isStoppedByAction]);
-            resolve(result);
-        }
+        onProgress:onProgress
+        onNewSegments:onNewSegments
+        onEnd:onEnd
     ];
 }
 
@@ -173,29 +188,25 @@ RCT_REMAP_METHOD(transcribeFile,
         reject(@"whisper_error", @"Context not found", nil);
         return;
     }
-    if ([context isCapturing]) {
-        reject(@"whisper_error", @"The context is in realtime transcribe mode", nil);
-        return;
-    }
-    if ([context isTranscribing]) {
-        reject(@"whisper_error", @"Context is already transcribing", nil);
-        return;
-    }
 
     float *data = nil;
     int count = 0;
+    NSString *path = nil;
     if ([waveFilePathOrDataBase64 hasPrefix:@"http://"] || [waveFilePathOrDataBase64 hasPrefix:@"https://"]) {
-        NSString *path = [RNWhisperDownloader downloadFile:waveFilePathOrDataBase64 toFile:nil];
-        data = [RNWhisperAudioUtils decodeWaveFile:path count:&count];
+        path = [RNWhisperDownloader downloadFile:waveFilePathOrDataBase64 toFile:nil];
+        if (path == nil) {
+            reject(@"whisper_error", @"Invalid file", nil);
+            return;
+        }
     } else if ([waveFilePathOrDataBase64 hasPrefix:@"data:audio/wav;base64,"]) {
         NSData *waveData = [[NSData alloc] initWithBase64EncodedString:[waveFilePathOrDataBase64 substringFromIndex:22] options:0];
         data = [RNWhisperAudioUtils decodeWaveData:waveData count:&count cutHeader:YES];
+        if (data == nil) {
+            reject(@"whisper_error", @"Invalid file", nil);
+            return;
+        }
     } else {
-        data = [RNWhisperAudioUtils decodeWaveFile:waveFilePathOrDataBase64 count:&count];
-    }
-    if (data == nil) {
-        reject(@"whisper_error", @"Invalid file", nil);
-        return;
+        path = waveFilePathOrDataBase64;
     }
 
     [self transcribeData:context
@@ -203,6 +214,7 @@ RCT_REMAP_METHOD(transcribeFile,
         withJobId:jobId
         withData:data
         withDataCount:count
+        withPath:path
         withOptions:options
         withResolver:resolve
         withRejecter:reject
@@ -223,14 +235,6 @@ RCT_REMAP_METHOD(transcribeData,
       reject(@"whisper_error", @"Context not found", nil);
       return;
   }
-  if ([context isCapturing]) {
-      reject(@"whisper_error", @"The context is in realtime transcribe mode", nil);
-      return;
-  }
-  if ([context isTranscribing]) {
-      reject(@"whisper_error", @"Context is already transcribing", nil);
-      return;
-  }
 
   NSData *pcmData = [[NSData alloc] initWithBase64EncodedString:dataBase64 options:0];
   int count = 0;
@@ -246,6 +250,7 @@ RCT_REMAP_METHOD(transcribeData,
       withJobId:jobId
       withData:data
       withDataCount:count
+      withPath:nil
       withOptions:options
       withResolver:resolve
       withRejecter:reject
@@ -334,6 +339,21 @@ RCT_REMAP_METHOD(bench,
     resolve(result);
 }
 
+RCT_REMAP_METHOD(benchJobs,
+                 withContextId:(int)contextId
+                 withMaxThreads:(int)maxThreads
+                 withResolver:(RCTPromiseResolveBlock)resolve
+                 withRejecter:(RCTPromiseRejectBlock)reject)
+{
+    RNWhisperContext *context = contexts[[NSNumber numberWithInt:contextId]];
+    if (context == nil) {
+        reject(@"whisper_error", @"Context not found", nil);
+        return;
+    }
+    NSString *result = [context benchJobs:maxThreads];
+    resolve(result);
+}
+
 RCT_REMAP_METHOD(releaseContext,
                  withContextId:(int)contextId
                  withResolver:(RCTPromiseResolveBlock)resolve
@@ -13,7 +13,7 @@ typedef struct {
     __unsafe_unretained id mSelf;
     NSDictionary* options;
 
-    struct rnwhisper::job * job;
+    std::shared_ptr<rnwhisper::job> job;
 
     bool isTranscribing;
     bool isRealtime;
@@ -43,10 +43,15 @@ typedef struct {
 @interface RNWhisperContext : NSObject {
     int contextId;
     dispatch_queue_t dQueue;
+    // File and data jobs run on their own states, next to each other and to the realtime session
+    dispatch_queue_t fileQueue;
+    dispatch_group_t fileGroup;
+    NSMutableSet<NSNumber *> *fileJobIds;
     struct whisper_context * ctx;
     RNWhisperContextRecordState recordState;
     NSString * reasonNoMetal;
     bool isMetalEnabled;
+    id memoryWarningObserver;
 }
 
 + (instancetype)initWithModelPath:(NSString *)modelPath contextId:(int)contextId noCoreML:(BOOL)noCoreML noMetal:(BOOL)noMetal useFlashAttn:(BOOL)useFlashAttn;
@@ -63,14 +68,21 @@ typedef struct {
     options:(NSDictionary *)options
     onProgress:(void (^)(int))onProgress
     onNewSegments:(void (^)(NSDictionary *))onNewSegments
-    onEnd:(void (^)(int))onEnd;
+    onEnd:(void (^)(int, NSMutableDictionary *))onEnd;
+- (BOOL)transcribeFile:(int)jobId
+    path:(NSString *)path
+    options:(NSDictionary *)options
+    onProgress:(void (^)(int))onProgress
+    onNewSegments:(void (^)(NSDictionary *))onNewSegments
+    onEnd:(void (^)(int, NSMutableDictionary *))onEnd;
 - (void)stopTranscribe:(int)jobId;
 - (void)stopCurrentTranscribe;
 - (bool)isCapturing;
 - (bool)isTranscribing;
 - (bool)isStoppedByAction;
-- (NSMutableDictionary *)getTextSegments;
+- (NSMutableDictionary *)getTextSegments:(rnwhisper::job *)job;
 - (NSString *)bench:(int)maxThreads;
+- (NSString *)benchJobs:(int)maxThreads;
 - (void)invalidate;
 - (void)pauseAudio;
 - (void)resumeAudio;
@@ -1,7 +1,9 @@
 #import "RNWhisperContext.h"
 #import <Metal/Metal.h>
+#import <UIKit/UIKit.h>
 #import <React/RCTLog.h>
 #include <vector>
+#include <memory>
 #include <unicode/ustring.h>
 
 #define NUM_BYTES_PER_BUFFER 16 * 1024
@@ -17,7 +19,7 @@
 {
     RNWhisperContext *context = [[RNWhisperContext alloc] init];
     context->contextId = contextId;
-    struct whisper_context_params cparams;
+    struct whisper_context_params cparams = whisper_context_default_params();
     NSString *reasonNoMetal = @"";
     cparams.use_gpu = !noMetal;
     cparams.flash_attn = useFlashAttn;
@@ -81,8 +83,27 @@
         [[NSString stringWithFormat:@"RNWhisperContext-%d", contextId] UTF8String],
         DISPATCH_QUEUE_SERIAL
     );
+    context->fileQueue = dispatch_queue_create(
+        [[NSString stringWithFormat:@"RNWhisperContext-%d-file", contextId] UTF8String],
+        DISPATCH_QUEUE_CONCURRENT
+    );
+    context->fileGroup = dispatch_group_create();
+    context->fileJobIds = [NSMutableSet set];
     context->isMetalEnabled = cparams.use_gpu;
     context->reasonNoMetal = reasonNoMetal;
+
+    // The idle transcription states kept for reuse are rebuilt on demand, give their memory back when asked
+    struct whisper_context *ctx = context->ctx;
+    if (ctx != NULL) {
+        context->memoryWarningObserver = [[NSNotificationCenter defaultCenter]
+            addObserverForName:UIApplicationDidReceiveMemoryWarningNotification
+            object:nil
+            queue:nil
+            usingBlock:^(NSNotification *note) {
+                whisper_state_pool_trim(ctx, 0);
+            }
+        ];
+    }
     return context;
 }
 
@@ -108,6 +129,8 @@
     params.translate        = options[@"translate"] != nil ? [options[@"translate"] boolValue] : false;
     params.language         = options[@"language"] != nil ? strdup([options[@"language"] UTF8String]) : "auto";
     params.n_threads        = n_threads > 0 ? n_threads : default_n_threads;
+    params.use_threadpool   = options[@"useThreadPool"] != nil ? [options[@"useThreadPool"] boolValue] : true;
+    params.cpu_mask         = options[@"cpuMask"] != nil ? [options[@"cpuMask"] unsignedLongLongValue] : 0;
     params.offset_ms        = 0;
     params.no_context       = false;
     params.split_on_word = false;
@@ -118,6 +141,7 @@
     }
     params.token_timestamps = options[@"tokenTimestamps"] != nil ? [options[@"tokenTimestamps"] boolValue] : false;
     params.tdrz_enable = options[@"tdrzEnable"] != nil ? [options[@"tdrzEnable"] boolValue] : false;
+    params.audio_ctx_auto = options[@"audioCtxAuto"] != nil ? [options[@"audioCtxAuto"] boolValue] : false;
 
     if (options[@"bestOf"] != nil) {
         params.greedy.best_of = [options[@"bestOf"] intValue];
@@ -131,6 +155,9 @@
     if (options[@"duration"] != nil) {
         params.duration_ms = [options[@"duration"] intValue];
     }
+    if (options[@"parallelOverlapMs"] != nil) {
+        params.parallel_overlap_ms = [options[@"parallelOverlapMs"] intValue];
+    }
     if (options[@"wordThold"] != nil) {
         params.thold_pt = [options[@"wordThold"] intValue];
     }
@@ -140,6 +167,12 @@
     if (options[@"temperatureInc"] != nil) {
         params.temperature_inc = [options[@"temperature_inc"] floatValue];
     }
+    if (options[@"topK"] != nil) {
+        params.top_k = [options[@"topK"] intValue];
+    }
+    if (options[@"topP"] != nil) {
+        params.top_p = [options[@"topP"] floatValue];
+    }
     if (options[@"prompt"] != nil) {
         params.initial_prompt = strdup([options[@"prompt"] UTF8String]);
     }
@@ -163,7 +196,7 @@
     return self->dQueue;
 }
 
-- (void)prepareRealtime:(int)jobId options:(NSDictionary *)options {
+- (BOOL)prepareRealtime:(int)jobId options:(NSDictionary *)options {
     self->recordState.options = options;
 
     self->recordState.dataFormat.mSampleRate = WHISPER_SAMPLE_RATE; // 16000
@@ -188,7 +221,8 @@
     self->recordState.sliceNSamples.clear();
     self->recordState.sliceNSamples.push_back(0);
 
-    self->recordState.job = rnwhisper::job_new(jobId, [self createParams:options jobId:jobId]);
+    self->recordState.job = rnwhisper::job_new(jobId, self->ctx, [self createParams:options jobId:jobId]);
+    if (self->recordState.job == nullptr) return NO;
     self->recordState.job->set_realtime_params(
         {
             .use_vad = options[@"useVad"] != nil ? [options[@"useVad"] boolValue] : false,
@@ -205,6 +239,7 @@
 
     self->recordState.currentVolumeLevel = -1;
     self->recordState.mSelf = self;
+    return YES;
 }
 
 bool vad(RNWhisperContextRecordState *state, int sliceIndex, int nSamples, int n)
@@ -328,15 +363,18 @@ void AudioInputCallback(void * inUserData,
 
     // NSLog(@"[custom-RNWhisper] Slice %d has %d samples, put %d samples", state->sliceIndex, nSamples, n);
 
-    // Append to WAV
+    if (!state->job->put_pcm_data((short*) inBuffer->mAudioData, state->sliceIndex, nSamples, n)) {
+        // Transcription is too far behind, drop the buffer
+        AudioQueueEnqueueBuffer(state->queue, inBuffer, 0, NULL);
+        return;
+    }
+
+    // Append to WAV, only the samples that are transcribed
     if (state->wavWriter) {
-        const int n = inBuffer->mAudioDataByteSize / sizeof(short);
         // NSLog(@"[custom-RNWhisper] Append %d samples to WAV", n);
         state->wavWriter->appendSamples((short*) inBuffer->mAudioData, n);
         // NSLog(@"[custom-RNWhisper] Append %d samples to WAV done", n);
     }
-    
-    state->job->put_pcm_data((short*) inBuffer->mAudioData, state->sliceIndex, nSamples, n);
 
     bool isSpeech = vad(state, state->sliceIndex, nSamples, n);
     state->sliceNSamples[state->sliceIndex] += n;
@@ -376,8 +414,10 @@ void AudioInputCallback(void * inUserData,
         NSLog(@"[custom-RNWhisper] Finalize WAV done");
     }
 
-    state->transcribeHandler(state->job->job_id, @"end", result);
-    rnwhisper::job_remove(state->job->job_id);
+    const int jobId = state->job->job_id;
+    state->transcribeHandler(jobId, @"end", result);
+    state->job = nullptr;
+    rnwhisper::job_remove(jobId);
 }
 
 - (void)fullTranscribeSamples:(RNWhisperContextRecordState*) state {
@@ -385,11 +425,8 @@ void AudioInputCallback(void * inUserData,
     state->nSamplesTranscribing = nSamplesOfIndex;
     NSLog(@"[RNWhisper] Transcribing %d samples", state->nSamplesTranscribing);
 
-    float* pcmf32 = state->job->pcm_slice_to_f32(state->transcribeSliceIndex, state->nSamplesTranscribing);
-
     CFTimeInterval timeStart = CACurrentMediaTime();
-    int code = [state->mSelf fullTranscribe:state->job audioData:pcmf32 audioDataCount:state->nSamplesTranscribing];
-    free(pcmf32);
+    int code = [state->mSelf fullTranscribeSlice:state->job.get() sliceIndex:state->transcribeSliceIndex nSamples:state->nSamplesTranscribing];
     CFTimeInterval timeEnd = CACurrentMediaTime();
     const float timeRecording = (float) state->nSamplesTranscribing / (float) state->dataFormat.mSampleRate;
 
@@ -404,7 +441,7 @@ void AudioInputCallback(void * inUserData,
     NSMutableDictionary* result = [base mutableCopy];
 
     if (code == 0) {
-        result[@"data"] = [state->mSelf getTextSegments];
+        result[@"data"] = [state->mSelf getTextSegments:state->job.get()];
     } else {
         result[@"error"] = [NSString stringWithFormat:@"Transcribe failed with code %d", code];
     }
@@ -483,7 +520,10 @@ void AudioInputCallback(void * inUserData,
     NSLog(@"[custom-RNWhisper] Start RealTime transcribe");
     self->recordState.transcribeHandler = onTranscribe;
 
-    [self prepareRealtime:jobId options:options];
+    if (![self prepareRealtime:jobId options:options]) {
+        self->recordState.isRealtime = false;
+        return -1;
+    }
 
     // if (options[@"audioOutputPath"] != nil) {
     //     self->recordState.job->open_raw_file([options[@"audioOutputPath"] UTF8String]);
@@ -542,7 +582,11 @@ void AudioInputCallback(void * inUserData,
 
 - (void)stopTranscribe:(int)jobId {
     NSLog(@"[custom-RNWhisper] Stop transcribe");
-    if (self->recordState.job) self->recordState.job->abort();
+    rnwhisper::job_abort(jobId);
+    @synchronized (self->fileJobIds) {
+        // A file job ends on its own once aborted, the realtime session is left alone
+        if ([self->fileJobIds containsObject:@(jobId)]) return;
+    }
     if (self->recordState.isRealtime && self->recordState.isCapturing) {
         [self stopAudio];
         if (!self->recordState.isTranscribing) {
@@ -572,6 +616,11 @@ void AudioInputCallback(void * inUserData,
 }
 
 - (void)stopCurrentTranscribe {
+    @synchronized (self->fileJobIds) {
+        for (NSNumber *jobId in self->fileJobIds) {
+            rnwhisper::job_abort([jobId intValue]);
+        }
+    }
     if (self->recordState.job == nullptr) return;
     [self stopTranscribe:self->recordState.job->job_id];
 }
@@ -579,16 +628,27 @@ void AudioInputCallback(void * inUserData,
 - (int)fullTranscribe:(rnwhisper::job *)job
   audioData:(float *)audioData
   audioDataCount:(int)audioDataCount
+  nProcessors:(int)nProcessors
 {
-    whisper_reset_timings(self->ctx);
-    int code = whisper_full(self->ctx, job->params, audioData, audioDataCount);
-    if (job && job->is_aborted()) code = -999;
+    int code = nProcessors > 1
+        ? whisper_full_parallel_with_state(self->ctx, job->state, job->params, audioData, audioDataCount, nProcessors)
+        : whisper_full_with_state(self->ctx, job->state, job->params, audioData, audioDataCount);
+    if (job->is_aborted()) code = -999;
     // if (code == 0) {
     //     whisper_print_timings(self->ctx);
     // }
     return code;
 }
 
+- (int)fullTranscribeSlice:(rnwhisper::job *)job
+  sliceIndex:(int)sliceIndex
+  nSamples:(int)nSamples
+{
+    int code = job->transcribe_slice(sliceIndex, nSamples);
+    if (job->is_aborted()) code = -999;
+    return code;
+}
+
 // Helper function to check if a given C-string is valid UTF-8
 static BOOL is_valid_utf8(const char *str) {
     if (!str) return NO;
@@ -606,9 +666,11 @@ struct rnwhisper_segments_callback_data {
     __strong NSMutableData *tempData;
 };
 
-- (NSMutableDictionary *)getTextSegments {
+// Results of a job, it must not be removed yet
+- (NSMutableDictionary *)getTextSegments:(rnwhisper::job *)job {
     NSString *text = @"";
-    int n_segments = whisper_full_n_segments(self->ctx);
+    struct whisper_state *state = job != nullptr ? job->state : nullptr;
+    int n_segments = state != nullptr ? whisper_full_n_segments_from_state(state) : 0;
 
     NSMutableArray *segments = [[NSMutableArray alloc] init];
     // NSLog(@"[custom-RNWhisper] getTextSegments");
@@ -618,7 +680,7 @@ struct rnwhisper_segments_callback_data {
     NSMutableData *tempData = [NSMutableData data];
 
     for (int i = 0; i < n_segments; i++) {
-        const char *text_cur = whisper_full_get_segment_text(self->ctx, i);
+        const char *text_cur = whisper_full_get_segment_text_from_state(state, i);
 
         if (text_cur == NULL) {
             // NSLog(@"[custom-RNWhisper] text_cur is NULL for segment %d", i);
@@ -652,17 +714,16 @@ struct rnwhisper_segments_callback_data {
             // From here, handle speaker turn if needed
             NSMutableString *mutable_ns_text = [NSMutableString stringWithString:ns_text];
 
-            if (self->recordState.options[@"tdrzEnable"] &&
-                [self->recordState.options[@"tdrzEnable"] boolValue] &&
-                whisper_full_get_segment_speaker_turn_next(self->ctx, i)) {
+            if (job->params.tdrz_enable &&
+                whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 [mutable_ns_text appendString:@" [SPEAKER_TURN]"];
             }
 
             // Append the text to the overall text
             text = [text stringByAppendingString:mutable_ns_text];
 
-            const int64_t t0 = whisper_full_get_segment_t0(self->ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(self->ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
 
             NSDictionary *segment = @{
                 @"text": [NSString stringWithString:mutable_ns_text],
@@ -699,8 +760,18 @@ struct rnwhisper_segments_callback_data {
     return result;
 }
 
+- (NSString *)benchJobs:(int)maxThreads {
+    const int n_threads = maxThreads > 0 ? maxThreads : 0;
+    return [NSString stringWithUTF8String:rnwhisper::bench_jobs(self->ctx, n_threads).c_str()];
+}
+
 - (void)invalidate {
     [self stopCurrentTranscribe];
+    dispatch_group_wait(self->fileGroup, DISPATCH_TIME_FOREVER);
+    if (self->memoryWarningObserver != nil) {
+        [[NSNotificationCenter defaultCenter] removeObserver:self->memoryWarningObserver];
+        self->memoryWarningObserver = nil;
+    }
     whisper_free(self->ctx);
 }
 
@@ -711,12 +782,60 @@ struct rnwhisper_segments_callback_data {
     options:(NSDictionary *)options
     onProgress:(void (^)(int))onProgress
     onNewSegments:(void (^)(NSDictionary *))onNewSegments
-    onEnd:(void (^)(int))onEnd
+    onEnd:(void (^)(int, NSMutableDictionary *))onEnd
+{
+    int nProcessors = options[@"nProcessors"] != nil ? [options[@"nProcessors"] intValue] : 1;
+    [self transcribe:jobId
+        options:options
+        onProgress:onProgress
+        onNewSegments:onNewSegments
+        onEnd:onEnd
+        run:^int(rnwhisper::job *job) {
+            return [self fullTranscribe:job audioData:audioData audioDataCount:audioDataCount nProcessors:nProcessors];
+        }
+    ];
+}
+
+- (BOOL)transcribeFile:(int)jobId
+    path:(NSString *)path
+    options:(NSDictionary *)options
+    onProgress:(void (^)(int))onProgress
+    onNewSegments:(void (^)(NSDictionary *))onNewSegments
+    onEnd:(void (^)(int, NSMutableDictionary *))onEnd
 {
-    dispatch_async(dQueue, ^{
-        self->recordState.isStoppedByAction = false;
-        self->recordState.isTranscribing = true;
+    // The file is mapped and transcribed window by window, long files don't need to fit in memory
+    // With nProcessors > 1, the chunks of the mapped file are transcribed in parallel instead
+    auto wav = std::make_shared<rnaudioutils::WavFileMap>();
+    if (!wav->open([path UTF8String])) return NO;
+
+    int nProcessors = options[@"nProcessors"] != nil ? [options[@"nProcessors"] intValue] : 1;
+    [self transcribe:jobId
+        options:options
+        onProgress:onProgress
+        onNewSegments:onNewSegments
+        onEnd:onEnd
+        run:^int(rnwhisper::job *job) {
+            int code = nProcessors > 1
+                ? whisper_full_i16_parallel_with_state(self->ctx, job->state, job->params, wav->samples(), wav->nSamples(), nProcessors)
+                : whisper_full_i16_windowed_with_state(self->ctx, job->state, job->params, wav->samples(), wav->nSamples());
+            if (job->is_aborted()) code = -999;
+            return code;
+        }
+    ];
+    return YES;
+}
 
+- (void)transcribe:(int)jobId
+    options:(NSDictionary *)options
+    onProgress:(void (^)(int))onProgress
+    onNewSegments:(void (^)(NSDictionary *))onNewSegments
+    onEnd:(void (^)(int, NSMutableDictionary *))onEnd
+    run:(int (^)(rnwhisper::job *))run
+{
+    @synchronized (self->fileJobIds) {
+        [self->fileJobIds addObject:@(jobId)];
+    }
+    dispatch_group_async(fileGroup, fileQueue, ^{
         whisper_full_params params = [self createParams:options jobId:jobId];
 
         if (options[@"onProgress"] && [options[@"onProgress"] boolValue]) {
@@ -735,7 +854,7 @@ struct rnwhisper_segments_callback_data {
             user_data->total_n_new = 0;
             user_data->tempData = [NSMutableData data];
 
-            params.new_segment_callback = [](struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * ud) {
+            params.new_segment_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * state, int n_new, void * ud) {
                 struct rnwhisper_segments_callback_data *data = (struct rnwhisper_segments_callback_data *)ud;
                 data->total_n_new += n_new;
 
@@ -745,7 +864,7 @@ struct rnwhisper_segments_callback_data {
                 NSMutableData *tempData = data->tempData;
 
                 for (int i = data->total_n_new - n_new; i < data->total_n_new; i++) {
-                    const char *text_cur = whisper_full_get_segment_text(ctx, i);
+                    const char *text_cur = whisper_full_get_segment_text_from_state(state, i);
                     if (text_cur == NULL) {
                         // NSLog(@"[custom-RNWhisper] text_cur is NULL for segment %d", i);
                         continue;
@@ -769,14 +888,14 @@ struct rnwhisper_segments_callback_data {
                         [tempData setLength:0];
 
                         NSMutableString *mutable_ns_text = [NSMutableString stringWithString:ns_text];
-                        if (data->tdrzEnable && whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+                        if (data->tdrzEnable && whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                             [mutable_ns_text appendString:@" [SPEAKER_TURN]"];
                         }
 
                         combinedText = [combinedText stringByAppendingString:mutable_ns_text];
 
-                        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
 
                         NSDictionary *segment = @{
                             @"text": [NSString stringWithString:mutable_ns_text],
@@ -807,12 +926,16 @@ struct rnwhisper_segments_callback_data {
         }
 
 
-        rnwhisper::job* job = rnwhisper::job_new(jobId, params);
-        self->recordState.job = job;
-        int code = [self fullTranscribe:job audioData:audioData audioDataCount:audioDataCount];
+        std::shared_ptr<rnwhisper::job> job = rnwhisper::job_new(jobId, self->ctx, params);
+        int code = job != nullptr ? run(job.get()) : -1;
+        // The results are read from the state of the job before it's removed
+        NSMutableDictionary *result = [self getTextSegments:job.get()];
+        result[@"isAborted"] = @(job != nullptr && job->is_aborted());
+        onEnd(code, result);
         rnwhisper::job_remove(jobId);
-        self->recordState.isTranscribing = false;
-        onEnd(code);
+        @synchronized (self->fileJobIds) {
+            [self->fileJobIds removeObject:@(jobId)];
+        }
     });
 }
 @end
@@ -9,6 +9,10 @@ export type TranscribeOptions = {
   translate?: boolean
   /** Number of threads to use during computation (Default: 2 for 4-core devices, 4 for more cores) */
   maxThreads?: number
+  /** Keep the worker threads alive between transcriptions of the context (Default: true) */
+  useThreadPool?: boolean
+  /** Bitmask of the CPU cores the thread pool may run on, bit N = core N, up to core 52 (exact in a JS number) (Default: 0, no pinning) */
+  cpuMask?: number
   /** Maximum number of text context tokens to store */
   maxContext?: number
   /** Maximum segment length in characters */
@@ -17,15 +21,30 @@ export type TranscribeOptions = {
   tokenTimestamps?: boolean
   /** Enable tinydiarize (requires a tdrz model) */
   tdrzEnable?: boolean
+  /** Shrink the encoder context to the audio length for audio shorter than 30 s, faster but may reduce accuracy (Default: false) */
+  audioCtxAuto?: boolean
   /** Word timestamp probability threshold */
   wordThold?: number
   /** Time offset in milliseconds */
   offset?: number
   /** Duration of audio to process in milliseconds */
   duration?: number
+  /** Transcribe a file or buffer as that many chunks split at quiet points, decoded in parallel (Default: 1) */
+  nProcessors?: number
+  /** With nProcessors > 1, audio decoded past each split on both sides, the text decoded twice is kept once (Default: 0) */
+  parallelOverlapMs?: number
   /** Tnitial decoding temperature */
   temperature?: number
+  /**
+   * Temperature increase for the fallback decodes when a decode fails.
+   * Note: since the sampler rewrite, runs sampled at temperature > 0 draw from the same distribution
+   * but use the random stream differently, so their output differs from earlier versions.
+   */
   temperatureInc?: number
+  /** Sample only from the most likely tokens at temperature > 0, beam search candidates are not restricted (Default: 0, all tokens) */
+  topK?: number
+  /** Sample only from the most likely tokens whose probabilities add up to topP at temperature > 0, beam search candidates are not restricted (Default: 1.0, all tokens) */
+  topP?: number
   /** Beam size for beam search */
   beamSize?: number
   /** Number of best candidates to keep */
@@ -102,6 +121,9 @@ export interface Spec extends TurboModule {
 
   bench(contextId: number, maxThreads: number): Promise<string>
 
+  // Throughput of 1, 2 and 4 jobs running at the same time on the context
+  benchJobs(contextId: number, maxThreads: number): Promise<string>
+
   // iOS specific
   getAudioSessionCurrentCategory: () => Promise<{
     category: string
@@ -195,6 +195,13 @@ export type BenchResult = {
   promptMs: number
 }
 
+export type BenchJobsResult = {
+  config: string
+  nThreads: number
+  /** Jobs per second with 1, 2 and 4 jobs running at the same time, each on its own state */
+  jobsPerSec: number[]
+}
+
 const updateAudioSession = async (setting: AudioSessionSettingIos) => {
   await AudioSessionIos.setCategory(setting.category, setting.options || [])
   if (setting.mode) {
@@ -297,6 +304,7 @@ export class WhisperContext {
   /**
    * Transcribe audio file (path or base64 encoded wav file)
    * base64: need add `data:audio/wav;base64,` prefix
+   * Each transcription runs on its own state, it can run next to other ones and a realtime session of the context
    */
   transcribe(
     filePathOrBase64: string | number,
@@ -504,6 +512,12 @@ export class WhisperContext {
     } as BenchResult
   }
 
+  async benchJobs(maxThreads: number): Promise<BenchJobsResult> {
+    const result = await RNWhisper.benchJobs(this.id, maxThreads)
+    const [config, nThreads, ...jobsPerSec] = JSON.parse(result)
+    return { config, nThreads, jobsPerSec } as BenchJobsResult
+  }
+
   async release(): Promise<void> {
     return RNWhisper.releaseContext(this.id)
   }